@@ -1,23 +1,56 @@
 #include "armv6m.h"
 #include "common.h"
 #include "ir.h"
+#include "optimizer.h"
+#include "parser.h"
 #include "symbols.h"
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <strings.h>
 
 #define NVIC_ISER 0xe000e100
 #define NVIC_ICPR 0xe000e280
+#define NVIC_IPR 0xe000e400
+// each IPR word has the priorities of four interrupts, in the top two bits of each byte
+#define NVIC_IPR_WORDS 8
+#define NVIC_PRIORITY_SHIFT 6
+#define SCB_SCR 0xe000ed10
+#define SCR_SLEEPONEXIT (1 << 1)
+#define SCR_SLEEPDEEP (1 << 2)
+#define SYST_CSR 0xe000e010
+#define SYST_RVR 0xe000e014
+#define SYST_CVR 0xe000e018
+// count with the core clock, interrupt on each tick, and start
+#define SYST_CSR_START 0b111
+#define SYST_MAX_RELOAD 0xffffff
+// 1ms at the 1MHz that the SAMD21 starts up with
+#define DEFAULT_TICK_CYCLES 1000
 
 #define R_ARG1 0
 #define R_ARG2_DEST 1 // could probably combine arg2 and dest registers
 #define R_TEMP_OFFSET 2
 #define R_SP 13
+#define R_LR 14
+// temps in r4 and up must be kept for whatever an interrupt handler interrupted
+#define R_CALLEE_SAVED_FIRST 4
+// With --gp, r7 holds RAM_BASE_ADDRESS instead of a temp. It is set at the start of
+// ____init, before any interrupt is enabled, and nothing writes it after that, so
+// interrupt handlers can use it without saving or setting it.
+#define R_GP 7
+
+// SUB/ADD SP can only move the stack pointer by 127 words
+#define MAX_FRAME_SIZE 127
+// worst_case_cycles gives up on calls nested deeper than this (e.g. recursion)
+#define MAX_CALL_DEPTH 8
 
 #define C_ALWAYS 0b1110
 #define C_EQUALS 0b0000
 #define C_LESSTHAN 0b1011
 #define C_GREATERTHAN 0b1100
+#define C_NOTEQUALS 0b0001
+#define C_CARRYSET 0b0010
+#define C_CARRYCLEAR 0b0011
 
 #define ADDS_OPCODE 0b0001100
 #define ADDS_OPCODE_OFFSET 9
@@ -25,6 +58,12 @@
 #define ADDS_IMM_OPCODE_OFFSET 11
 #define ADD_SP_IMM_OPCODE 0b101100000
 #define ADD_SP_IMM_OPCODE_OFFSET 7
+#define ADD_SP_R_OPCODE 0b0100010001101
+#define ADD_SP_R_OPCODE_OFFSET 3
+#define ADD_PC_R_OPCODE 0b010001001
+#define ADD_PC_R_OPCODE_OFFSET 7
+#define ADD_R_SP_IMM_OPCODE 0b10101
+#define ADD_R_SP_IMM_OPCODE_OFFSET 11
 #define SUBS_OPCODE 0b0001101
 #define SUBS_OPCODE_OFFSET 9
 #define SUBS_IMM_OPCODE 0b00111
@@ -35,16 +74,30 @@
 #define MOV_OPCODE_OFFSET 11
 #define MOV_R_OPCODE 0b01000110
 #define MOV_R_OPCODE_OFFSET 8
+#define BX_OPCODE 0b010001110
+#define BX_OPCODE_OFFSET 7
 #define LSLS_OPCODE 0b00000
 #define LSLS_OPCODE_OFFSET 11
 #define LSLS_R_OPCODE 0b0100000010
 #define LSLS_R_OPCODE_OFFSET 6
-#define ASRS_R_OPCODE 0b0100000100
-#define ASRS_R_OPCODE_OFFSET 6
+#define LSRS_OPCODE 0b00001
+#define LSRS_OPCODE_OFFSET 11
+#define LSRS_R_OPCODE 0b0100000011
+#define LSRS_R_OPCODE_OFFSET 6
 #define ANDS_OPCODE 0b0100000000
 #define ANDS_OPCODE_OFFSET 6
 #define ORRS_OPCODE 0b0100001100
 #define ORRS_OPCODE_OFFSET 6
+#define EORS_OPCODE 0b0100000001
+#define EORS_OPCODE_OFFSET 6
+#define MVNS_OPCODE 0b0100001111
+#define MVNS_OPCODE_OFFSET 6
+#define BICS_OPCODE 0b0100001110
+#define BICS_OPCODE_OFFSET 6
+#define MULS_OPCODE 0b0100001101
+#define MULS_OPCODE_OFFSET 6
+#define ADCS_OPCODE 0b0100000101
+#define ADCS_OPCODE_OFFSET 6
 #define STR_OPCODE 0b01100
 #define STR_OPCODE_OFFSET 11
 #define STRH_OPCODE 0b10000
@@ -57,11 +110,55 @@
 #define LDRH_OPCODE_OFFSET 11
 #define LDRB_OPCODE 0b01111
 #define LDRB_OPCODE_OFFSET 11
+#define STR_R_OPCODE 0b0101000
+#define STR_R_OPCODE_OFFSET 9
+#define STRH_R_OPCODE 0b0101001
+#define STRH_R_OPCODE_OFFSET 9
+#define STRB_R_OPCODE 0b0101010
+#define STRB_R_OPCODE_OFFSET 9
+#define LDR_R_OPCODE 0b0101100
+#define LDR_R_OPCODE_OFFSET 9
+#define LDRH_R_OPCODE 0b0101101
+#define LDRH_R_OPCODE_OFFSET 9
+#define LDRB_R_OPCODE 0b0101110
+#define LDRB_R_OPCODE_OFFSET 9
 #define CMP_OPCODE 0b0100001010
 #define CMP_OPCODE_OFFSET 6
+#define CMP_IMM_OPCODE 0b00101
+#define CMP_IMM_OPCODE_OFFSET 11
+#define HINT_OPCODE 0b10111111
+#define HINT_OPCODE_OFFSET 8
+#define HINT_NOP 0b0000
+#define HINT_WFE 0b0010
+#define HINT_WFI 0b0011
+#define HINT_SEV 0b0100
+#define REV_OPCODE 0b1011101000
+#define REV_OPCODE_OFFSET 6
+#define REV16_OPCODE 0b1011101001
+#define REV16_OPCODE_OFFSET 6
+#define REVSH_OPCODE 0b1011101011
+#define REVSH_OPCODE_OFFSET 6
+#define CPS_OPCODE 0b10110110011
+#define CPS_OPCODE_OFFSET 5
+#define CPS_DISABLE 0b1
+#define CPS_I 0b0010
+#define BARRIER_INIT 0b1111001110111111
+#define BARRIER_OPCODE 0b10001111
+#define BARRIER_OPCODE_OFFSET 8
+#define BARRIER_DSB 0b0100
+#define BARRIER_DMB 0b0101
+#define BARRIER_ISB 0b0110
+#define BARRIER_SY 0b1111
 #define MRS_INIT 0b1111001111101111
 #define MRS_OPCODE 0b1000
 #define MRS_OPCODE_OFFSET 12
+// the first half of MSR has the source register in its low bits
+#define MSR_INIT 0b1111001110000000
+#define MSR_OPCODE 0b10001000
+#define MSR_OPCODE_OFFSET 8
+#define SYSM_PRIMASK 0b00010000
+#define STMIA_OPCODE 0b11000
+#define STMIA_OPCODE_OFFSET 11
 #define PUSH_OPCODE 0b1011010
 #define PUSH_OPCODE_OFFSET 9
 #define POP_OPCODE 0b1011110
@@ -83,6 +180,9 @@ void add_armv6m_inst(ARMv6Op op, MachineCodeFunction *code_func) {
         op.label = next_label;
         next_label = 0;
     }
+    if (code_func->len == MAX_FUNCTION_OPS) {
+        PANIC("Function is too big: maximum is %d instructions\n", MAX_FUNCTION_OPS);
+    }
     code_func->ops[code_func->len] = op;
     code_func->len++;
 }
@@ -102,6 +202,22 @@ void add_sp_imm(int imm, MachineCodeFunction *code_func) {
     op.code = (ADD_SP_IMM_OPCODE << ADD_SP_IMM_OPCODE_OFFSET) | (imm);
     add_armv6m_inst(op, code_func);
 }
+void add_sp_r(int rdm, MachineCodeFunction *code_func) {
+    ARMv6Op op = {0};
+    op.code = (ADD_SP_R_OPCODE << ADD_SP_R_OPCODE_OFFSET) | (rdm);
+    add_armv6m_inst(op, code_func);
+}
+// ADD PC, Rm: jumps forward by Rm bytes from 4 bytes past this instruction
+void add_pc_r(int rm, MachineCodeFunction *code_func) {
+    ARMv6Op op = {0};
+    op.code = (ADD_PC_R_OPCODE << ADD_PC_R_OPCODE_OFFSET) | (rm << 3) | 0b111;
+    add_armv6m_inst(op, code_func);
+}
+void add_r_sp_imm(int rd, int imm, MachineCodeFunction *code_func) {
+    ARMv6Op op = {0};
+    op.code = (ADD_R_SP_IMM_OPCODE << ADD_R_SP_IMM_OPCODE_OFFSET) | (rd << 8) | (imm);
+    add_armv6m_inst(op, code_func);
+}
 void subs(int rd, int rn, int rm, MachineCodeFunction *code_func) {
     ARMv6Op op = {0};
     op.code = (SUBS_OPCODE << SUBS_OPCODE_OFFSET) | (rm << 6) | (rn << 3) | (rd);
@@ -129,6 +245,11 @@ void mov_r(int rd, int rm, MachineCodeFunction *code_func) {
     op.code = (MOV_R_OPCODE << MOV_R_OPCODE_OFFSET) | (D << 7) | (rm << 3) | (rd_short);
     add_armv6m_inst(op, code_func);
 }
+void bx(int rm, MachineCodeFunction *code_func) {
+    ARMv6Op op = {0};
+    op.code = (BX_OPCODE << BX_OPCODE_OFFSET) | (rm << 3);
+    add_armv6m_inst(op, code_func);
+}
 void lsls(int rd, int rm, int imm, MachineCodeFunction *code_func) {
     ARMv6Op op = {0};
     op.code = (LSLS_OPCODE << LSLS_OPCODE_OFFSET) | (imm << 6) | (rm << 3) | (rd);
@@ -139,9 +260,14 @@ void lsls_r(int rdn, int rm, MachineCodeFunction *code_func) {
     op.code = (LSLS_R_OPCODE << LSLS_R_OPCODE_OFFSET) | (rm << 3) | (rdn);
     add_armv6m_inst(op, code_func);
 }
-void asrs_r(int rdn, int rm, MachineCodeFunction *code_func) {
+void lsrs(int rd, int rm, int imm, MachineCodeFunction *code_func) {
     ARMv6Op op = {0};
-    op.code = (ASRS_R_OPCODE << ASRS_R_OPCODE_OFFSET) | (rm << 3) | (rdn);
+    op.code = (LSRS_OPCODE << LSRS_OPCODE_OFFSET) | (imm << 6) | (rm << 3) | (rd);
+    add_armv6m_inst(op, code_func);
+}
+void lsrs_r(int rdn, int rm, MachineCodeFunction *code_func) {
+    ARMv6Op op = {0};
+    op.code = (LSRS_R_OPCODE << LSRS_R_OPCODE_OFFSET) | (rm << 3) | (rdn);
     add_armv6m_inst(op, code_func);
 }
 void ands(int rd, int rm, MachineCodeFunction *code_func) {
@@ -154,6 +280,31 @@ void orrs(int rd, int rm, MachineCodeFunction *code_func) {
     op.code = (ORRS_OPCODE << ORRS_OPCODE_OFFSET) | (rm << 3) | (rd);
     add_armv6m_inst(op, code_func);
 }
+void eors(int rdn, int rm, MachineCodeFunction *code_func) {
+    ARMv6Op op = {0};
+    op.code = (EORS_OPCODE << EORS_OPCODE_OFFSET) | (rm << 3) | (rdn);
+    add_armv6m_inst(op, code_func);
+}
+void mvns(int rd, int rm, MachineCodeFunction *code_func) {
+    ARMv6Op op = {0};
+    op.code = (MVNS_OPCODE << MVNS_OPCODE_OFFSET) | (rm << 3) | (rd);
+    add_armv6m_inst(op, code_func);
+}
+void bics(int rdn, int rm, MachineCodeFunction *code_func) {
+    ARMv6Op op = {0};
+    op.code = (BICS_OPCODE << BICS_OPCODE_OFFSET) | (rm << 3) | (rdn);
+    add_armv6m_inst(op, code_func);
+}
+void muls(int rdm, int rn, MachineCodeFunction *code_func) {
+    ARMv6Op op = {0};
+    op.code = (MULS_OPCODE << MULS_OPCODE_OFFSET) | (rn << 3) | (rdm);
+    add_armv6m_inst(op, code_func);
+}
+void adcs(int rdn, int rm, MachineCodeFunction *code_func) {
+    ARMv6Op op = {0};
+    op.code = (ADCS_OPCODE << ADCS_OPCODE_OFFSET) | (rm << 3) | (rdn);
+    add_armv6m_inst(op, code_func);
+}
 void str(int rt, int rn, int imm, MachineCodeFunction *code_func) {
     ARMv6Op op = {0};
     op.code = (STR_OPCODE << STR_OPCODE_OFFSET) | (imm << 6) | (rn << 3) | (rt);
@@ -184,11 +335,46 @@ void ldrb(int rt, int rn, int imm, MachineCodeFunction *code_func) {
     op.code = (LDRB_OPCODE << LDRB_OPCODE_OFFSET) | (imm << 6) | (rn << 3) | (rt);
     add_armv6m_inst(op, code_func);
 }
+void str_r(int rt, int rn, int rm, MachineCodeFunction *code_func) {
+    ARMv6Op op = {0};
+    op.code = (STR_R_OPCODE << STR_R_OPCODE_OFFSET) | (rm << 6) | (rn << 3) | (rt);
+    add_armv6m_inst(op, code_func);
+}
+void strh_r(int rt, int rn, int rm, MachineCodeFunction *code_func) {
+    ARMv6Op op = {0};
+    op.code = (STRH_R_OPCODE << STRH_R_OPCODE_OFFSET) | (rm << 6) | (rn << 3) | (rt);
+    add_armv6m_inst(op, code_func);
+}
+void strb_r(int rt, int rn, int rm, MachineCodeFunction *code_func) {
+    ARMv6Op op = {0};
+    op.code = (STRB_R_OPCODE << STRB_R_OPCODE_OFFSET) | (rm << 6) | (rn << 3) | (rt);
+    add_armv6m_inst(op, code_func);
+}
+void ldr_r(int rt, int rn, int rm, MachineCodeFunction *code_func) {
+    ARMv6Op op = {0};
+    op.code = (LDR_R_OPCODE << LDR_R_OPCODE_OFFSET) | (rm << 6) | (rn << 3) | (rt);
+    add_armv6m_inst(op, code_func);
+}
+void ldrh_r(int rt, int rn, int rm, MachineCodeFunction *code_func) {
+    ARMv6Op op = {0};
+    op.code = (LDRH_R_OPCODE << LDRH_R_OPCODE_OFFSET) | (rm << 6) | (rn << 3) | (rt);
+    add_armv6m_inst(op, code_func);
+}
+void ldrb_r(int rt, int rn, int rm, MachineCodeFunction *code_func) {
+    ARMv6Op op = {0};
+    op.code = (LDRB_R_OPCODE << LDRB_R_OPCODE_OFFSET) | (rm << 6) | (rn << 3) | (rt);
+    add_armv6m_inst(op, code_func);
+}
 void cmp(int rm, int rn, MachineCodeFunction *code_func) {
     ARMv6Op op = {0};
     op.code = (CMP_OPCODE << CMP_OPCODE_OFFSET) | (rm << 3) | (rn);
     add_armv6m_inst(op, code_func);
 }
+void cmp_imm(int rn, int imm, MachineCodeFunction *code_func) {
+    ARMv6Op op = {0};
+    op.code = (CMP_IMM_OPCODE << CMP_IMM_OPCODE_OFFSET) | (rn << 8) | (imm);
+    add_armv6m_inst(op, code_func);
+}
 void mrs(int rd, int spec_reg, MachineCodeFunction *code_func) {
     ARMv6Op op = {0};
     op.code = MRS_INIT;
@@ -196,6 +382,53 @@ void mrs(int rd, int spec_reg, MachineCodeFunction *code_func) {
     op.code = (MRS_OPCODE << MRS_OPCODE_OFFSET) | (rd << 8) | (spec_reg);
     add_armv6m_inst(op, code_func);
 }
+void msr(int spec_reg, int rn, MachineCodeFunction *code_func) {
+    ARMv6Op op = {0};
+    op.code = MSR_INIT | rn;
+    add_armv6m_inst(op, code_func);
+    op.code = (MSR_OPCODE << MSR_OPCODE_OFFSET) | (spec_reg);
+    add_armv6m_inst(op, code_func);
+}
+void hint(int hint, MachineCodeFunction *code_func) {
+    ARMv6Op op = {0};
+    op.code = (HINT_OPCODE << HINT_OPCODE_OFFSET) | (hint << 4);
+    add_armv6m_inst(op, code_func);
+}
+void rev(int rd, int rm, MachineCodeFunction *code_func) {
+    ARMv6Op op = {0};
+    op.code = (REV_OPCODE << REV_OPCODE_OFFSET) | (rm << 3) | (rd);
+    add_armv6m_inst(op, code_func);
+}
+void rev16(int rd, int rm, MachineCodeFunction *code_func) {
+    ARMv6Op op = {0};
+    op.code = (REV16_OPCODE << REV16_OPCODE_OFFSET) | (rm << 3) | (rd);
+    add_armv6m_inst(op, code_func);
+}
+void revsh(int rd, int rm, MachineCodeFunction *code_func) {
+    ARMv6Op op = {0};
+    op.code = (REVSH_OPCODE << REVSH_OPCODE_OFFSET) | (rm << 3) | (rd);
+    add_armv6m_inst(op, code_func);
+}
+// CPSID i (disable is 1) or CPSIE i (disable is 0)
+void cps(int disable, MachineCodeFunction *code_func) {
+    ARMv6Op op = {0};
+    op.code = (CPS_OPCODE << CPS_OPCODE_OFFSET) | (disable << 4) | CPS_I;
+    add_armv6m_inst(op, code_func);
+}
+void barrier(int type, MachineCodeFunction *code_func) {
+    ARMv6Op op = {0};
+    op.code = BARRIER_INIT;
+    add_armv6m_inst(op, code_func);
+    op.code = (BARRIER_OPCODE << BARRIER_OPCODE_OFFSET) | (type << 4) | BARRIER_SY;
+    add_armv6m_inst(op, code_func);
+}
+// STMIA rn!, {reg_list}: stores the registers to consecutive words, lowest register first,
+// and leaves rn pointing after the last one
+void stmia(int rn, int reg_list, MachineCodeFunction *code_func) {
+    ARMv6Op op = {0};
+    op.code = (STMIA_OPCODE << STMIA_OPCODE_OFFSET) | (rn << 8) | (reg_list);
+    add_armv6m_inst(op, code_func);
+}
 void push(int r, MachineCodeFunction *code_func) {
     ARMv6Op op = {0};
     op.code = (PUSH_OPCODE << PUSH_OPCODE_OFFSET) | (1 << r);
@@ -216,6 +449,17 @@ void pop_pc(MachineCodeFunction *code_func) {
     op.code = (POP_OPCODE << POP_OPCODE_OFFSET) | (1 << 8);
     add_armv6m_inst(op, code_func);
 }
+// reg_list has bit n set for register n, and bit 8 for LR (push) or PC (pop)
+void push_list(int reg_list, MachineCodeFunction *code_func) {
+    ARMv6Op op = {0};
+    op.code = (PUSH_OPCODE << PUSH_OPCODE_OFFSET) | (reg_list);
+    add_armv6m_inst(op, code_func);
+}
+void pop_list(int reg_list, MachineCodeFunction *code_func) {
+    ARMv6Op op = {0};
+    op.code = (POP_OPCODE << POP_OPCODE_OFFSET) | (reg_list);
+    add_armv6m_inst(op, code_func);
+}
 void bl(int target_function, MachineCodeFunction *code_func) {
     ARMv6Op op = {0};
     op.target_function = target_function;
@@ -235,10 +479,208 @@ void b(int cond, int target_label, MachineCodeFunction *code_func) {
     }
     add_armv6m_inst(op, code_func);
 }
+// A conditional branch over the next instruction
+void b_skip_next(int cond, MachineCodeFunction *code_func) {
+    ARMv6Op op = {0};
+    op.code = (B_OPCODE << B_OPCODE_OFFSET) | (cond << 8);
+    add_armv6m_inst(op, code_func);
+}
+
+// The names of the condition codes, indexed by their encoding. These are the suffixes of
+// conditional branches in asm blocks, e.g. "BNE".
+char *condition_names[] = {"EQ", "NE", "CS", "CC", "MI", "PL", "VS", "VC", "HI", "LS", "GE", "LT", "GT", "LE"};
+#define CONDITIONS_NUM 14
+
+bool asm_mnemonic_is(AsmInstruction *inst, char *name) {
+    return inst->mnemonic.len == (int)strlen(name) && strncasecmp(inst->mnemonic.str, name, inst->mnemonic.len) == 0;
+}
+// Returns the condition of a conditional branch mnemonic, e.g. "BNE", or -1
+int asm_branch_condition(AsmInstruction *inst) {
+    if (inst->mnemonic.len != 3 || (inst->mnemonic.str[0] != 'B' && inst->mnemonic.str[0] != 'b')) {
+        return -1;
+    }
+    for (int cond = 0; cond < CONDITIONS_NUM; cond++) {
+        if (strncasecmp(inst->mnemonic.str + 1, condition_names[cond], 2) == 0) {
+            return cond;
+        }
+    }
+    return -1;
+}
+// Returns true if the operands of an instruction have the given form, one character per
+// operand: "r" is a register, "i" an immediate and "l" a label. "R" and "I" are a
+// register and an immediate inside an address, e.g. "[r2, 4]" is "RI".
+bool asm_operands_are(AsmInstruction *inst, char *form) {
+    if ((int)strlen(form) != inst->operands_num) {
+        return false;
+    }
+    for (int i = 0; i < inst->operands_num; i++) {
+        AsmOperand *operand = &inst->operands[i];
+        char c = form[i];
+        bool in_brackets = c == 'R' || c == 'I';
+        AsmOperandType type = (c == 'r' || c == 'R') ? asm_register : (c == 'l' ? asm_label : asm_immediate);
+        if (operand->type != type || operand->in_brackets != in_brackets) {
+            return false;
+        }
+    }
+    return true;
+}
+// Returns the immediate operand i of an instruction divided by scale, checking that it is
+// a multiple of scale and fits in an encoding that goes up to max (after scaling)
+int asm_immediate_value(AsmInstruction *inst, int i, int max, int scale) {
+    int imm = inst->operands[i].value;
+    if (imm < 0 || imm % scale != 0 || imm / scale > max) {
+        STRINGREF_TO_CSTR1(&inst->mnemonic, 512);
+        PANIC("Immediate %d is out of range for asm instruction '%s'\n", imm, cstr1);
+    }
+    return imm / scale;
+}
+// Encodes a load or store in an asm block, e.g. "LDR r2, [r3, 4]". size is the access
+// size in bytes and the offset is a multiple of it.
+void asm_load_store_to_armv6m(AsmInstruction *inst, bool load, int size, MachineCodeFunction *code_func) {
+    AsmOperand *o = inst->operands;
+    if (asm_operands_are(inst, "rRR")) {
+        if (load && size == 4) {
+            ldr_r(o[0].value, o[1].value, o[2].value, code_func);
+        } else if (load && size == 2) {
+            ldrh_r(o[0].value, o[1].value, o[2].value, code_func);
+        } else if (load) {
+            ldrb_r(o[0].value, o[1].value, o[2].value, code_func);
+        } else if (size == 4) {
+            str_r(o[0].value, o[1].value, o[2].value, code_func);
+        } else if (size == 2) {
+            strh_r(o[0].value, o[1].value, o[2].value, code_func);
+        } else {
+            strb_r(o[0].value, o[1].value, o[2].value, code_func);
+        }
+        return;
+    }
+    int imm = 0;
+    if (asm_operands_are(inst, "rRI")) {
+        imm = asm_immediate_value(inst, 2, 31, size);
+    } else if (!asm_operands_are(inst, "rR")) {
+        STRINGREF_TO_CSTR1(&inst->mnemonic, 512);
+        PANIC("Invalid operands for asm instruction '%s'\n", cstr1);
+    }
+    if (load && size == 4) {
+        ldr(o[0].value, o[1].value, imm, code_func);
+    } else if (load && size == 2) {
+        ldrh(o[0].value, o[1].value, imm, code_func);
+    } else if (load) {
+        ldrb(o[0].value, o[1].value, imm, code_func);
+    } else if (size == 4) {
+        str(o[0].value, o[1].value, imm, code_func);
+    } else if (size == 2) {
+        strh(o[0].value, o[1].value, imm, code_func);
+    } else {
+        strb(o[0].value, o[1].value, imm, code_func);
+    }
+}
+// Encodes one instruction of an asm block. The operands are already registers, immediates
+// and label numbers, so this only has to pick the encoding.
+void asm_instruction_to_armv6m(AsmInstruction *inst, MachineCodeFunction *code_func) {
+    AsmOperand *o = inst->operands;
+    int cond = asm_branch_condition(inst);
+    STRINGREF_TO_CSTR1(&inst->mnemonic, 512);
+    if (asm_mnemonic_is(inst, "ADDS") && asm_operands_are(inst, "rrr")) {
+        adds(o[0].value, o[1].value, o[2].value, code_func);
+    } else if (asm_mnemonic_is(inst, "ADDS") && asm_operands_are(inst, "rr")) {
+        adds(o[0].value, o[0].value, o[1].value, code_func);
+    } else if (asm_mnemonic_is(inst, "ADDS") && asm_operands_are(inst, "ri")) {
+        adds_imm(o[0].value, asm_immediate_value(inst, 1, 0xFF, 1), code_func);
+    } else if (asm_mnemonic_is(inst, "SUBS") && asm_operands_are(inst, "rrr")) {
+        subs(o[0].value, o[1].value, o[2].value, code_func);
+    } else if (asm_mnemonic_is(inst, "SUBS") && asm_operands_are(inst, "rr")) {
+        subs(o[0].value, o[0].value, o[1].value, code_func);
+    } else if (asm_mnemonic_is(inst, "SUBS") && asm_operands_are(inst, "ri")) {
+        subs_imm(o[0].value, asm_immediate_value(inst, 1, 0xFF, 1), code_func);
+    } else if (asm_mnemonic_is(inst, "MOVS") && asm_operands_are(inst, "ri")) {
+        mov(o[0].value, asm_immediate_value(inst, 1, 0xFF, 1), code_func);
+    } else if (asm_mnemonic_is(inst, "MOVS") && asm_operands_are(inst, "rr")) {
+        // MOVS between low registers is LSLS by 0
+        lsls(o[0].value, o[1].value, 0, code_func);
+    } else if (asm_mnemonic_is(inst, "MOV") && asm_operands_are(inst, "rr")) {
+        mov_r(o[0].value, o[1].value, code_func);
+    } else if (asm_mnemonic_is(inst, "LSLS") && asm_operands_are(inst, "rri")) {
+        lsls(o[0].value, o[1].value, asm_immediate_value(inst, 2, 31, 1), code_func);
+    } else if (asm_mnemonic_is(inst, "LSLS") && asm_operands_are(inst, "rr")) {
+        lsls_r(o[0].value, o[1].value, code_func);
+    } else if (asm_mnemonic_is(inst, "LSRS") && asm_operands_are(inst, "rri")) {
+        lsrs(o[0].value, o[1].value, asm_immediate_value(inst, 2, 31, 1), code_func);
+    } else if (asm_mnemonic_is(inst, "LSRS") && asm_operands_are(inst, "rr")) {
+        lsrs_r(o[0].value, o[1].value, code_func);
+    } else if (asm_mnemonic_is(inst, "ANDS") && asm_operands_are(inst, "rr")) {
+        ands(o[0].value, o[1].value, code_func);
+    } else if (asm_mnemonic_is(inst, "ORRS") && asm_operands_are(inst, "rr")) {
+        orrs(o[0].value, o[1].value, code_func);
+    } else if (asm_mnemonic_is(inst, "EORS") && asm_operands_are(inst, "rr")) {
+        eors(o[0].value, o[1].value, code_func);
+    } else if (asm_mnemonic_is(inst, "BICS") && asm_operands_are(inst, "rr")) {
+        bics(o[0].value, o[1].value, code_func);
+    } else if (asm_mnemonic_is(inst, "MVNS") && asm_operands_are(inst, "rr")) {
+        mvns(o[0].value, o[1].value, code_func);
+    } else if (asm_mnemonic_is(inst, "ADCS") && asm_operands_are(inst, "rr")) {
+        adcs(o[0].value, o[1].value, code_func);
+    } else if (asm_mnemonic_is(inst, "MULS") && (asm_operands_are(inst, "rr")
+            || (asm_operands_are(inst, "rrr") && o[2].value == o[0].value))) {
+        // "MULS rd, rn, rd" has to write one of the registers it multiplies
+        muls(o[0].value, o[1].value, code_func);
+    } else if (asm_mnemonic_is(inst, "CMP") && asm_operands_are(inst, "rr")) {
+        cmp(o[1].value, o[0].value, code_func);
+    } else if (asm_mnemonic_is(inst, "CMP") && asm_operands_are(inst, "ri")) {
+        cmp_imm(o[0].value, asm_immediate_value(inst, 1, 0xFF, 1), code_func);
+    } else if (asm_mnemonic_is(inst, "LDR") || asm_mnemonic_is(inst, "STR")) {
+        asm_load_store_to_armv6m(inst, asm_mnemonic_is(inst, "LDR"), 4, code_func);
+    } else if (asm_mnemonic_is(inst, "LDRH") || asm_mnemonic_is(inst, "STRH")) {
+        asm_load_store_to_armv6m(inst, asm_mnemonic_is(inst, "LDRH"), 2, code_func);
+    } else if (asm_mnemonic_is(inst, "LDRB") || asm_mnemonic_is(inst, "STRB")) {
+        asm_load_store_to_armv6m(inst, asm_mnemonic_is(inst, "LDRB"), 1, code_func);
+    } else if (asm_mnemonic_is(inst, "B") && asm_operands_are(inst, "l")) {
+        b(C_ALWAYS, o[0].value, code_func);
+    } else if (cond != -1 && asm_operands_are(inst, "l")) {
+        b(cond, o[0].value, code_func);
+    } else if (asm_mnemonic_is(inst, "NOP") && asm_operands_are(inst, "")) {
+        mov_r(8, 8, code_func);
+    } else {
+        PANIC("Unsupported asm instruction or operands: '%s'\n", cstr1);
+    }
+}
 
+// Returns the amount an 8 bit value has to be shifted left by to make imm, or -1 if
+// imm has bits set more than 8 apart. Masks and single bits usually look like this.
+int shifted_immediate(uint32_t imm) {
+    if (imm == 0) {
+        return -1;
+    }
+    int shift = 0;
+    while ((imm & 1) == 0) {
+        imm >>= 1;
+        shift++;
+    }
+    return imm <= 0xFF ? shift : -1;
+}
+// Returns how many instructions immediate_to_rX uses for imm
+int immediate_size(uint32_t imm) {
+    if (imm <= 0xFF) {
+        return 1;
+    } else if (shifted_immediate(imm) != -1) {
+        return 2;
+    } else if (imm <= 0xFFFF) {
+        return 3;
+    } else if (imm <= 0xFFFFFF) {
+        return 5;
+    }
+    return 7;
+}
+bool immediate_is_cheaper_inverted(uint32_t imm) {
+    return immediate_size(~imm) < immediate_size(imm);
+}
 void immediate_to_rX(uint32_t imm, int r, MachineCodeFunction *code_func) {
+    int shift = shifted_immediate(imm);
     if (imm <= 0xFF) {
         mov(r, imm, code_func);
+    } else if (shift != -1) {
+        mov(r, imm >> shift, code_func);
+        lsls(r, r, shift, code_func);
     } else if (imm <= 0xFFFF) {
         mov(r, (imm & 0xFF00) >> 8, code_func);
         lsls(r, r, 8, code_func);
@@ -260,6 +702,92 @@ void immediate_to_rX(uint32_t imm, int r, MachineCodeFunction *code_func) {
     }
 }
 
+// With --gp, a static whose offset from RAM_BASE_ADDRESS is at most 31 times its size is
+// loaded and stored with an immediate offset from R_GP, in a single instruction. Const
+// arrays are in flash, not RAM, so they are never near it.
+bool static_var_near_gp(Variable *var) {
+    int offset = var->address - RAM_BASE_ADDRESS;
+    int size = int_type_size(var->int_type);
+    return options.gp && !var->is_const && var->array_len == 0 && offset % size == 0 && offset / size <= 31;
+}
+// Puts the address of a static in r and returns the register that has it, and the
+// immediate offset (in units of the static's size) to load or store it with. With --gp
+// the address of a static in RAM is an offset added to R_GP, or just R_GP if the static
+// is near it. Const arrays in flash always get their whole address.
+int static_var_address_to_rX(Variable *var, int r, int *imm, MachineCodeFunction *code_func) {
+    *imm = 0;
+    if (static_var_near_gp(var)) {
+        *imm = (var->address - RAM_BASE_ADDRESS) / int_type_size(var->int_type);
+        return R_GP;
+    }
+    if (options.gp && !var->is_const) {
+        immediate_to_rX(var->address - RAM_BASE_ADDRESS, r, code_func);
+        adds(r, r, R_GP, code_func);
+        return r;
+    }
+    immediate_to_rX(var->address, r, code_func);
+    return r;
+}
+
+// Puts the address of a stack slot in R_ARG2_DEST and returns the immediate offset to
+// load or store it with. LDR/STR can only add 31 times the access size to a register,
+// so further away slots get their whole address computed instead.
+int stack_slot_to_r1(int sp_offset, int size, MachineCodeFunction *code_func) {
+    if (sp_offset / size <= 31) {
+        mov_r(R_ARG2_DEST, R_SP, code_func);
+        return sp_offset / size;
+    }
+    immediate_to_rX(sp_offset, R_ARG2_DEST, code_func);
+    add_sp_r(R_ARG2_DEST, code_func);
+    return 0;
+}
+
+// Puts the address of the array that an element is in into r, and returns the register
+// that has it. Local arrays are word aligned in the frame, so they are a single ADD from SP.
+int array_address_to_rX(SymbolTable *symbols, IRValue *value, int r, MachineCodeFunction *code_func) {
+    if (value->type == irv_local_variable) {
+        Variable *var = &symbols->function_vars[value->local_variable_index];
+        add_r_sp_imm(r, var->frame_offset / 4, code_func);
+        return r;
+    }
+    if (value->address_in_temp) {
+        return value->address_temp_num + R_TEMP_OFFSET;
+    }
+    Variable *var = &symbols->static_vars[value->static_variable_index];
+    int imm;
+    return static_var_address_to_rX(var, r, &imm, code_func);
+}
+// Loads an array element into r with a register-offset load, the byte offset of the
+// element is already in a temp
+void array_element_to_rX(SymbolTable *symbols, IRValue *arg, Variable *var, int r, MachineCodeFunction *code_func) {
+    int offset_r = arg->offset_temp_num + R_TEMP_OFFSET;
+    // the address can't go in r if r has the offset, R_ARG1 is free in that case
+    int address_r = array_address_to_rX(symbols, arg, r == offset_r ? R_ARG1 : r, code_func);
+    if (var->int_type == int_u8) {
+        ldrb_r(r, address_r, offset_r, code_func);
+    } else if (var->int_type == int_u16) {
+        ldrh_r(r, address_r, offset_r, code_func);
+    } else if (var->int_type == int_u32) {
+        ldr_r(r, address_r, offset_r, code_func);
+    } else {
+        PANIC("INVALID INT TYPE OF ARRAY\n");
+    }
+}
+// Stores r into an array element with a register-offset store
+void rx_to_array_element(SymbolTable *symbols, IRValue *result, Variable *var, int r, MachineCodeFunction *code_func) {
+    int offset_r = result->offset_temp_num + R_TEMP_OFFSET;
+    int address_r = array_address_to_rX(symbols, result, R_ARG2_DEST, code_func);
+    if (var->int_type == int_u8) {
+        strb_r(r, address_r, offset_r, code_func);
+    } else if (var->int_type == int_u16) {
+        strh_r(r, address_r, offset_r, code_func);
+    } else if (var->int_type == int_u32) {
+        str_r(r, address_r, offset_r, code_func);
+    } else {
+        PANIC("INVALID INT TYPE OF ARRAY\n");
+    }
+}
+
 // Returns register that will have the arg value
 int arg_to_rX(SymbolTable *symbols, IRValue *arg, int r, MachineCodeFunction *code_func) {
     switch (arg->type) {
@@ -274,7 +802,12 @@ int arg_to_rX(SymbolTable *symbols, IRValue *arg, int r, MachineCodeFunction *co
             PANIC("IR NON-FUNCTION ARG CAN'T BE FUNCTION");
         case irv_mmp_struct_item: {
             StructItem *si = &symbols->struct_items[arg->mmp_struct_item_index];
-            immediate_to_rX(si->address, R_ARG2_DEST, code_func);
+            int address_r = R_ARG2_DEST;
+            if (arg->address_in_temp) {
+                address_r = arg->address_temp_num + R_TEMP_OFFSET;
+            } else {
+                immediate_to_rX(si->address, address_r, code_func);
+            }
             int width = 0;
             if (si->type == si_bf) {
                 width = si->bf.width;
@@ -286,11 +819,11 @@ int arg_to_rX(SymbolTable *symbols, IRValue *arg, int r, MachineCodeFunction *co
                 width = 32;
             }
             if (width == 8) {
-                ldrb(r, R_ARG2_DEST, 0, code_func);
+                ldrb(r, address_r, 0, code_func);
             } else if (width == 16) {
-                ldrh(r, R_ARG2_DEST, 0, code_func);
+                ldrh(r, address_r, 0, code_func);
             } else if (width == 32) {
-                ldr(r, R_ARG2_DEST, 0, code_func);
+                ldr(r, address_r, 0, code_func);
             } else {
                 PANIC("INVALID WIDTH OF STRUCT ITEM\n");
             }
@@ -298,30 +831,41 @@ int arg_to_rX(SymbolTable *symbols, IRValue *arg, int r, MachineCodeFunction *co
         }
         case irv_static_variable: {
             Variable *var = &symbols->static_vars[arg->static_variable_index];
-            immediate_to_rX(var->address, r, code_func);
+            if (arg->offset_in_temp) {
+                array_element_to_rX(symbols, arg, var, r, code_func);
+                return r;
+            }
+            int address_r = r;
+            int imm = 0;
+            if (arg->address_in_temp) {
+                address_r = arg->address_temp_num + R_TEMP_OFFSET;
+            } else {
+                address_r = static_var_address_to_rX(var, address_r, &imm, code_func);
+            }
             if (var->int_type == int_u8) {
-                ldrb(r, r, 0, code_func);
+                ldrb(r, address_r, imm, code_func);
             } else if (var->int_type == int_u16) {
-                ldrh(r, r, 0, code_func);
+                ldrh(r, address_r, imm, code_func);
             } else if (var->int_type == int_u32) {
-                ldr(r, r, 0, code_func);
+                ldr(r, address_r, imm, code_func);
             } else {
                 PANIC("INVALID INT TYPE OF STATIC VARIABLE\n");
             }
             return r;
         }
         case irv_local_variable: {
-            Function *func = &symbols->functions[arg->func_index];
             Variable *var = &symbols->function_vars[arg->local_variable_index];
-            int local_var_num = arg->local_variable_index - func->func_vars_index;
-            int sp_offset = local_var_num * 4;
-            mov_r(R_ARG2_DEST, R_SP, code_func);
+            if (arg->offset_in_temp) {
+                array_element_to_rX(symbols, arg, var, r, code_func);
+                return r;
+            }
+            int imm = stack_slot_to_r1(var->frame_offset, int_type_size(var->int_type), code_func);
             if (var->int_type == int_u8) {
-                ldrb(r, R_ARG2_DEST, sp_offset, code_func);
+                ldrb(r, R_ARG2_DEST, imm, code_func);
             } else if (var->int_type == int_u16) {
-                ldrh(r, R_ARG2_DEST, sp_offset >> 1, code_func);
+                ldrh(r, R_ARG2_DEST, imm, code_func);
             } else if (var->int_type == int_u32) {
-                ldr(r, R_ARG2_DEST, sp_offset >> 2, code_func);
+                ldr(r, R_ARG2_DEST, imm, code_func);
             } else {
                 PANIC("INVALID INT TYPE OF STATIC VARIABLE\n");
             }
@@ -331,14 +875,15 @@ int arg_to_rX(SymbolTable *symbols, IRValue *arg, int r, MachineCodeFunction *co
             Function *func = &symbols->functions[arg->func_index];
             FunctionArg *func_arg = &symbols->func_args[arg->func_arg_index];
             int func_arg_num = arg->func_arg_index - func->func_args_index;
-            int sp_offset = (func->func_vars_len + 1 + func_arg_num) * 4;
-            mov_r(R_ARG2_DEST, R_SP, code_func);
+            // arguments were pushed by the caller, above the saved LR and this function's frame
+            int sp_offset = (func->frame_size + 1 + func_arg_num) * 4;
+            int imm = stack_slot_to_r1(sp_offset, int_type_size(func_arg->int_type), code_func);
             if (func_arg->int_type == int_u8) {
-                ldrb(r, R_ARG2_DEST, sp_offset, code_func);
+                ldrb(r, R_ARG2_DEST, imm, code_func);
             } else if (func_arg->int_type == int_u16) {
-                ldrh(r, R_ARG2_DEST, sp_offset >> 1, code_func);
+                ldrh(r, R_ARG2_DEST, imm, code_func);
             } else if (func_arg->int_type == int_u32) {
-                ldr(r, R_ARG2_DEST, sp_offset >> 2, code_func);
+                ldr(r, R_ARG2_DEST, imm, code_func);
             } else {
                 PANIC("INVALID INT TYPE OF STATIC VARIABLE\n");
             }
@@ -366,7 +911,12 @@ void rx_to_result(SymbolTable *symbols, IRValue *result, int r, MachineCodeFunct
             PANIC("IR RESULT CAN'T BE FUNCTION ARGUMENT");
         case irv_mmp_struct_item: {
             StructItem *si = &symbols->struct_items[result->mmp_struct_item_index];
-            immediate_to_rX(si->address, R_ARG2_DEST, code_func);
+            int address_r = R_ARG2_DEST;
+            if (result->address_in_temp) {
+                address_r = result->address_temp_num + R_TEMP_OFFSET;
+            } else {
+                immediate_to_rX(si->address, address_r, code_func);
+            }
             int width = 0;
             if (si->type == si_bf) {
                 width = si->bf.width;
@@ -378,11 +928,11 @@ void rx_to_result(SymbolTable *symbols, IRValue *result, int r, MachineCodeFunct
                 width = 32;
             }
             if (width == 8) {
-                strb(r, R_ARG2_DEST, 0, code_func);
+                strb(r, address_r, 0, code_func);
             } else if (width == 16) {
-                strh(r, R_ARG2_DEST, 0, code_func);
+                strh(r, address_r, 0, code_func);
             } else if (width == 32) {
-                str(r, R_ARG2_DEST, 0, code_func);
+                str(r, address_r, 0, code_func);
             } else {
                 PANIC("INVALID WIDTH OF STRUCT ITEM\n");
             }
@@ -390,30 +940,41 @@ void rx_to_result(SymbolTable *symbols, IRValue *result, int r, MachineCodeFunct
         }
         case irv_static_variable: {
             Variable *var = &symbols->static_vars[result->static_variable_index];
-            immediate_to_rX(var->address, R_ARG2_DEST, code_func);
+            if (result->offset_in_temp) {
+                rx_to_array_element(symbols, result, var, r, code_func);
+                return;
+            }
+            int address_r = R_ARG2_DEST;
+            int imm = 0;
+            if (result->address_in_temp) {
+                address_r = result->address_temp_num + R_TEMP_OFFSET;
+            } else {
+                address_r = static_var_address_to_rX(var, address_r, &imm, code_func);
+            }
             if (var->int_type == int_u8) {
-                strb(r, R_ARG2_DEST, 0, code_func);
+                strb(r, address_r, imm, code_func);
             } else if (var->int_type == int_u16) {
-                strh(r, R_ARG2_DEST, 0, code_func);
+                strh(r, address_r, imm, code_func);
             } else if (var->int_type == int_u32) {
-                str(r, R_ARG2_DEST, 0, code_func);
+                str(r, address_r, imm, code_func);
             } else {
                 PANIC("INVALID INT TYPE OF STATIC VARIABLE\n");
             }
             return;
         }
         case irv_local_variable: {
-            Function *func = &symbols->functions[result->func_index];
             Variable *var = &symbols->function_vars[result->local_variable_index];
-            int local_var_num = result->local_variable_index - func->func_vars_index;
-            int sp_offset = local_var_num * 4;
-            mov_r(R_ARG2_DEST, R_SP, code_func);
+            if (result->offset_in_temp) {
+                rx_to_array_element(symbols, result, var, r, code_func);
+                return;
+            }
+            int imm = stack_slot_to_r1(var->frame_offset, int_type_size(var->int_type), code_func);
             if (var->int_type == int_u8) {
-                strb(r, R_ARG2_DEST, sp_offset, code_func);
+                strb(r, R_ARG2_DEST, imm, code_func);
             } else if (var->int_type == int_u16) {
-                strh(r, R_ARG2_DEST, sp_offset >> 1, code_func);
+                strh(r, R_ARG2_DEST, imm, code_func);
             } else if (var->int_type == int_u32) {
-                str(r, R_ARG2_DEST, sp_offset >> 2, code_func);
+                str(r, R_ARG2_DEST, imm, code_func);
             } else {
                 PANIC("INVALID INT TYPE OF STATIC VARIABLE\n");
             }
@@ -423,6 +984,605 @@ void rx_to_result(SymbolTable *symbols, IRValue *result, int r, MachineCodeFunct
     }
 }
 
+// ANDS, ORRS, EORS, BICS, LSLS and LSRS only have a form where the first operand is also the destination.
+// This emits one of them for rd = rn OP rm without changing rn or rm (unless one of
+// them is rd), since they can be temps that are used again later.
+void rdn_op(void (*op)(int, int, MachineCodeFunction *), int rd, int rn, int rm, MachineCodeFunction *code_func) {
+    if (rd == rn) {
+        op(rd, rm, code_func);
+    } else if (rd != rm) {
+        mov_r(rd, rn, code_func);
+        op(rd, rm, code_func);
+    } else {
+        if (rn != R_ARG1) {
+            mov_r(R_ARG1, rn, code_func);
+        }
+        op(R_ARG1, rm, code_func);
+        mov_r(rd, R_ARG1, code_func);
+    }
+}
+
+// Emits rd = rn shifted by a constant amount, using the 5 bit immediate form of LSLS/LSRS.
+// Everything is shifted out by 32 or more, like the register forms do.
+void shift_imm(bool left, int rd, int rn, uint32_t amount, MachineCodeFunction *code_func) {
+    if (amount >= 32) {
+        mov(rd, 0, code_func);
+    } else if (left || amount == 0) {
+        lsls(rd, rn, amount, code_func);
+    } else {
+        lsrs(rd, rn, amount, code_func);
+    }
+}
+
+// Returns n if value is 2 to the power of n, or -1 if it isn't a power of two
+int power_of_two(uint32_t value) {
+    if (value == 0 || (value & (value - 1)) != 0) {
+        return -1;
+    }
+    int n = 0;
+    while (value > 1) {
+        value >>= 1;
+        n++;
+    }
+    return n;
+}
+
+// Emits rd = rn * imm. MULS needs the constant in a register, so powers of two are
+// shifted instead, and constants one more or less than a power of two that take more
+// than one instruction to load are a shift and an add or subtract.
+void multiply_imm(int rd, int rn, uint32_t imm, MachineCodeFunction *code_func) {
+    if (imm == 0) {
+        mov(rd, 0, code_func);
+    } else if (power_of_two(imm) != -1) {
+        lsls(rd, rn, power_of_two(imm), code_func);
+    } else if (immediate_size(imm) > 1 && power_of_two(imm - 1) != -1) {
+        lsls(R_ARG2_DEST, rn, power_of_two(imm - 1), code_func);
+        adds(rd, R_ARG2_DEST, rn, code_func);
+    } else if (immediate_size(imm) > 1 && power_of_two(imm + 1) != -1) {
+        lsls(R_ARG2_DEST, rn, power_of_two(imm + 1), code_func);
+        subs(rd, R_ARG2_DEST, rn, code_func);
+    } else {
+        immediate_to_rX(imm, R_ARG2_DEST, code_func);
+        rdn_op(muls, rd, rn, R_ARG2_DEST, code_func);
+    }
+}
+
+// Works out the reciprocal to divide by d (which isn't a power of two) with a multiply:
+// x / d == mulhu(x, m) >> shift for every 32 bit x, where mulhu is the top half of the
+// 64 bit product. Some divisors need a 33 bit m, then add is set and
+// x / d == (((x - t) >> 1) + t) >> shift instead, where t = mulhu(x, m).
+void division_magic(uint32_t d, uint32_t *m, int *shift, bool *add) {
+    for (int s = 0; s < 32; s++) {
+        uint64_t p = (uint64_t)1 << (32 + s);
+        uint64_t candidate = (p + d - 1) / d;
+        // rounding m up is exact for every 32 bit x if it is off by at most 2^s
+        if (candidate <= 0xFFFFFFFF && candidate * d - p <= ((uint64_t)1 << s)) {
+            *m = candidate;
+            *shift = s;
+            *add = false;
+            return;
+        }
+    }
+    int l = 0;
+    while (((uint64_t)1 << l) < d) {
+        l++;
+    }
+    *m = (uint32_t)((((uint64_t)1 << 32) * (((uint64_t)1 << l) - d)) / d + 1);
+    *shift = l - 1;
+    *add = true;
+}
+
+// Emits R_ARG1 = the top 32 bits of rn * m. MULS only gives the bottom 32 bits of a
+// product, so this adds up the four 16 by 16 bit products of the halves instead.
+// a and b are scratch, and none of rn, a or b can be R_ARG1 or R_ARG2_DEST.
+void mulhu_imm(int rn, uint32_t m, int a, int b, MachineCodeFunction *code_func) {
+    lsls(R_ARG1, rn, 16, code_func);
+    lsrs(R_ARG1, R_ARG1, 16, code_func); // low half of rn
+    lsrs(R_ARG2_DEST, rn, 16, code_func); // high half of rn
+    immediate_to_rX(m & 0xFFFF, a, code_func);
+    mov_r(b, a, code_func);
+    muls(b, R_ARG1, code_func);
+    lsrs(b, b, 16, code_func); // (low * m_low) >> 16
+    muls(a, R_ARG2_DEST, code_func);
+    adds(b, b, a, code_func); // + high * m_low, which can't overflow
+    immediate_to_rX(m >> 16, a, code_func);
+    muls(R_ARG1, a, code_func); // low * m_high
+    muls(R_ARG2_DEST, a, code_func); // high * m_high
+    adds(b, b, R_ARG1, code_func); // this one can carry, into bit 48 of the product
+    mov(a, 0, code_func);
+    adcs(a, a, code_func);
+    lsls(a, a, 16, code_func);
+    lsrs(b, b, 16, code_func);
+    adds(R_ARG1, R_ARG2_DEST, b, code_func);
+    adds(R_ARG1, R_ARG1, a, code_func);
+}
+
+// Emits rd = rn / d, or rd = rn % d if modulo is set. ARMv6-M has no divide instruction,
+// so powers of two are shifted and everything else multiplies by the reciprocal.
+void divide_imm(bool modulo, int rd, int rn, uint32_t d, MachineCodeFunction *code_func) {
+    int n = power_of_two(d);
+    if (d == 0) {
+        // the same as ____udivmod: all ones, with the dividend left over
+        if (modulo) {
+            if (rd != rn) {
+                mov_r(rd, rn, code_func);
+            }
+        } else {
+            mov(rd, 0, code_func);
+            mvns(rd, rd, code_func);
+        }
+    } else if (n != -1 && modulo) {
+        if (n == 0) {
+            mov(rd, 0, code_func);
+        } else {
+            lsls(rd, rn, 32 - n, code_func);
+            lsrs(rd, rd, 32 - n, code_func);
+        }
+    } else if (n != -1) {
+        shift_imm(false, rd, rn, n, code_func);
+    } else {
+        uint32_t m;
+        int shift;
+        bool add;
+        division_magic(d, &m, &shift, &add);
+        // The sequence needs more registers than r0 and r1, so it borrows some temps and
+        // puts them back afterwards. rn is copied to one of them if it is r0.
+        int scratch[3];
+        int scratch_num = 0;
+        for (int r = R_TEMP_OFFSET; scratch_num < 3; r++) {
+            if (r != rn) {
+                scratch[scratch_num++] = r;
+            }
+        }
+        int x = rn;
+        int reg_list = (1 << scratch[0]) | (1 << scratch[1]);
+        if (rn < R_TEMP_OFFSET) {
+            x = scratch[2];
+            reg_list |= 1 << x;
+        }
+        push_list(reg_list, code_func);
+        if (x != rn) {
+            mov_r(x, rn, code_func);
+        }
+        mulhu_imm(x, m, scratch[0], scratch[1], code_func);
+        if (add) {
+            subs(R_ARG2_DEST, x, R_ARG1, code_func);
+            lsrs(R_ARG2_DEST, R_ARG2_DEST, 1, code_func);
+            adds(R_ARG1, R_ARG2_DEST, R_ARG1, code_func);
+        }
+        if (shift > 0) {
+            lsrs(R_ARG1, R_ARG1, shift, code_func);
+        }
+        if (modulo) {
+            immediate_to_rX(d, R_ARG2_DEST, code_func);
+            muls(R_ARG2_DEST, R_ARG1, code_func);
+            subs(R_ARG1, x, R_ARG2_DEST, code_func);
+        }
+        pop_list(reg_list, code_func);
+        if (rd != R_ARG1) {
+            mov_r(rd, R_ARG1, code_func);
+        }
+    }
+}
+
+// ____udivmod is the division routine for divisors that aren't known at compile time.
+// It is only added to the program when something divides by a variable.
+int udivmod_func_index = 0;
+int udivmod_function(SymbolTable *symbols) {
+    if (udivmod_func_index == 0) {
+        if (symbols->functions_num == MAX_FUNCTIONS) {
+            PANIC("Too many functions: maximum is %d\n", MAX_FUNCTIONS);
+        }
+        Function func = {0};
+        func.func_args_index = -1;
+        func.ir_code_index = -1;
+        func.func_vars_index = -1;
+        func.name.str = "____udivmod";
+        func.name.len = 11;
+        udivmod_func_index = add_function(symbols, func);
+    }
+    return udivmod_func_index;
+}
+// Takes the dividend in r0 and the divisor in r1, and returns the quotient in r0 and the
+// remainder in r1. The dividend is shifted into the remainder one bit at a time, and the
+// divisor is subtracted whenever it fits. r2 and r3 are saved, so temps stay live across it.
+void udivmod_to_armv6m(MachineCodeFunction *code_func) {
+    int reg_list = (1 << 2) | (1 << 3);
+    push_list(reg_list | (1 << 8), code_func);
+    cmp_imm(R_ARG2_DEST, 0, code_func);
+    b(C_NOTEQUALS, 1, code_func);
+    // dividing by zero gives all ones, with the dividend left over
+    mov_r(R_ARG2_DEST, R_ARG1, code_func);
+    mov(R_ARG1, 0, code_func);
+    mvns(R_ARG1, R_ARG1, code_func);
+    pop_list(reg_list | (1 << 8), code_func);
+    next_label = 1;
+    mov(3, 32, code_func); // bits of the dividend left
+    // a zero top byte of the dividend would only shift zeros into the quotient
+    next_label = 2;
+    lsrs(2, R_ARG1, 24, code_func);
+    b(C_NOTEQUALS, 3, code_func);
+    lsls(R_ARG1, R_ARG1, 8, code_func);
+    subs_imm(3, 8, code_func);
+    cmp_imm(3, 8, code_func);
+    b(C_NOTEQUALS, 2, code_func);
+    next_label = 3;
+    mov(2, 0, code_func); // remainder
+    // the top bit of the dividend goes into the remainder, and the bottom bit is free for the quotient
+    next_label = 4;
+    lsls(R_ARG1, R_ARG1, 1, code_func);
+    adcs(2, 2, code_func);
+    b(C_CARRYSET, 5, code_func); // the remainder is over 32 bits, so the divisor fits
+    cmp(R_ARG2_DEST, 2, code_func);
+    b(C_CARRYCLEAR, 6, code_func);
+    next_label = 5;
+    subs(2, 2, R_ARG2_DEST, code_func);
+    adds_imm(R_ARG1, 1, code_func);
+    next_label = 6;
+    subs_imm(3, 1, code_func);
+    b(C_NOTEQUALS, 4, code_func);
+    mov_r(R_ARG2_DEST, 2, code_func);
+    pop_list(reg_list | (1 << 8), code_func);
+}
+
+// ____drain makes the calls that interrupt handlers have deferred, from the main loop in
+// ____init. It is only added to the program when something uses "defer".
+int drain_func_index = 0;
+int drain_function(SymbolTable *symbols) {
+    if (drain_func_index == 0) {
+        if (symbols->functions_num == MAX_FUNCTIONS) {
+            PANIC("Too many functions: maximum is %d\n", MAX_FUNCTIONS);
+        }
+        Function func = {0};
+        func.func_args_index = -1;
+        func.ir_code_index = -1;
+        func.func_vars_index = -1;
+        func.name.str = "____drain";
+        func.name.len = 9;
+        drain_func_index = add_function(symbols, func);
+    }
+    return drain_func_index;
+}
+// Empties each defer queue in turn. The arguments of a call are pushed from its entry
+// and the entry is freed before the call, so the handler can reuse it straight away.
+// The queue is checked again after each call, since its handler may have run meanwhile.
+void drain_to_armv6m(SymbolTable *symbols, MachineCodeFunction *code_func) {
+    push_lr(code_func);
+    for (int i = 0; i < symbols->defer_queues_num; i++) {
+        DeferQueue *queue = &symbols->defer_queues[i];
+        int args_len = symbols->functions[queue->func_index].func_args_len;
+        next_label = i + 1;
+        int head_imm, tail_imm, entries_imm;
+        int head_r = static_var_address_to_rX(&symbols->static_vars[queue->head_var], R_ARG1, &head_imm, code_func);
+        ldrb(R_ARG2_DEST, head_r, head_imm, code_func);
+        int tail_r = static_var_address_to_rX(&symbols->static_vars[queue->tail_var], 2, &tail_imm, code_func);
+        ldrb(2, tail_r, tail_imm, code_func);
+        cmp(R_ARG2_DEST, 2, code_func);
+        b(C_EQUALS, i + 2, code_func);
+        if (args_len > 0) {
+            immediate_to_rX(args_len * 4, 2, code_func);
+            muls(2, R_ARG2_DEST, code_func);
+            int entries_r = static_var_address_to_rX(&symbols->static_vars[queue->entries_var], 3, &entries_imm, code_func);
+            adds(2, 2, entries_r, code_func);
+            // the first argument is pushed last, so it is closest to the callee's frame
+            for (int arg = args_len - 1; arg >= 0; arg--) {
+                ldr(3, 2, arg, code_func);
+                push(3, code_func);
+            }
+        }
+        adds_imm(R_ARG2_DEST, 1, code_func);
+        mov(2, DEFER_QUEUE_LEN - 1, code_func);
+        ands(R_ARG2_DEST, 2, code_func);
+        strb(R_ARG2_DEST, head_r, head_imm, code_func);
+        bl(queue->func_index, code_func);
+        if (args_len > 0) {
+            add_sp_imm(args_len, code_func);
+        }
+        b(C_ALWAYS, i + 1, code_func);
+    }
+    next_label = symbols->defer_queues_num + 1;
+    pop_pc(code_func);
+}
+
+// Sets ____tasks_runnable from a handler, so that the main loop runs the tasks again
+// instead of sleeping
+void tasks_runnable_to_armv6m(SymbolTable *symbols, MachineCodeFunction *code_func) {
+    StringRef runnable_name = {"____tasks_runnable", 18};
+    int runnable_var = find_static_variable(symbols, &runnable_name);
+    int imm;
+    int address_r = static_var_address_to_rX(&symbols->static_vars[runnable_var], R_ARG1, &imm, code_func);
+    mov(R_ARG2_DEST, 1, code_func);
+    strb(R_ARG2_DEST, address_r, imm, code_func);
+}
+// ____systick is the SysTick handler, which counts the ticks for sleep_ticks. It is only
+// added to the program when a task uses sleep_ticks.
+int systick_func_index = 0;
+int systick_function(SymbolTable *symbols) {
+    if (systick_func_index == 0) {
+        if (symbols->functions_num == MAX_FUNCTIONS) {
+            PANIC("Too many functions: maximum is %d\n", MAX_FUNCTIONS);
+        }
+        Function func = {0};
+        func.func_args_index = -1;
+        func.ir_code_index = -1;
+        func.func_vars_index = -1;
+        func.name.str = "____systick";
+        func.name.len = 11;
+        systick_func_index = add_function(symbols, func);
+    }
+    return systick_func_index;
+}
+// It is entered straight from the vector table, and only uses registers that the exception
+// saved, so it can return with the EXC_RETURN value in LR
+void systick_to_armv6m(SymbolTable *symbols, MachineCodeFunction *code_func) {
+    StringRef ticks_name = {"____ticks", 9};
+    int ticks_var = find_static_variable(symbols, &ticks_name);
+    int imm;
+    int address_r = static_var_address_to_rX(&symbols->static_vars[ticks_var], R_ARG1, &imm, code_func);
+    ldr(R_ARG2_DEST, address_r, imm, code_func);
+    adds_imm(R_ARG2_DEST, 1, code_func);
+    str(R_ARG2_DEST, address_r, imm, code_func);
+    tasks_runnable_to_armv6m(symbols, code_func);
+    bx(R_LR, code_func);
+}
+// Starts SysTick if any task sleeps, before interrupts are enabled. The tasks themselves
+// need nothing: their states, the counts they wait on and the ticks are all in .bss.
+void tasks_to_armv6m(SymbolTable *symbols, MachineCodeFunction *init_code) {
+    StringRef ticks_name = {"____ticks", 9};
+    if (find_static_variable(symbols, &ticks_name) == -1) {
+        return;
+    }
+    if (options.idle_mode == idle_deep) {
+        PANIC("sleep_ticks can't be used with --idle deep, since SysTick stops in deep sleep\n");
+    }
+    int tick_cycles = options.tick_cycles ? options.tick_cycles : DEFAULT_TICK_CYCLES;
+    if (tick_cycles < 2 || tick_cycles - 1 > SYST_MAX_RELOAD) {
+        PANIC("The tick must be from 2 to %d cycles but is %d\n", SYST_MAX_RELOAD + 1, tick_cycles);
+    }
+    immediate_to_rX(SYST_CSR, R_ARG1, init_code);
+    immediate_to_rX(tick_cycles - 1, 2, init_code);
+    str(2, R_ARG1, (SYST_RVR - SYST_CSR) / 4, init_code);
+    mov(2, 0, init_code);
+    str(2, R_ARG1, (SYST_CVR - SYST_CSR) / 4, init_code);
+    mov(2, SYST_CSR_START, init_code);
+    str(2, R_ARG1, 0, init_code);
+    systick_function(symbols);
+}
+
+// RAM isn't cleared at reset, so ____init starts by copying the initial values of .data
+// from flash and zeroing .bss, a word at a time from the end. See layout_static_vars.
+// With --gp it sets R_GP first.
+#define DATA_COPY_LABEL 99996
+#define BSS_ZERO_LABEL 99995
+void static_vars_to_armv6m(SymbolTable *symbols, MachineCodeFunction *init_code) {
+    if (options.gp) {
+        immediate_to_rX(RAM_BASE_ADDRESS, R_GP, init_code);
+    }
+    if (symbols->data_len > 0) {
+        immediate_to_rX(VECTOR_TABLE_SIZE + symbols->data_image, R_ARG1, init_code);
+        immediate_to_rX(symbols->data_address, R_ARG2_DEST, init_code);
+        immediate_to_rX(symbols->data_len, 2, init_code);
+        next_label = DATA_COPY_LABEL;
+        subs_imm(2, 4, init_code);
+        ldr_r(3, R_ARG1, 2, init_code);
+        str_r(3, R_ARG2_DEST, 2, init_code);
+        b(C_NOTEQUALS, DATA_COPY_LABEL, init_code);
+    }
+    if (symbols->bss_len > 0) {
+        immediate_to_rX(symbols->bss_address, R_ARG1, init_code);
+        immediate_to_rX(symbols->bss_len, 2, init_code);
+        mov(3, 0, init_code);
+        next_label = BSS_ZERO_LABEL;
+        subs_imm(2, 4, init_code);
+        str_r(3, R_ARG1, 2, init_code);
+        b(C_NOTEQUALS, BSS_ZERO_LABEL, init_code);
+    }
+}
+
+// An initialize block's write of a constant to a whole peripheral register
+bool op_is_register_init(IROp *op) {
+    return op->opcode == ir_copy && op->result.type == irv_mmp_struct_item
+        && !op->result.address_in_temp && op->arg1.type == irv_immediate;
+}
+int struct_item_size(StructItem *si) {
+    return si->type == si_bf ? si->bf.width / 8 : int_type_size(si->int_type);
+}
+// Points R_ARG2_DEST at address, with a single ADDS or SUBS if it already points close by
+void register_base_to_r1(uint32_t address, bool *have_base, uint32_t *base, MachineCodeFunction *code_func) {
+    if (*have_base && address > *base && address - *base <= 0xFF) {
+        adds_imm(R_ARG2_DEST, address - *base, code_func);
+    } else if (*have_base && address < *base && *base - address <= 0xFF) {
+        subs_imm(R_ARG2_DEST, *base - address, code_func);
+    } else if (!*have_base || address != *base) {
+        immediate_to_rX(address, R_ARG2_DEST, code_func);
+    }
+    *have_base = true;
+    *base = address;
+}
+// Returns the offset of a register of size bytes from R_ARG2_DEST, first moving R_ARG2_DEST
+// to the register if it's out of reach of a load or store's immediate offset
+uint32_t register_offset_from_r1(uint32_t address, int size, bool *have_base, uint32_t *base, MachineCodeFunction *code_func) {
+    uint32_t offset = address - *base;
+    if (!*have_base || address < *base || offset % size != 0 || offset / size > 31) {
+        register_base_to_r1(address, have_base, base, code_func);
+        offset = 0;
+    }
+    return offset;
+}
+
+// The busy-wait loops for write-synchronized registers. Labels from the parser count up
+// from 1, so these can't clash with one.
+#define SYNC_WAIT_LABEL 99900
+#define MAX_SYNC_WAITS 95
+#define MAX_PENDING_SYNCS 16
+int sync_waits_num = 0;
+
+// Loops until the sync status field of the register si is cleared. Uses r2.
+void sync_wait_to_armv6m(SymbolTable *symbols, StructItem *si, bool *have_base, uint32_t *base, MachineCodeFunction *code_func) {
+    if (sync_waits_num == MAX_SYNC_WAITS) {
+        PANIC("Too many waits for write-synchronized registers in initialize blocks\n");
+    }
+    StructItem *status = &symbols->struct_items[si->sync_si_index];
+    BitFieldItem *bfi = &symbols->bitfield_items[si->sync_bfi_index];
+    int size = struct_item_size(status);
+    uint32_t offset = register_offset_from_r1(status->address, size, have_base, base, code_func);
+    int label = SYNC_WAIT_LABEL + sync_waits_num++;
+    next_label = label;
+    if (size == 1) {
+        ldrb(2, R_ARG2_DEST, offset, code_func);
+    } else if (size == 2) {
+        ldrh(2, R_ARG2_DEST, offset / 2, code_func);
+    } else {
+        ldr(2, R_ARG2_DEST, offset / 4, code_func);
+    }
+    if (bfi->width == 1) {
+        // shift the bit out into the carry flag
+        if (bfi->offset == 31) {
+            lsls(2, 2, 1, code_func);
+        } else {
+            lsrs(2, 2, bfi->offset + 1, code_func);
+        }
+        b(C_CARRYSET, label, code_func);
+        return;
+    }
+    if (32 - bfi->offset - bfi->width > 0) {
+        lsls(2, 2, 32 - bfi->offset - bfi->width, code_func);
+    }
+    if (bfi->width == 32) {
+        cmp_imm(2, 0, code_func);
+    } else {
+        lsrs(2, 2, 32 - bfi->width, code_func);
+    }
+    b(C_NOTEQUALS, label, code_func);
+}
+// A write to a write-synchronized register is pending until its sync status field clears.
+// pending holds the last such register written for each sync status field. Another write
+// to a register with the same sync status field has to wait for it; writes to any other
+// register don't.
+int pending_sync_index(StructItem **pending, int pending_num, StructItem *si) {
+    if (si->sync_si_index == -1) {
+        return -1;
+    }
+    for (int i = 0; i < pending_num; i++) {
+        if (pending[i]->sync_bfi_index == si->sync_bfi_index) {
+            return i;
+        }
+    }
+    return -1;
+}
+void remove_pending_sync(StructItem **pending, int *pending_num, int p) {
+    (*pending_num)--;
+    for (int i = p; i < *pending_num; i++) {
+        pending[i] = pending[i + 1];
+    }
+}
+// The register writes in ____init come from initialize blocks, and are all constants.
+// Rather than build each register's address from scratch, the last address is kept in
+// R_ARG2_DEST and the next register is stored to at an immediate offset from it, or it
+// is moved there with one ADDS or SUBS. A run of writes to consecutive word registers is
+// a single STMIA. The writes are still made in the order they were written in, since the
+// hardware often depends on it (e.g. a peripheral being enabled last).
+// A write to a write-synchronized register only waits for the sync of an earlier write
+// that it depends on, and any writes still syncing are waited for at the end, since the
+// code that runs after ____init doesn't know about them.
+// Returns how many of the len ops were translated.
+int register_inits_to_armv6m(SymbolTable *symbols, IROp *ops, int len, MachineCodeFunction *code_func) {
+    bool have_base = false;
+    uint32_t base = 0;
+    bool have_value = false;
+    uint32_t value = 0;
+    StructItem *pending[MAX_PENDING_SYNCS];
+    int pending_num = 0;
+    // the values of an STMIA go in R_ARG1 and the temp registers
+    int stmia_max = 1 + temp_registers_num();
+    int i = 0;
+    while (i < len && op_is_register_init(&ops[i]) && (i == 0 || !ops[i].label)) {
+        if (ops[i].label) {
+            next_label = ops[i].label;
+        }
+        StructItem *si = &symbols->struct_items[ops[i].result.mmp_struct_item_index];
+        int size = struct_item_size(si);
+        int p = pending_sync_index(pending, pending_num, si);
+        if (p != -1) {
+            sync_wait_to_armv6m(symbols, pending[p], &have_base, &base, code_func);
+            remove_pending_sync(pending, &pending_num, p);
+        }
+        if (si->sync_si_index != -1) {
+            if (pending_num == MAX_PENDING_SYNCS) {
+                sync_wait_to_armv6m(symbols, pending[0], &have_base, &base, code_func);
+                remove_pending_sync(pending, &pending_num, 0);
+            }
+            pending[pending_num++] = si;
+        }
+        int run = 1;
+        while (size == 4 && i + run < len && run < stmia_max && op_is_register_init(&ops[i + run])
+                && !ops[i + run].label) {
+            StructItem *next = &symbols->struct_items[ops[i + run].result.mmp_struct_item_index];
+            if (struct_item_size(next) != 4 || next->address != si->address + 4 * run) {
+                break;
+            }
+            // a synchronized register might have to wait, so it starts a new run
+            if (next->sync_si_index != -1) {
+                break;
+            }
+            run++;
+        }
+        if (run > 1) {
+            register_base_to_r1(si->address, &have_base, &base, code_func);
+            int reg_list = 0;
+            for (int k = 0; k < run; k++) {
+                int r = k == 0 ? R_ARG1 : R_TEMP_OFFSET + k - 1;
+                immediate_to_rX(ops[i + k].arg1.immediate_value, r, code_func);
+                reg_list |= 1 << r;
+            }
+            stmia(R_ARG2_DEST, reg_list, code_func);
+            base += 4 * run;
+            have_value = true;
+            value = ops[i].arg1.immediate_value;
+            i += run;
+            continue;
+        }
+
+        uint32_t offset = register_offset_from_r1(si->address, size, &have_base, &base, code_func);
+        if (!have_value || value != (uint32_t)ops[i].arg1.immediate_value) {
+            immediate_to_rX(ops[i].arg1.immediate_value, R_ARG1, code_func);
+            have_value = true;
+            value = ops[i].arg1.immediate_value;
+        }
+        if (size == 1) {
+            strb(R_ARG1, R_ARG2_DEST, offset, code_func);
+        } else if (size == 2) {
+            strh(R_ARG1, R_ARG2_DEST, offset / 2, code_func);
+        } else if (size == 4) {
+            str(R_ARG1, R_ARG2_DEST, offset / 4, code_func);
+        } else {
+            PANIC("INVALID WIDTH OF STRUCT ITEM\n");
+        }
+        i++;
+    }
+    for (int k = 0; k < pending_num; k++) {
+        sync_wait_to_armv6m(symbols, pending[k], &have_base, &base, code_func);
+    }
+    return i;
+}
+
+// The shared epilogue of an interrupt handler. Labels from the parser count up from 1,
+// so this can't clash with one.
+#define ISR_EPILOGUE_LABEL 99998
+
+InterruptHandler *find_interrupt_handler(SymbolTable *symbols, int func_index) {
+    for (int i = 0; i < symbols->interrupt_handlers_num; i++) {
+        if (symbols->interrupt_handlers[i].func_index == func_index) {
+            return &symbols->interrupt_handlers[i];
+        }
+    }
+    return NULL;
+}
+
+// The atomic blocks of the function being translated that haven't ended yet, innermost last
+int open_atomic_regions[MAX_ATOMIC_REGIONS];
+int open_atomic_regions_num = 0;
+
 int next_condition = C_ALWAYS;
 void ir_to_armv6m_inst(SymbolTable *symbols, IROp *ir_op, MachineCodeFunction *code_func, int func_index) {
     Function *func = &symbols->functions[func_index];
@@ -448,41 +1608,88 @@ void ir_to_armv6m_inst(SymbolTable *symbols, IROp *ir_op, MachineCodeFunction *c
             rx_to_result(symbols, &ir_op->result, rd, code_func);
             break;
         }
-        case ir_shift_left: {
+        case ir_shift_left:
+        case ir_shift_right: {
+            // all the int types are unsigned, so shifting right is a logical shift
+            bool left = ir_op->opcode == ir_shift_left;
             int rn = arg_to_rX(symbols, &ir_op->arg1, R_ARG1, code_func);
-            int rm = arg_to_rX(symbols, &ir_op->arg2, R_ARG2_DEST, code_func);
             int rd = result_rx(&ir_op->result);
-            if (rd != rn) {
-                lsls_r(rn, rm, code_func);
-                mov_r(rd, rn, code_func);
+            if (ir_op->arg2.type == irv_immediate) {
+                shift_imm(left, rd, rn, ir_op->arg2.immediate_value, code_func);
             } else {
-                lsls_r(rd, rm, code_func);
+                int rm = arg_to_rX(symbols, &ir_op->arg2, R_ARG2_DEST, code_func);
+                rdn_op(left ? lsls_r : lsrs_r, rd, rn, rm, code_func);
             }
             rx_to_result(symbols, &ir_op->result, rd, code_func);
             break;
         }
-        case ir_shift_right: {
+        case ir_bitwise_and: {
+            int rn = arg_to_rX(symbols, &ir_op->arg1, R_ARG1, code_func);
+            int rd = result_rx(&ir_op->result);
+            if (ir_op->arg2.type == irv_immediate && immediate_is_cheaper_inverted(ir_op->arg2.immediate_value)) {
+                // clearing a field: BICS with the field's mask is cheaper than ANDS with everything else
+                immediate_to_rX(~(uint32_t)ir_op->arg2.immediate_value, R_ARG2_DEST, code_func);
+                rdn_op(bics, rd, rn, R_ARG2_DEST, code_func);
+            } else {
+                int rm = arg_to_rX(symbols, &ir_op->arg2, R_ARG2_DEST, code_func);
+                rdn_op(ands, rd, rn, rm, code_func);
+            }
+            rx_to_result(symbols, &ir_op->result, rd, code_func);
+            break;
+        }
+        case ir_bitwise_xor: {
+            int rn = arg_to_rX(symbols, &ir_op->arg1, R_ARG1, code_func);
+            int rd = result_rx(&ir_op->result);
+            if (ir_op->arg2.type == irv_immediate && ir_op->arg2.immediate_value == -1) {
+                // ~x is x ^ 0xFFFFFFFF
+                mvns(rd, rn, code_func);
+            } else {
+                int rm = arg_to_rX(symbols, &ir_op->arg2, R_ARG2_DEST, code_func);
+                rdn_op(eors, rd, rn, rm, code_func);
+            }
+            rx_to_result(symbols, &ir_op->result, rd, code_func);
+            break;
+        }
+        case ir_bitwise_or: {
             int rn = arg_to_rX(symbols, &ir_op->arg1, R_ARG1, code_func);
             int rm = arg_to_rX(symbols, &ir_op->arg2, R_ARG2_DEST, code_func);
             int rd = result_rx(&ir_op->result);
-            if (rd != rn) {
-                asrs_r(rn, rm, code_func);
-                mov_r(rd, rn, code_func);
+            rdn_op(orrs, rd, rn, rm, code_func);
+            rx_to_result(symbols, &ir_op->result, rd, code_func);
+            break;
+        }
+        case ir_multiply: {
+            int rn = arg_to_rX(symbols, &ir_op->arg1, R_ARG1, code_func);
+            int rd = result_rx(&ir_op->result);
+            if (ir_op->arg2.type == irv_immediate) {
+                multiply_imm(rd, rn, ir_op->arg2.immediate_value, code_func);
             } else {
-                asrs_r(rd, rm, code_func);
+                int rm = arg_to_rX(symbols, &ir_op->arg2, R_ARG2_DEST, code_func);
+                rdn_op(muls, rd, rn, rm, code_func);
             }
             rx_to_result(symbols, &ir_op->result, rd, code_func);
             break;
         }
-        case ir_bitwise_and: {
+        case ir_divide:
+        case ir_modulo: {
+            bool modulo = ir_op->opcode == ir_modulo;
             int rn = arg_to_rX(symbols, &ir_op->arg1, R_ARG1, code_func);
-            int rm = arg_to_rX(symbols, &ir_op->arg2, R_ARG2_DEST, code_func);
             int rd = result_rx(&ir_op->result);
-            if (rd != rn) {
-                ands(rn, rm, code_func);
-                mov_r(rd, rn, code_func);
+            if (ir_op->arg2.type == irv_immediate) {
+                divide_imm(modulo, rd, rn, ir_op->arg2.immediate_value, code_func);
             } else {
-                ands(rd, rm, code_func);
+                int rm = arg_to_rX(symbols, &ir_op->arg2, R_ARG2_DEST, code_func);
+                if (rn != R_ARG1) {
+                    mov_r(R_ARG1, rn, code_func);
+                }
+                if (rm != R_ARG2_DEST) {
+                    mov_r(R_ARG2_DEST, rm, code_func);
+                }
+                bl(udivmod_function(symbols), code_func);
+                int r = modulo ? R_ARG2_DEST : R_ARG1;
+                if (rd != r) {
+                    mov_r(rd, r, code_func);
+                }
             }
             rx_to_result(symbols, &ir_op->result, rd, code_func);
             break;
@@ -530,6 +1737,105 @@ void ir_to_armv6m_inst(SymbolTable *symbols, IROp *ir_op, MachineCodeFunction *c
             next_condition = C_ALWAYS;
             break;
         }
+        case ir_jump_table: {
+            // ARMv6-M has no TBB, so the table is a run of "B" instructions that is jumped
+            // into by adding the index (times 2) to PC. PC reads 4 bytes ahead, which is
+            // the ADD and a padding NOP.
+            int r = arg_to_rX(symbols, &ir_op->arg1, R_ARG1, code_func);
+            int entries = ir_op->arg2.immediate_value;
+            if (entries <= 0xFF) {
+                cmp_imm(r, entries, code_func);
+            } else {
+                immediate_to_rX(entries, R_ARG2_DEST, code_func);
+                cmp(R_ARG2_DEST, r, code_func);
+            }
+            // the default can be further than a conditional branch reaches
+            b_skip_next(C_CARRYCLEAR, code_func);
+            b(C_ALWAYS, ir_op->target_label, code_func);
+            lsls(R_ARG1, r, 1, code_func);
+            add_pc_r(R_ARG1, code_func);
+            mov_r(8, 8, code_func);
+            break;
+        }
+        case ir_jump_table_entry: {
+            b(C_ALWAYS, ir_op->target_label, code_func);
+            break;
+        }
+
+        // Intrinsics
+        // Atomic blocks
+        case ir_atomic_begin: {
+            // PRIMASK is saved before interrupts are masked, to keep the masked part short
+            mrs(R_ARG1, SYSM_PRIMASK, code_func);
+            rx_to_result(symbols, &ir_op->result, R_ARG1, code_func);
+            cps(1, code_func);
+            if (code_func->atomic_regions_num == MAX_ATOMIC_REGIONS) {
+                PANIC("Too many atomic blocks in one function: maximum is %d\n", MAX_ATOMIC_REGIONS);
+            }
+            AtomicRegion *region = &code_func->atomic_regions[code_func->atomic_regions_num];
+            region->first = code_func->len;
+            region->last = -1;
+            open_atomic_regions[open_atomic_regions_num++] = code_func->atomic_regions_num++;
+            break;
+        }
+        case ir_atomic_end: {
+            int r = arg_to_rX(symbols, &ir_op->arg1, R_ARG1, code_func);
+            msr(SYSM_PRIMASK, r, code_func);
+            int region = open_atomic_regions[--open_atomic_regions_num];
+            code_func->atomic_regions[region].last = code_func->len - 1;
+            break;
+        }
+        case ir_intrinsic: {
+            int rm = 0;
+            if (intrinsics[ir_op->arg2.immediate_value].args_num > 0) {
+                rm = arg_to_rX(symbols, &ir_op->arg1, R_ARG1, code_func);
+            }
+            int rd = result_rx(&ir_op->result);
+            switch (ir_op->arg2.immediate_value) {
+                case intrinsic_nop: hint(HINT_NOP, code_func); break;
+                case intrinsic_wfi: hint(HINT_WFI, code_func); break;
+                case intrinsic_wfe: hint(HINT_WFE, code_func); break;
+                case intrinsic_sev: hint(HINT_SEV, code_func); break;
+                case intrinsic_dmb: barrier(BARRIER_DMB, code_func); break;
+                case intrinsic_dsb: barrier(BARRIER_DSB, code_func); break;
+                case intrinsic_isb: barrier(BARRIER_ISB, code_func); break;
+                case intrinsic_rev: rev(rd, rm, code_func); break;
+                case intrinsic_rev16: rev16(rd, rm, code_func); break;
+                case intrinsic_revsh: revsh(rd, rm, code_func); break;
+                case intrinsic_cpsid: cps(1, code_func); break;
+                case intrinsic_cpsie: cps(0, code_func); break;
+            }
+            if (intrinsics[ir_op->arg2.immediate_value].has_result) {
+                rx_to_result(symbols, &ir_op->result, rd, code_func);
+            }
+            break;
+        }
+
+        // Inline asm
+        case ir_asm: {
+            AsmBlock *block = &symbols->asm_blocks[ir_op->arg1.immediate_value];
+            bool label_pending = false;
+            for (int i = 0; i < block->instructions_len; i++) {
+                AsmInstruction *inst = &symbols->asm_instructions[block->instructions_index + i];
+                if (inst->label) {
+                    // an instruction only has one label, so a NOP carries the one before
+                    if (next_label) {
+                        mov_r(8, 8, code_func);
+                    }
+                    next_label = inst->label;
+                    label_pending = true;
+                }
+                if (inst->mnemonic.len > 0) {
+                    asm_instruction_to_armv6m(inst, code_func);
+                    label_pending = false;
+                }
+            }
+            // a label at the end of the block can't be left for the next op, which may have its own
+            if (label_pending) {
+                mov_r(8, 8, code_func);
+            }
+            break;
+        }
 
         // Copy
         case ir_copy: {
@@ -563,23 +1869,18 @@ void ir_to_armv6m_inst(SymbolTable *symbols, IROp *ir_op, MachineCodeFunction *c
             break;
         }
         case ir_return: {
-            // find interrupt handler if it exists
-            for (int i = 0; i < symbols->interrupt_handlers_num; i++) {
-                InterruptHandler *handler = &symbols->interrupt_handlers[i];
-                if (handler->func_index == func_index) {
-                    // This function is a handler, clear the interrupt flag
-                    immediate_to_rX(NVIC_ICPR, R_ARG1, code_func);
-                    ldr(R_ARG2_DEST, R_ARG1, 0, code_func);
-                    mov(2, 1, code_func);
-                    lsls(2, 2, handler->interrupt_number, code_func);
-                    orrs(R_ARG2_DEST, 2, code_func);
-                    str(R_ARG2_DEST, R_ARG1, 0, code_func);
+            if (find_interrupt_handler(symbols, func_index) != NULL) {
+                // handlers return nothing, and all share the epilogue at the end of the function.
+                // The last return falls through to it, unless it is a branch target.
+                if (ir_op != &symbols->ir_code[func->ir_code_index + func->ir_code_len - 1] || ir_op->label) {
+                    b(C_ALWAYS, ISR_EPILOGUE_LABEL, code_func);
                 }
+                break;
             }
             // normal return
             int r = arg_to_rX(symbols, &ir_op->arg1, R_ARG1, code_func);
             mov_r(0, r, code_func);
-            add_sp_imm(func->func_vars_len, code_func);
+            add_sp_imm(func->frame_size, code_func);
             pop_pc(code_func);
             break;
         }
@@ -587,12 +1888,120 @@ void ir_to_armv6m_inst(SymbolTable *symbols, IROp *ir_op, MachineCodeFunction *c
     }
 }
 
+// The registers a value is kept in, if any are temps, as a mask with bit n set for register n
+int ir_value_registers(IRValue *value) {
+    int regs = 0;
+    if (value->type == irv_temp) {
+        regs |= 1 << (value->temp_num + R_TEMP_OFFSET);
+    }
+    if (value->address_in_temp) {
+        regs |= 1 << (value->address_temp_num + R_TEMP_OFFSET);
+    }
+    if (value->offset_in_temp) {
+        regs |= 1 << (value->offset_temp_num + R_TEMP_OFFSET);
+    }
+    return regs;
+}
+
+// Exception entry already stacks r0-r3, r12, LR, PC and xPSR, so an interrupt handler
+// only has to push the temps in r4-r7 that it uses, and LR if it calls anything. A call
+// to a function can use any temp, so then all of them are pushed.
+// Returns a register list for push_list, with bit 8 set for LR.
+int interrupt_handler_saved_registers(SymbolTable *symbols, Function *func) {
+    int regs = 0;
+    bool calls = false;
+    for (int i = 0; i < func->ir_code_len; i++) {
+        IROp *ir_op = &symbols->ir_code[func->ir_code_index + i];
+        regs |= ir_value_registers(&ir_op->result);
+        regs |= ir_value_registers(&ir_op->arg1);
+        regs |= ir_value_registers(&ir_op->arg2);
+        if (ir_op->opcode == ir_asm) {
+            regs |= symbols->asm_blocks[ir_op->arg1.immediate_value].clobbers;
+        }
+        if (ir_op->opcode == ir_call) {
+            calls = true;
+            regs |= 0xff;
+        }
+        if ((ir_op->opcode == ir_divide || ir_op->opcode == ir_modulo) && ir_op->arg2.type != irv_immediate) {
+            // ____udivmod only uses r0-r3
+            calls = true;
+        }
+    }
+    regs &= 0xff & ~((1 << R_CALLEE_SAVED_FIRST) - 1);
+    if (calls) {
+        regs |= 1 << 8;
+    }
+    return regs;
+}
+
+// An interrupt handler is entered straight from the vector table. After whatever it had to
+// save is popped, PC is loaded with the EXC_RETURN value that the exception put in LR,
+// which makes the core unstack the rest. The pending flag is cleared with a single store,
+// since writing a 0 bit to ICPR does nothing.
+void interrupt_handler_to_armv6m(SymbolTable *symbols, MachineCodeFunction *code_func, int func_index, InterruptHandler *handler) {
+    Function *func = &symbols->functions[func_index];
+    int saved = interrupt_handler_saved_registers(symbols, func);
+    if (saved) {
+        push_list(saved, code_func);
+    }
+    if (func->frame_size > 0) {
+        sub_sp_imm(func->frame_size, code_func);
+    }
+    for (int i = 0; i < func->ir_code_len; i++) {
+        ir_to_armv6m_inst(symbols, &symbols->ir_code[func->ir_code_index + i], code_func, func_index);
+    }
+    next_label = ISR_EPILOGUE_LABEL;
+    if (handler->count_var != -1) {
+        // tasks in await_irq wait for the count to change
+        int imm;
+        int address_r = static_var_address_to_rX(&symbols->static_vars[handler->count_var], R_ARG1, &imm, code_func);
+        ldr(R_ARG2_DEST, address_r, imm, code_func);
+        adds_imm(R_ARG2_DEST, 1, code_func);
+        str(R_ARG2_DEST, address_r, imm, code_func);
+        tasks_runnable_to_armv6m(symbols, code_func);
+    }
+    immediate_to_rX(NVIC_ICPR, R_ARG1, code_func);
+    mov(R_ARG2_DEST, 1, code_func);
+    lsls(R_ARG2_DEST, R_ARG2_DEST, handler->interrupt_number, code_func);
+    str(R_ARG2_DEST, R_ARG1, 0, code_func);
+    if (func->frame_size > 0) {
+        add_sp_imm(func->frame_size, code_func);
+    }
+    if (saved & (1 << 8)) {
+        pop_list(saved, code_func);
+    } else {
+        if (saved) {
+            pop_list(saved, code_func);
+        }
+        bx(R_LR, code_func);
+    }
+}
+
 void ir_to_armv6m_function(SymbolTable *symbols, MachineCodeFunction *code_func, int func_index) {
     Function *func = &symbols->functions[func_index];
+    if (func->frame_size > MAX_FRAME_SIZE) {
+        STRINGREF_TO_CSTR1(&func->name, 512);
+        PANIC("Too many local variables in function '%s'\n", cstr1);
+    }
+    open_atomic_regions_num = 0;
+    sync_waits_num = 0;
+    InterruptHandler *handler = find_interrupt_handler(symbols, func_index);
+    if (handler != NULL) {
+        interrupt_handler_to_armv6m(symbols, code_func, func_index, handler);
+        return;
+    }
     push_lr(code_func);
-    sub_sp_imm(func->func_vars_len, code_func);
+    sub_sp_imm(func->frame_size, code_func);
+    if (func_index == INIT_FUNC_INDEX) {
+        static_vars_to_armv6m(symbols, code_func);
+    }
     for (int i = 0; i < func->ir_code_len; i++) {
-        ir_to_armv6m_inst(symbols, &symbols->ir_code[func->ir_code_index + i], code_func, func_index);
+        IROp *ir_op = &symbols->ir_code[func->ir_code_index + i];
+        if (func_index == INIT_FUNC_INDEX && op_is_register_init(ir_op)) {
+            i += register_inits_to_armv6m(symbols, ir_op, func->ir_code_len - i, code_func) - 1;
+            continue;
+        }
+        ir_to_armv6m_inst(symbols, ir_op, code_func, func_index);
     }
 }
 
@@ -619,27 +2028,233 @@ void fill_local_branches(MachineCodeFunction *code_func) {
     }
 }
 
+// How many cycles an instruction takes on the Cortex-M0+, taking branches. op is the
+// first half of 32-bit instructions.
+int armv6m_op_cycles(ARMv6Op *op) {
+    int top4 = op->code >> 12;
+    if ((op->code >> BL_INIT_OPCODE_OFFSET) == BL_INIT_OPCODE) {
+        // BL, MRS, MSR and the barriers
+        return 3;
+    } else if (top4 >= 0b0101 && top4 <= 0b1001) {
+        // loads and stores
+        return 2;
+    } else if ((op->code >> STMIA_OPCODE_OFFSET) == STMIA_OPCODE) {
+        int regs = 0;
+        for (int r = 0; r < 8; r++) {
+            regs += (op->code >> r) & 1;
+        }
+        return 1 + regs;
+    } else if ((op->code >> PUSH_OPCODE_OFFSET) == PUSH_OPCODE || (op->code >> POP_OPCODE_OFFSET) == POP_OPCODE) {
+        int regs = 0;
+        for (int r = 0; r < 8; r++) {
+            regs += (op->code >> r) & 1;
+        }
+        bool pop_pc = (op->code >> POP_OPCODE_OFFSET) == POP_OPCODE && (op->code & (1 << 8));
+        return 1 + regs + ((op->code >> 8) & 1) + (pop_pc ? 2 : 0);
+    } else if ((op->code >> B_OPCODE_OFFSET) == B_OPCODE
+            || (op->code >> B_ALWAYS_OPCODE_OFFSET) == B_ALWAYS_OPCODE
+            || (op->code >> BX_OPCODE_OFFSET) == BX_OPCODE
+            || (op->code >> ADD_PC_R_OPCODE_OFFSET) == ADD_PC_R_OPCODE) {
+        return 2;
+    } else if ((op->code >> HINT_OPCODE_OFFSET) == HINT_OPCODE && ((op->code >> 4) & 0b1111) != HINT_NOP && ((op->code >> 4) & 0b1111) != HINT_SEV) {
+        // WFI and WFE
+        return 2;
+    }
+    return 1;
+}
+
+// The most cycles that running ops first to last of a function can take, counting every
+// branch as taken and adding the cost of the functions it calls. Returns -1 if there is
+// no bound, because a branch goes backwards (a loop) or a called function has no bound.
+int worst_case_cycles(MachineCode *code, int func_index, int first, int last, int depth) {
+    MachineCodeFunction *code_func = &code->functions[func_index];
+    int cycles = 0;
+    for (int i = first; i <= last; i++) {
+        ARMv6Op *op = &code_func->ops[i];
+        if (op->target_label) {
+            for (int j = 0; j <= i; j++) {
+                if (code_func->ops[j].label == op->target_label) {
+                    return -1;
+                }
+            }
+        }
+        if (op->target_function) {
+            if (depth == MAX_CALL_DEPTH) {
+                return -1;
+            }
+            MachineCodeFunction *callee = &code->functions[op->target_function];
+            int callee_cycles = worst_case_cycles(code, op->target_function, 0, callee->len - 1, depth + 1);
+            if (callee_cycles == -1) {
+                return -1;
+            }
+            cycles += callee_cycles;
+        }
+        cycles += armv6m_op_cycles(op);
+        if ((op->code >> BL_INIT_OPCODE_OFFSET) == BL_INIT_OPCODE) {
+            // skip the second half
+            i++;
+        }
+    }
+    return cycles;
+}
+
+// Sets the priorities of the interrupt handlers that have one, before they are enabled.
+// ARMv6-M can only write whole IPR words, so the priorities in each word are combined
+// and it is written once. The other interrupts in the word keep the reset priority of 0.
+void interrupt_priorities_to_armv6m(SymbolTable *symbols, MachineCodeFunction *init_code) {
+    uint32_t words[NVIC_IPR_WORDS] = {0};
+    bool words_used[NVIC_IPR_WORDS] = {0};
+    bool any_used = false;
+    for (int i = 0; i < symbols->interrupt_handlers_num; i++) {
+        InterruptHandler *handler = &symbols->interrupt_handlers[i];
+        if (handler->priority == -1) {
+            continue;
+        }
+        int word = handler->interrupt_number / 4;
+        if (word >= NVIC_IPR_WORDS) {
+            PANIC("Interrupt number %d is too big: maximum is %d\n", handler->interrupt_number, NVIC_IPR_WORDS * 4 - 1);
+        }
+        int shift = (handler->interrupt_number % 4) * 8 + NVIC_PRIORITY_SHIFT;
+        words[word] |= (uint32_t)handler->priority << shift;
+        words_used[word] = true;
+        any_used = true;
+    }
+    if (!any_used) {
+        return;
+    }
+    immediate_to_rX(NVIC_IPR, R_ARG1, init_code);
+    for (int word = 0; word < NVIC_IPR_WORDS; word++) {
+        if (words_used[word]) {
+            immediate_to_rX(words[word], R_ARG2_DEST, init_code);
+            str(R_ARG2_DEST, R_ARG1, word, init_code);
+        }
+    }
+}
+
+// The end of ____init, which loops forever. Each time around, the loop calls the "idle"
+// function if the program has one and then each task, then sleeps until an interrupt
+// (unless the idle mode is "spin", or a task yielded). The sleep bits in the SCB are set
+// first, if they are needed.
+void idle_to_armv6m(SymbolTable *symbols, MachineCodeFunction *init_code) {
+    int scr_bits = 0;
+    if (options.idle_mode == idle_deep) {
+        scr_bits |= SCR_SLEEPDEEP;
+    }
+    if (options.sleep_on_exit) {
+        scr_bits |= SCR_SLEEPONEXIT;
+    }
+    if (scr_bits) {
+        immediate_to_rX(SCB_SCR, R_ARG1, init_code);
+        ldr(R_ARG2_DEST, R_ARG1, 0, init_code);
+        mov(2, scr_bits, init_code);
+        orrs(R_ARG2_DEST, 2, init_code);
+        str(R_ARG2_DEST, R_ARG1, 0, init_code);
+    }
+
+    StringRef idle_name = {"idle", 4};
+    int idle_func_index = find_function_index(symbols, &idle_name);
+    if (idle_func_index != -1 && symbols->functions[idle_func_index].func_args_len != 0) {
+        PANIC("The idle function can't have arguments\n");
+    }
+    if (options.sleep_on_exit && symbols->tasks_num > 0) {
+        PANIC("Tasks can't be used with --sleep-on-exit, since the main loop would never run\n");
+    }
+    next_label = 99999;
+    if (idle_func_index != -1) {
+        bl(idle_func_index, init_code);
+    }
+    // each task runs until it stops, in turn
+    for (int i = 0; i < symbols->tasks_num; i++) {
+        bl(symbols->tasks[i].func_index, init_code);
+    }
+    StringRef runnable_name = {"____tasks_runnable", 18};
+    int runnable_var = find_static_variable(symbols, &runnable_name);
+    if (symbols->defer_queues_num == 0 && runnable_var == -1) {
+        if (options.idle_mode != idle_spin) {
+            hint(HINT_WFI, init_code);
+        }
+        b(C_ALWAYS, 99999, init_code);
+        return;
+    }
+
+    // With deferred calls the loop also runs ____drain. It only sleeps if no task can run
+    // and every queue is empty, which is checked with interrupts masked so that a handler
+    // can't wake a task or add a call between the check and the WFI. A masked interrupt
+    // still wakes the WFI. The runnable flag is cleared for the next time around.
+    if (options.sleep_on_exit && symbols->defer_queues_num > 0) {
+        PANIC("defer can't be used with --sleep-on-exit, since the main loop would never run\n");
+    }
+    if (options.idle_mode != idle_spin) {
+        // the runnable flag's address is kept in r2, which the queue checks don't use
+        int runnable_imm = 0;
+        int runnable_r = 0;
+        cps(1, init_code);
+        if (runnable_var != -1) {
+            runnable_r = static_var_address_to_rX(&symbols->static_vars[runnable_var], 2, &runnable_imm, init_code);
+            ldrb(R_ARG2_DEST, runnable_r, runnable_imm, init_code);
+            cmp_imm(R_ARG2_DEST, 0, init_code);
+            b(C_NOTEQUALS, 99997, init_code);
+        }
+        for (int i = 0; i < symbols->defer_queues_num; i++) {
+            DeferQueue *queue = &symbols->defer_queues[i];
+            int head_imm, tail_imm;
+            int head_r = static_var_address_to_rX(&symbols->static_vars[queue->head_var], R_ARG1, &head_imm, init_code);
+            ldrb(R_ARG1, head_r, head_imm, init_code);
+            int tail_r = static_var_address_to_rX(&symbols->static_vars[queue->tail_var], R_ARG2_DEST, &tail_imm, init_code);
+            ldrb(R_ARG2_DEST, tail_r, tail_imm, init_code);
+            cmp(R_ARG1, R_ARG2_DEST, init_code);
+            b(C_NOTEQUALS, 99997, init_code);
+        }
+        hint(HINT_WFI, init_code);
+        next_label = 99997;
+        if (runnable_var != -1) {
+            mov(R_ARG2_DEST, 0, init_code);
+            strb(R_ARG2_DEST, runnable_r, runnable_imm, init_code);
+        }
+        cps(0, init_code);
+    }
+    if (symbols->defer_queues_num > 0) {
+        bl(drain_function(symbols), init_code);
+    }
+    b(C_ALWAYS, 99999, init_code);
+}
+
 void ir_to_armv6m(SymbolTable *symbols, MachineCode *code) {
-    for (int i = 0; i < symbols->functions_num; i++) {
+    if (symbols->functions_num > MAX_FUNCTIONS) {
+        PANIC("Too many functions: maximum is %d\n", MAX_FUNCTIONS);
+    }
+    // ____udivmod can be added while translating, and has no IR
+    int functions_num = symbols->functions_num;
+    for (int i = 0; i < functions_num; i++) {
         ir_to_armv6m_function(symbols, &code->functions[i], i);
     }
 
     // Enable interrupts at end of ____init if we have any
     MachineCodeFunction *init_code = &code->functions[0];
+    tasks_to_armv6m(symbols, init_code);
+    interrupt_priorities_to_armv6m(symbols, init_code);
     if (symbols->interrupt_handlers_num > 0) {
-        immediate_to_rX(NVIC_ISER, R_ARG1, init_code);
-        ldr(R_ARG2_DEST, R_ARG1, 0, init_code);
+        // writing a 0 bit to ISER does nothing, so the handlers' bits are all written at
+        // once, without reading it first
+        uint32_t mask = 0;
         for (int i = 0; i < symbols->interrupt_handlers_num; i++) {
-            InterruptHandler *int_handler = &symbols->interrupt_handlers[i];
-            mov(2, 1, init_code);
-            lsls(2, 2, int_handler->interrupt_number, init_code);
-            orrs(R_ARG2_DEST, 2, init_code);
+            mask |= 1u << symbols->interrupt_handlers[i].interrupt_number;
         }
+        immediate_to_rX(NVIC_ISER, R_ARG1, init_code);
+        immediate_to_rX(mask, R_ARG2_DEST, init_code);
         str(R_ARG2_DEST, R_ARG1, 0, init_code);
     }
-    // loop forever
-    next_label = 99999;
-    b(C_ALWAYS, 99999, init_code);
+    idle_to_armv6m(symbols, init_code);
+
+    if (udivmod_func_index != 0) {
+        udivmod_to_armv6m(&code->functions[udivmod_func_index]);
+    }
+    if (drain_func_index != 0) {
+        drain_to_armv6m(symbols, &code->functions[drain_func_index]);
+    }
+    if (systick_func_index != 0) {
+        systick_to_armv6m(symbols, &code->functions[systick_func_index]);
+    }
 
     // fill in branches
     for (int i = 0; i < symbols->functions_num; i++) {
@@ -666,6 +2281,29 @@ void print_uint16_t_binary(uint16_t i) {
     printf("%d", i & 0x1);
 }
 
+// Prints the registers of a PUSH or POP, where bit 8 is LR or PC
+void print_register_list(int registers, char *r8_name) {
+    int printed = 0;
+    printf("{");
+    for (int i = 0; i < 9; i++) {
+        if (registers & (1 << i)) {
+            if (printed > 0) {
+                printf(", ");
+            }
+            if (i == 8) {
+                printf("%s", r8_name);
+            } else {
+                printf("R%d", i);
+            }
+            printed++;
+        }
+    }
+    printf("}");
+    for (int i = printed * 4; i < 16; i++) {
+        printf(" ");
+    }
+}
+
 bool double_op = false;
 uint16_t op_init = 0;
 ARMv6Op op_init_op = {0};
@@ -690,10 +2328,19 @@ void print_op_machine_code(SymbolTable *symbols, ARMv6Op *op, int i) {
     } else {
         double_op = false;
     }
-    if (op->code == MRS_INIT) {
-        op_init = MRS_INIT;
+    if (op->code == MRS_INIT || op->code == BARRIER_INIT || (op->code & ~0b1111) == MSR_INIT) {
+        op_init = op->code;
         op_init_op = *op;
         double_op = true;
+    } else if ((op_init == BARRIER_INIT) && ((op->code >> BARRIER_OPCODE_OFFSET) == BARRIER_OPCODE)) {
+        int type = (op->code & 0b0000000011110000) >> 4;
+        printf("%s SY              ", type == BARRIER_DMB ? "DMB" : type == BARRIER_DSB ? "DSB" : "ISB");
+        printf("\t(");
+        print_uint16_t_binary(BARRIER_INIT);
+        printf("  ");
+        print_uint16_t_binary(op->code);
+        printf(")\n");
+        op_init = 0;
     } else if ((op_init == MRS_INIT) && ((op->code >> MRS_OPCODE_OFFSET) == MRS_OPCODE)) {
         printf(
             "MRS R%d, Spec0x%x      ",
@@ -706,6 +2353,18 @@ void print_op_machine_code(SymbolTable *symbols, ARMv6Op *op, int i) {
         print_uint16_t_binary(op->code);
         printf(")\n");
         op_init = 0;
+    } else if (((op_init & ~0b1111) == MSR_INIT) && ((op->code >> MSR_OPCODE_OFFSET) == MSR_OPCODE)) {
+        printf(
+            "MSR Spec0x%x, R%d      ",
+            (op->code & 0b0000000011111111) >> 0,
+            (op_init & 0b0000000000001111) >> 0
+        );
+        printf("\t(");
+        print_uint16_t_binary(op_init);
+        printf("  ");
+        print_uint16_t_binary(op->code);
+        printf(")\n");
+        op_init = 0;
     } else if ((op->code >> BL_INIT_OPCODE_OFFSET) == BL_INIT_OPCODE) {
         op_init = op->code;
         op_init_op = *op;
@@ -732,11 +2391,7 @@ void print_op_machine_code(SymbolTable *symbols, ARMv6Op *op, int i) {
             offset |= 0b1111111000000000;
         }
         int16_t offset_s = offset + 4;
-        if (cond == C_EQUALS) {
-            printf("BEQ %d               ", offset_s);
-        } else if (cond == C_LESSTHAN) {
-            printf("BLT %d               ", offset_s);
-        }
+        printf("B%s %d               ", condition_names[cond], offset_s);
         printf("\t("); print_uint16_t_binary(op->code); printf(")\n");
     } else if ((op->code >> B_ALWAYS_OPCODE_OFFSET) == B_ALWAYS_OPCODE) {
         uint16_t offset = op->code & 0b11111111111;
@@ -762,6 +2417,26 @@ void print_op_machine_code(SymbolTable *symbols, ARMv6Op *op, int i) {
             (op->code & 0b0000000011111111) >> 0
         );
         printf("\t("); print_uint16_t_binary(op->code); printf(")\n");
+    } else if ((op->code >> ADD_SP_R_OPCODE_OFFSET) == ADD_SP_R_OPCODE) {
+        printf(
+            "ADD R%d, SP, R%d        ",
+            (op->code & 0b0000000000000111) >> 0,
+            (op->code & 0b0000000000000111) >> 0
+        );
+        printf("\t("); print_uint16_t_binary(op->code); printf(")\n");
+    } else if ((op->code >> ADD_PC_R_OPCODE_OFFSET) == ADD_PC_R_OPCODE && (op->code & 0b111) == 0b111) {
+        printf(
+            "ADD PC, R%d            ",
+            (op->code & 0b0000000001111000) >> 3
+        );
+        printf("\t("); print_uint16_t_binary(op->code); printf(")\n");
+    } else if ((op->code >> ADD_R_SP_IMM_OPCODE_OFFSET) == ADD_R_SP_IMM_OPCODE) {
+        printf(
+            "ADD R%d, SP, #0x%x     ",
+            (op->code & 0b0000011100000000) >> 8,
+            ((op->code & 0b0000000011111111) >> 0) << 2
+        );
+        printf("\t("); print_uint16_t_binary(op->code); printf(")\n");
     } else if ((op->code >> ADD_SP_IMM_OPCODE_OFFSET) == ADD_SP_IMM_OPCODE) {
         printf(
             "ADD SP, SP, #0x%x        ",
@@ -806,6 +2481,12 @@ void print_op_machine_code(SymbolTable *symbols, ARMv6Op *op, int i) {
             (op->code & 0b0000000001111000) >> 3
         );
         printf("\t("); print_uint16_t_binary(op->code); printf(")\n");
+    } else if ((op->code >> BX_OPCODE_OFFSET) == BX_OPCODE) {
+        printf(
+            "BX R%d                 ",
+            (op->code & 0b0000000001111000) >> 3
+        );
+        printf("\t("); print_uint16_t_binary(op->code); printf(")\n");
     } else if ((op->code >> LSLS_OPCODE_OFFSET) == LSLS_OPCODE) {
         printf(
             "LSLS R%d, R%d, #0x%x    ",
@@ -821,9 +2502,31 @@ void print_op_machine_code(SymbolTable *symbols, ARMv6Op *op, int i) {
             (op->code & 0b0000000000111000) >> 3
         );
         printf("\t("); print_uint16_t_binary(op->code); printf(")\n");
-    } else if ((op->code >> ASRS_R_OPCODE_OFFSET) == ASRS_R_OPCODE) {
+    } else if ((op->code >> LSRS_OPCODE_OFFSET) == LSRS_OPCODE) {
+        printf(
+            "LSRS R%d, R%d, #0x%x    ",
+            (op->code & 0b0000000000000111) >> 0,
+            (op->code & 0b0000000000111000) >> 3,
+            (op->code & 0b0000011111000000) >> 6
+        );
+        printf("\t("); print_uint16_t_binary(op->code); printf(")\n");
+    } else if ((op->code >> EORS_OPCODE_OFFSET) == EORS_OPCODE) {
+        printf(
+            "EORS R%d, R%d          ",
+            (op->code & 0b0000000000000111) >> 0,
+            (op->code & 0b0000000000111000) >> 3
+        );
+        printf("\t("); print_uint16_t_binary(op->code); printf(")\n");
+    } else if ((op->code >> MVNS_OPCODE_OFFSET) == MVNS_OPCODE) {
+        printf(
+            "MVNS R%d, R%d          ",
+            (op->code & 0b0000000000000111) >> 0,
+            (op->code & 0b0000000000111000) >> 3
+        );
+        printf("\t("); print_uint16_t_binary(op->code); printf(")\n");
+    } else if ((op->code >> LSRS_R_OPCODE_OFFSET) == LSRS_R_OPCODE) {
         printf(
-            "ASRS R%d, R%d          ",
+            "LSRS R%d, R%d          ",
             (op->code & 0b0000000000000111) >> 0,
             (op->code & 0b0000000000111000) >> 3
         );
@@ -842,6 +2545,13 @@ void print_op_machine_code(SymbolTable *symbols, ARMv6Op *op, int i) {
             (op->code & 0b0000000000111000) >> 3
         );
         printf("\t("); print_uint16_t_binary(op->code); printf(")\n");
+    } else if ((op->code >> BICS_OPCODE_OFFSET) == BICS_OPCODE) {
+        printf(
+            "BICS R%d, R%d          ",
+            (op->code & 0b0000000000000111) >> 0,
+            (op->code & 0b0000000000111000) >> 3
+        );
+        printf("\t("); print_uint16_t_binary(op->code); printf(")\n");
     } else if ((op->code >> STR_OPCODE_OFFSET) == STR_OPCODE) {
         printf(
             "STR R%d, [R%d + #0x%x]  ",
@@ -890,6 +2600,54 @@ void print_op_machine_code(SymbolTable *symbols, ARMv6Op *op, int i) {
             (op->code & 0b0000011111000000) >> 6
         );
         printf("\t("); print_uint16_t_binary(op->code); printf(")\n");
+    } else if ((op->code >> STR_R_OPCODE_OFFSET) == STR_R_OPCODE) {
+        printf(
+            "STR R%d, [R%d + R%d]     ",
+            (op->code & 0b0000000000000111) >> 0,
+            (op->code & 0b0000000000111000) >> 3,
+            (op->code & 0b0000000111000000) >> 6
+        );
+        printf("\t("); print_uint16_t_binary(op->code); printf(")\n");
+    } else if ((op->code >> STRH_R_OPCODE_OFFSET) == STRH_R_OPCODE) {
+        printf(
+            "STRH R%d, [R%d + R%d]    ",
+            (op->code & 0b0000000000000111) >> 0,
+            (op->code & 0b0000000000111000) >> 3,
+            (op->code & 0b0000000111000000) >> 6
+        );
+        printf("\t("); print_uint16_t_binary(op->code); printf(")\n");
+    } else if ((op->code >> STRB_R_OPCODE_OFFSET) == STRB_R_OPCODE) {
+        printf(
+            "STRB R%d, [R%d + R%d]    ",
+            (op->code & 0b0000000000000111) >> 0,
+            (op->code & 0b0000000000111000) >> 3,
+            (op->code & 0b0000000111000000) >> 6
+        );
+        printf("\t("); print_uint16_t_binary(op->code); printf(")\n");
+    } else if ((op->code >> LDR_R_OPCODE_OFFSET) == LDR_R_OPCODE) {
+        printf(
+            "LDR R%d, [R%d + R%d]     ",
+            (op->code & 0b0000000000000111) >> 0,
+            (op->code & 0b0000000000111000) >> 3,
+            (op->code & 0b0000000111000000) >> 6
+        );
+        printf("\t("); print_uint16_t_binary(op->code); printf(")\n");
+    } else if ((op->code >> LDRH_R_OPCODE_OFFSET) == LDRH_R_OPCODE) {
+        printf(
+            "LDRH R%d, [R%d + R%d]    ",
+            (op->code & 0b0000000000000111) >> 0,
+            (op->code & 0b0000000000111000) >> 3,
+            (op->code & 0b0000000111000000) >> 6
+        );
+        printf("\t("); print_uint16_t_binary(op->code); printf(")\n");
+    } else if ((op->code >> LDRB_R_OPCODE_OFFSET) == LDRB_R_OPCODE) {
+        printf(
+            "LDRB R%d, [R%d + R%d]    ",
+            (op->code & 0b0000000000000111) >> 0,
+            (op->code & 0b0000000000111000) >> 3,
+            (op->code & 0b0000000111000000) >> 6
+        );
+        printf("\t("); print_uint16_t_binary(op->code); printf(")\n");
     } else if ((op->code >> CMP_OPCODE_OFFSET) == CMP_OPCODE) {
         printf(
             "CMP R%d, R%d           ",
@@ -897,37 +2655,57 @@ void print_op_machine_code(SymbolTable *symbols, ARMv6Op *op, int i) {
             (op->code & 0b0000000000111000) >> 3
         );
         printf("\t("); print_uint16_t_binary(op->code); printf(")\n");
+    } else if ((op->code >> CMP_IMM_OPCODE_OFFSET) == CMP_IMM_OPCODE) {
+        printf(
+            "CMP R%d, #%-3d         ",
+            (op->code & 0b0000011100000000) >> 8,
+            (op->code & 0b0000000011111111) >> 0
+        );
+        printf("\t("); print_uint16_t_binary(op->code); printf(")\n");
+    } else if ((op->code >> MULS_OPCODE_OFFSET) == MULS_OPCODE) {
+        printf(
+            "MULS R%d, R%d          ",
+            (op->code & 0b0000000000000111) >> 0,
+            (op->code & 0b0000000000111000) >> 3
+        );
+        printf("\t("); print_uint16_t_binary(op->code); printf(")\n");
+    } else if ((op->code >> ADCS_OPCODE_OFFSET) == ADCS_OPCODE) {
+        printf(
+            "ADCS R%d, R%d          ",
+            (op->code & 0b0000000000000111) >> 0,
+            (op->code & 0b0000000000111000) >> 3
+        );
+        printf("\t("); print_uint16_t_binary(op->code); printf(")\n");
+    } else if ((op->code >> HINT_OPCODE_OFFSET) == HINT_OPCODE) {
+        int hint = (op->code & 0b0000000011110000) >> 4;
+        printf("%s                 ", hint == HINT_WFI ? "WFI" : hint == HINT_WFE ? "WFE" : hint == HINT_SEV ? "SEV" : "NOP");
+        printf("\t("); print_uint16_t_binary(op->code); printf(")\n");
+    } else if ((op->code >> REV_OPCODE_OFFSET) == REV_OPCODE
+            || (op->code >> REV16_OPCODE_OFFSET) == REV16_OPCODE
+            || (op->code >> REVSH_OPCODE_OFFSET) == REVSH_OPCODE) {
+        char *name = (op->code >> REV_OPCODE_OFFSET) == REV_OPCODE ? "REV"
+            : (op->code >> REV16_OPCODE_OFFSET) == REV16_OPCODE ? "REV16" : "REVSH";
+        printf(
+            "%s R%d, R%d         ",
+            name,
+            (op->code & 0b0000000000000111) >> 0,
+            (op->code & 0b0000000000111000) >> 3
+        );
+        printf("\t("); print_uint16_t_binary(op->code); printf(")\n");
+    } else if ((op->code >> CPS_OPCODE_OFFSET) == CPS_OPCODE) {
+        printf("%s i               ", (op->code >> 4) & CPS_DISABLE ? "CPSID" : "CPSIE");
+        printf("\t("); print_uint16_t_binary(op->code); printf(")\n");
+    } else if ((op->code >> STMIA_OPCODE_OFFSET) == STMIA_OPCODE) {
+        printf("STMIA R%d!, ", (op->code >> 8) & 0b111);
+        print_register_list(op->code & 0b11111111, "");
+        printf("\t("); print_uint16_t_binary(op->code); printf(")\n");
     } else if ((op->code >> PUSH_OPCODE_OFFSET) == PUSH_OPCODE) {
-        int registers = op->code & 0b111111111;
-        // we only support one register at a time
-        int r = -1;
-        for (int i = 0; i < 9; i++) {
-            if ((registers >> i) == 1) {
-                r = i;
-                break;
-            }
-        }
-        if (r == 8) {
-            printf("PUSH LR              ");
-        } else {
-            printf("PUSH R%d              ", r);
-        }
+        printf("PUSH ");
+        print_register_list(op->code & 0b111111111, "LR");
         printf("\t("); print_uint16_t_binary(op->code); printf(")\n");
     } else if ((op->code >> POP_OPCODE_OFFSET) == POP_OPCODE) {
-        int registers = op->code & 0b111111111;
-        // we only support one register at a time
-        int r = -1;
-        for (int i = 0; i < 9; i++) {
-            if ((registers >> i) == 1) {
-                r = i;
-                break;
-            }
-        }
-        if (r == 8) {
-            printf("POP PC               ");
-        } else {
-            printf("POP R%d               ", r);
-        }
+        printf("POP ");
+        print_register_list(op->code & 0b111111111, "PC");
         printf("\t("); print_uint16_t_binary(op->code); printf(")\n");
     } else {
         PANIC("UNIDENTIFIED ARMv6-M OPCODE: %x\n", op->code);
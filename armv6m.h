@@ -13,16 +13,31 @@ typedef struct _ARMv6Op {
     uint16_t code;
 } ARMv6Op;
 
+#define MAX_FUNCTION_OPS 2048
+#define MAX_ATOMIC_REGIONS 16
+
+// The ops that run with interrupts masked by an atomic block: from the one after its
+// CPSID to the MSR that puts PRIMASK back. last is -1 if the block never ends.
+typedef struct _AtomicRegion {
+    int first;
+    int last;
+} AtomicRegion;
+
 typedef struct _MachineCodeFunction {
-    ARMv6Op ops[512];
+    ARMv6Op ops[MAX_FUNCTION_OPS];
     int len;
+    bool removed; // set by the linker if nothing can call this function
+    AtomicRegion atomic_regions[MAX_ATOMIC_REGIONS];
+    int atomic_regions_num;
 } MachineCodeFunction;
 
 typedef struct _MachineCode {
-    MachineCodeFunction functions[16];
+    MachineCodeFunction functions[MAX_FUNCTIONS];
 } MachineCode;
 
+bool static_var_near_gp(Variable *var);
 void ir_to_armv6m(SymbolTable *symbols, MachineCode *code);
+int worst_case_cycles(MachineCode *code, int func_index, int first, int last, int depth);
 void print_all_machine_code(SymbolTable *symbols, MachineCode *code);
 void write_function_object_code(SymbolTable *symbols, MachineCode *code);
 
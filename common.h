@@ -36,4 +36,22 @@ typedef struct _StringRef {
 // A comparison function for StringRefs, defined in common.c
 bool string_ref_eq(StringRef *s1, StringRef *s2);
 
+// What ____init does once initialization is done. All the work happens in interrupt
+// handlers (and the "idle" function if there is one), so by default the core sleeps.
+typedef enum _IdleMode {
+    idle_wfi, // sleep with WFI until the next interrupt, in a loop
+    idle_deep, // the same, but with SLEEPDEEP set so the clocks stop too
+    idle_spin // loop without sleeping
+} IdleMode;
+
+// Command-line options. These are set once in main.c and read by the later passes.
+typedef struct _Options {
+    char *map_file_name; // NULL if no link map was requested
+    IdleMode idle_mode;
+    bool sleep_on_exit; // go back to sleep after interrupt handlers instead of to the idle loop
+    int tick_cycles; // the SysTick period for sleep_ticks in core clock cycles, 0 for the default
+    bool gp; // keep the start of RAM in r7, so statics can be reached from it (see R_GP in armv6m.c)
+} Options;
+extern Options options;
+
 #endif
\ No newline at end of file
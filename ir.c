@@ -0,0 +1,19 @@
+// This file contains the tables that go with the IR definitions in ir.h
+
+#include "ir.h"
+
+// This is indexed by IntrinsicId
+Intrinsic intrinsics[INTRINSICS_NUM] = {
+    {"__nop", 0, false, 1, 1, INTRINSIC_SIDE_EFFECTS},
+    {"__wfi", 0, false, 1, 2, INTRINSIC_SIDE_EFFECTS | INTRINSIC_MEMORY},
+    {"__wfe", 0, false, 1, 2, INTRINSIC_SIDE_EFFECTS | INTRINSIC_MEMORY},
+    {"__sev", 0, false, 1, 1, INTRINSIC_SIDE_EFFECTS},
+    {"__dmb", 0, false, 2, 3, INTRINSIC_SIDE_EFFECTS | INTRINSIC_MEMORY},
+    {"__dsb", 0, false, 2, 3, INTRINSIC_SIDE_EFFECTS | INTRINSIC_MEMORY},
+    {"__isb", 0, false, 2, 3, INTRINSIC_SIDE_EFFECTS | INTRINSIC_MEMORY},
+    {"__rev", 1, true, 1, 1, 0},
+    {"__rev16", 1, true, 1, 1, 0},
+    {"__revsh", 1, true, 1, 1, 0},
+    {"__cpsid", 0, false, 1, 1, INTRINSIC_SIDE_EFFECTS | INTRINSIC_MEMORY},
+    {"__cpsie", 0, false, 1, 1, INTRINSIC_SIDE_EFFECTS | INTRINSIC_MEMORY},
+};
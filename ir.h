@@ -1,6 +1,8 @@
 #ifndef IR_H
 #define IR_H
 
+#include <stdbool.h>
+
 // This enumerates all the types of IROps available
 // They are grouped by how they use the result, arg1, and arg2 values
 typedef enum _IROpCode {
@@ -10,6 +12,11 @@ typedef enum _IROpCode {
     ir_shift_left,
     ir_shift_right,
     ir_bitwise_and,
+    ir_bitwise_or,
+    ir_bitwise_xor,
+    ir_multiply,
+    ir_divide,
+    ir_modulo,
     ir_equals,
     ir_less_than,
     ir_greater_than,
@@ -21,13 +28,29 @@ typedef enum _IROpCode {
     ir_goto,
     // if arg1 != 0, then jump to target_label
     ir_if,
+    // jump to the arg1'th of the arg2 ir_jump_table_entry ops that follow, or to
+    // target_label if arg1 (unsigned) isn't less than arg2
+    ir_jump_table,
+    // one entry of a jump table: jump to target_label
+    ir_jump_table_entry,
 
     // arg1 used as param to upcoming function call
     ir_param,
     // call function in arg1
     ir_call,
     // return arg1 from function
-    ir_return
+    ir_return,
+
+    // the asm block with index arg1 (an immediate)
+    // it reads and writes the temps bound to its variables, and clobbers all other temps
+    ir_asm,
+    // start of an atomic block: save PRIMASK in result (a local variable), then mask interrupts
+    ir_atomic_begin,
+    // end of an atomic block: put back the PRIMASK saved in arg1
+    ir_atomic_end,
+    // result = the intrinsic arg2 (an immediate IntrinsicId) of arg1
+    // intrinsics without an argument don't read arg1, and ones without a value don't write result
+    ir_intrinsic
 } IROpCode;
 typedef enum _IRValueType {
     irv_function,
@@ -48,6 +71,14 @@ typedef struct _IRValue {
     int mmp_struct_item_index;
     int immediate_value;
     int temp_num;
+    // for static variables and mmp struct items, the optimizer can load the address
+    // into a temp once (e.g. before a loop) instead of every time the value is used
+    bool address_in_temp;
+    int address_temp_num;
+    // for array variables, the element is the one this many bytes (held in a temp)
+    // from the start of the array
+    bool offset_in_temp;
+    int offset_temp_num;
 } IRValue;
 // An IROp is a Three Address Code Quadruple
 typedef struct _IROp {
@@ -59,4 +90,41 @@ typedef struct _IROp {
     IRValue arg2;
 } IROp;
 
+// The built-in functions that are a single core instruction, e.g. "__wfi()" or "__rev(x)"
+typedef enum _IntrinsicId {
+    intrinsic_nop,
+    intrinsic_wfi,
+    intrinsic_wfe,
+    intrinsic_sev,
+    intrinsic_dmb,
+    intrinsic_dsb,
+    intrinsic_isb,
+    intrinsic_rev,
+    intrinsic_rev16,
+    intrinsic_revsh,
+    intrinsic_cpsid,
+    intrinsic_cpsie,
+    INTRINSICS_NUM
+} IntrinsicId;
+
+// The intrinsic does something the optimizer can't see (e.g. sleeps), so it is never
+// removed or worked out at compile time
+#define INTRINSIC_SIDE_EFFECTS 0x1
+// Memory and peripheral registers can change across the intrinsic (e.g. it lets interrupts
+// run, or it is a barrier), so no accesses are merged across it
+#define INTRINSIC_MEMORY 0x2
+
+// size is in halfwords, and cycles is the time the instruction takes on a Cortex-M0+
+// (not counting time spent asleep)
+typedef struct _Intrinsic {
+    char *name;
+    int args_num;
+    bool has_result;
+    int size;
+    int cycles;
+    int flags;
+} Intrinsic;
+
+extern Intrinsic intrinsics[INTRINSICS_NUM];
+
 #endif
\ No newline at end of file
@@ -21,6 +21,8 @@ char *token_type_to_static_string(TokenType token_type) {
         case t_rightparen: return "rightparen";
         case t_leftbrace: return "leftbrace";
         case t_rightbrace: return "rightbrace";
+        case t_leftbracket: return "leftbracket";
+        case t_rightbracket: return "rightbracket";
         case t_colon: return "colon";
         case t_semicolon: return "semicolon";
         case t_dot: return "dot";
@@ -36,6 +38,12 @@ char *token_type_to_static_string(TokenType token_type) {
         case t_plus: return "plus";
         case t_minus: return "minus";
         case t_and: return "and";
+        case t_or: return "or";
+        case t_xor: return "xor";
+        case t_not: return "not";
+        case t_star: return "star";
+        case t_slash: return "slash";
+        case t_percent: return "percent";
 
         case t_mmp: return "mmp";
         case t_unused: return "unused";
@@ -43,9 +51,17 @@ char *token_type_to_static_string(TokenType token_type) {
         case t_on_interrupt: return "on_interrupt";
         case t_fun: return "fun";
         case t_static: return "static";
+        case t_const: return "const";
+        case t_constexpr: return "constexpr";
         case t_while: return "while";
         case t_if: return "if";
         case t_else: return "else";
+        case t_match: return "match";
+        case t_asm: return "asm";
+        case t_atomic: return "atomic";
+        case t_defer: return "defer";
+        case t_task: return "task";
+        case t_yield: return "yield";
         case t_return: return "return";
 
         case t_inttype: return "inttype";
@@ -214,6 +230,10 @@ TokenType token_type(StringRef str, char *lookahead) {
         return t_leftbrace;
     } else if (str.str[0] == '}' && str.len == 1) {
         return t_rightbrace;
+    } else if (str.str[0] == '[' && str.len == 1) {
+        return t_leftbracket;
+    } else if (str.str[0] == ']' && str.len == 1) {
+        return t_rightbracket;
     } else if (str.str[0] == ':' && str.len == 1) {
         return t_colon;
     } else if (str.str[0] == ';' && str.len == 1) {
@@ -246,6 +266,18 @@ TokenType token_type(StringRef str, char *lookahead) {
         return t_minus;
     } else if (str.str[0] == '&' && str.len == 1) {
         return t_and;
+    } else if (str.str[0] == '|' && str.len == 1) {
+        return t_or;
+    } else if (str.str[0] == '^' && str.len == 1) {
+        return t_xor;
+    } else if (str.str[0] == '~' && str.len == 1) {
+        return t_not;
+    } else if (str.str[0] == '*' && str.len == 1) {
+        return t_star;
+    } else if (str.str[0] == '/' && str.len == 1) {
+        return t_slash;
+    } else if (str.str[0] == '%' && str.len == 1) {
+        return t_percent;
     } else if (str.len == 2 && strncmp(str.str, "==", str.len) == 0) {
         return t_equalsequals;
     } else if (str.str[0] == '=' && str.len == 1) {
@@ -265,12 +297,29 @@ TokenType token_type(StringRef str, char *lookahead) {
         return t_fun;
     } else if (str.len == 6 && strncmp(str.str, "static", str.len) == 0) {
         return t_static;
+    } else if (str.len == 5 && strncmp(str.str, "const", str.len) == 0 && char_is_in(lookahead[0], DELIM_CHARS, DELIM_CHARS_LEN)) {
+        return t_const;
+    } else if (str.len == 9 && strncmp(str.str, "constexpr", str.len) == 0 && char_is_in(lookahead[0], DELIM_CHARS, DELIM_CHARS_LEN)) {
+        return t_constexpr;
     } else if (str.len == 5 && strncmp(str.str, "while", str.len) == 0) {
         return t_while;
     } else if (str.len == 2 && strncmp(str.str, "if", str.len) == 0) {
         return t_if;
     } else if (str.len == 4 && strncmp(str.str, "else", str.len) == 0) {
         return t_else;
+    } else if (str.len == 5 && strncmp(str.str, "match", str.len) == 0 && char_is_in(lookahead[0], DELIM_CHARS, DELIM_CHARS_LEN)) {
+        // checked against the next character so ids like "matchclr" still work
+        return t_match;
+    } else if (str.len == 3 && strncmp(str.str, "asm", str.len) == 0 && char_is_in(lookahead[0], DELIM_CHARS, DELIM_CHARS_LEN)) {
+        return t_asm;
+    } else if (str.len == 6 && strncmp(str.str, "atomic", str.len) == 0 && char_is_in(lookahead[0], DELIM_CHARS, DELIM_CHARS_LEN)) {
+        return t_atomic;
+    } else if (str.len == 5 && strncmp(str.str, "defer", str.len) == 0 && char_is_in(lookahead[0], DELIM_CHARS, DELIM_CHARS_LEN)) {
+        return t_defer;
+    } else if (str.len == 4 && strncmp(str.str, "task", str.len) == 0 && char_is_in(lookahead[0], DELIM_CHARS, DELIM_CHARS_LEN)) {
+        return t_task;
+    } else if (str.len == 5 && strncmp(str.str, "yield", str.len) == 0 && char_is_in(lookahead[0], DELIM_CHARS, DELIM_CHARS_LEN)) {
+        return t_yield;
     } else if (str.len == 6 && strncmp(str.str, "return", str.len) == 0) {
         return t_return;
     } else if (is_inttype(str, lookahead)) {
@@ -14,8 +14,8 @@
 #define VALID_ID_CHARS_START_LEN 53
 #define VALID_ID_CHARS "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ1234567890_"
 #define VALID_ID_CHARS_LEN 63
-#define DELIM_CHARS "\0\n =(){}:;.,"
-#define DELIM_CHARS_LEN 12
+#define DELIM_CHARS "\0\n =(){}[]:;.,"
+#define DELIM_CHARS_LEN 14
 
 // This is a helper to turn a "Token" (defined below) into a printable string
 #define CREATE_TOKEN_STRING(t) char lexeme[256];\
@@ -38,6 +38,8 @@ typedef enum {
     t_rightparen,
     t_leftbrace,
     t_rightbrace,
+    t_leftbracket,
+    t_rightbracket,
     t_colon,
     t_semicolon,
     t_dot,
@@ -54,6 +56,12 @@ typedef enum {
     t_plus,
     t_minus,
     t_and,
+    t_or,
+    t_xor,
+    t_not,
+    t_star,
+    t_slash,
+    t_percent,
 
     // keywords
     t_mmp,
@@ -62,9 +70,17 @@ typedef enum {
     t_on_interrupt,
     t_fun,
     t_static,
+    t_const,
+    t_constexpr,
     t_while,
     t_if,
     t_else,
+    t_match,
+    t_asm,
+    t_atomic,
+    t_defer,
+    t_task,
+    t_yield,
     t_return,
 
     // int types
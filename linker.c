@@ -1,5 +1,6 @@
 #include "linker.h"
 #include "armv6m.h"
+#include "parser.h"
 
 void add16(uint8_t *dest, int curr_offset, uint16_t data) {
     for (int i = 0; i < 2; i++) {
@@ -11,10 +12,64 @@ void add32(uint8_t *dest, int curr_offset, uint32_t data) {
         dest[curr_offset + i] = (uint8_t)(data >> (8 * i));
     }
 }
+// Returns the address in flash of the first instruction. The code goes after the
+// vector table and the const data, on a word boundary.
+int code_start_address(SymbolTable *symbols) {
+    return VECTOR_TABLE_SIZE + ((symbols->const_data_len + 3) / 4) * 4;
+}
+
+// Returns the index of the SysTick handler that counts ticks for tasks, or -1 if there is none
+int systick_handler_index(SymbolTable *symbols) {
+    StringRef systick_name = {"____systick", 11};
+    return find_function_index(symbols, &systick_name);
+}
+
+// Walks the call graph starting at the reset function (function 0), every
+// interrupt handler and the SysTick handler. Any function that can't be reached through a BL is marked
+// as removed so that it isn't given an address or put in the linked blob.
+void remove_unreachable_functions(SymbolTable *symbols, MachineCode *code) {
+    bool reachable[1024];
+    int worklist[1024];
+    int worklist_len = 0;
+    memset(reachable, 0, sizeof(reachable));
+
+    reachable[0] = true;
+    worklist[worklist_len++] = 0;
+    if (systick_handler_index(symbols) != -1) {
+        reachable[systick_handler_index(symbols)] = true;
+        worklist[worklist_len++] = systick_handler_index(symbols);
+    }
+    for (int k = 0; k < symbols->interrupt_handlers_num; k++) {
+        int func_index = symbols->interrupt_handlers[k].func_index;
+        if (!reachable[func_index]) {
+            reachable[func_index] = true;
+            worklist[worklist_len++] = func_index;
+        }
+    }
+    while (worklist_len > 0) {
+        int i = worklist[--worklist_len];
+        for (int j = 0; j < code->functions[i].len; j++) {
+            int target = code->functions[i].ops[j].target_function;
+            if (target && !reachable[target]) {
+                reachable[target] = true;
+                worklist[worklist_len++] = target;
+            }
+        }
+    }
+    for (int i = 0; i < symbols->functions_num; i++) {
+        code->functions[i].removed = !reachable[i];
+    }
+}
+
 int link(SymbolTable *symbols, MachineCode *code, uint8_t *dest) {
+    remove_unreachable_functions(symbols, code);
+
     int len = 0;
     // for all code in each function, assign address
     for (int i = 0; i < symbols->functions_num; i++) {
+        if (code->functions[i].removed) {
+            continue;
+        }
         for (int j = 0; j < code->functions[i].len; j++) {
             code->functions[i].ops[j].address = len;
             len += 2; // every instruction is two bytes;
@@ -28,14 +83,11 @@ int link(SymbolTable *symbols, MachineCode *code, uint8_t *dest) {
                 int curr_address = op->address;
                 int target_address = code->functions[op->target_function].ops[0].address;
                 int offset = (target_address - curr_address) - 4;
-                int s = 0;
-                int j1 = 0;
-                int j2 = 0;
-                if (offset < 0) {
-                    s = 1;
-                    j1 = 1;
-                    j2 = 1;
-                }
+                // J1 and J2 are the inverted bits 23 and 22 of the offset, xored with the sign.
+                // That makes them both 1 for any offset within +-4MB, forwards or backwards.
+                int s = offset < 0;
+                int j1 = !((((uint32_t)offset) >> 23 & 1) ^ s);
+                int j2 = !((((uint32_t)offset) >> 22 & 1) ^ s);
                 uint16_t imm10 = (((uint32_t)offset) & 0b1111111111000000000000) >> 12;
                 uint16_t imm11 = (((uint32_t)offset) & 0b111111111110) >> 1;
                 op->code |= (s << 10) | imm10;
@@ -47,9 +99,9 @@ int link(SymbolTable *symbols, MachineCode *code, uint8_t *dest) {
 
     // construct empty vector table, add to dest
     int curr_offset = 0;
-    uint32_t reset_fn = 0xB1;
+    uint32_t reset_fn = code_start_address(symbols) + 1;
 
-    add32(dest, curr_offset, 0x20008000); // stack pointer
+    add32(dest, curr_offset, RAM_END_ADDRESS); // stack pointer
     curr_offset += 4;
     add32(dest, curr_offset, reset_fn); // reset
     curr_offset += 4;
@@ -140,8 +192,18 @@ int link(SymbolTable *symbols, MachineCode *code, uint8_t *dest) {
     add32(dest, curr_offset, reset_fn); // i2s_handler
     curr_offset += 4;
 
+    // const data, padded to a word so that the code after it is aligned
+    while (curr_offset < code_start_address(symbols)) {
+        int i = curr_offset - VECTOR_TABLE_SIZE;
+        dest[curr_offset] = i < symbols->const_data_len ? symbols->const_data[i] : 0;
+        curr_offset++;
+    }
+
     // for all code in each function, put in dest
     for (int i = 0; i < symbols->functions_num; i++) {
+        if (code->functions[i].removed) {
+            continue;
+        }
         // is it an interrupt handler?
         for (int k = 0; k < symbols->interrupt_handlers_num; k++) {
             if (symbols->interrupt_handlers[k].func_index == i) {
@@ -152,6 +214,9 @@ int link(SymbolTable *symbols, MachineCode *code, uint8_t *dest) {
                 add32(dest, position, curr_offset + 1); // add one for some reason
             }
         }
+        if (i == systick_handler_index(symbols)) {
+            add32(dest, 15 * 4, curr_offset + 1);
+        }
         for (int j = 0; j < code->functions[i].len; j++) {
             add16(dest, curr_offset, code->functions[i].ops[j].code);
             curr_offset += 2;
@@ -160,7 +225,7 @@ int link(SymbolTable *symbols, MachineCode *code, uint8_t *dest) {
 
     return curr_offset;
 }
-void print_hex(uint8_t *code, int len) {
+void print_hex(uint8_t *code, int len, uint32_t start_address) {
     int num_full_rows = len / 0x10;
     int len_last_row = len % 0x10;
     // all full rows
@@ -199,8 +264,93 @@ void print_hex(uint8_t *code, int len) {
         printf("%02x", (uint8_t)-sum); // checksum
         printf("\n");
     }
-    // start linear address - hardcoded to reset vector
-    printf(":04000005000000B146\n");
+    // start linear address, which is the reset vector
+    uint8_t sum = 0x04 + 0x05;
+    for (int i = 0; i < 4; i++) {
+        sum += (uint8_t)(start_address >> (8 * i));
+    }
+    printf(":04000005%08x%02x\n", start_address, (uint8_t)-sum);
     // end of file
     printf(":00000001FF\n");
-}
\ No newline at end of file
+}
+// Writes a human-readable map of where each function and const array ended up in
+// flash, where each static ended up in RAM, how long each atomic block can keep
+// interrupts masked, and which functions were removed because nothing calls them
+void write_link_map(SymbolTable *symbols, MachineCode *code, FILE *map) {
+    fprintf(map, "Const data:\n");
+    for (int i = 0; i < symbols->static_vars_num; i++) {
+        Variable *var = &symbols->static_vars[i];
+        if (var->is_const) {
+            STRINGREF_TO_CSTR1(&var->name, 512);
+            fprintf(map, "  0x%08x %5d %s\n", var->address, variable_size(var), cstr1);
+        }
+    }
+    if (symbols->data_len > 0) {
+        fprintf(map, "  0x%08x %5d (initial values of .data)\n", VECTOR_TABLE_SIZE + symbols->data_image, symbols->data_len);
+    }
+
+    // the statics are listed in address order, which isn't the order they were declared in
+    fprintf(map, "\nStatics:\n");
+    int ram_end = RAM_BASE_ADDRESS + symbols->data_len + symbols->bss_len;
+    for (int address = RAM_BASE_ADDRESS; address < ram_end; address++) {
+        for (int i = 0; i < symbols->static_vars_num; i++) {
+            Variable *var = &symbols->static_vars[i];
+            if (!var->is_const && var->address == address) {
+                STRINGREF_TO_CSTR1(&var->name, 512);
+                bool data = address >= symbols->data_address && address < symbols->data_address + symbols->data_len;
+                fprintf(map, "  0x%08x %5d %s %s\n", var->address, variable_size(var), data ? ".data" : ".bss ", cstr1);
+            }
+        }
+    }
+    fprintf(map, "  .data %d bytes, .bss %d bytes, %d bytes left for the stack\n",
+            symbols->data_len, symbols->bss_len, RAM_END_ADDRESS - ram_end);
+    fprintf(map, "\nFunctions:\n");
+    for (int i = 0; i < symbols->functions_num; i++) {
+        if (code->functions[i].removed) {
+            continue;
+        }
+        STRINGREF_TO_CSTR1(&symbols->functions[i].name, 512);
+        int address = code_start_address(symbols) + code->functions[i].ops[0].address;
+        int size = code->functions[i].len * 2;
+        fprintf(map, "  0x%08x %5d %s", address, size, cstr1);
+        for (int k = 0; k < symbols->interrupt_handlers_num; k++) {
+            if (symbols->interrupt_handlers[k].func_index == i) {
+                InterruptHandler *handler = &symbols->interrupt_handlers[k];
+                if (handler->priority == -1) {
+                    fprintf(map, " (interrupt %d)", handler->interrupt_number);
+                } else {
+                    fprintf(map, " (interrupt %d, priority %d)", handler->interrupt_number, handler->priority);
+                }
+            }
+        }
+        fprintf(map, "\n");
+    }
+    fprintf(map, "\nAtomic blocks (cycles with interrupts masked, at most):\n");
+    for (int i = 0; i < symbols->functions_num; i++) {
+        MachineCodeFunction *code_func = &code->functions[i];
+        if (code_func->removed) {
+            continue;
+        }
+        STRINGREF_TO_CSTR1(&symbols->functions[i].name, 512);
+        for (int k = 0; k < code_func->atomic_regions_num; k++) {
+            AtomicRegion *region = &code_func->atomic_regions[k];
+            int address = code_start_address(symbols) + code_func->ops[region->first].address;
+            int cycles = -1;
+            if (region->last != -1) {
+                cycles = worst_case_cycles(code, i, region->first, region->last, 0);
+            }
+            if (cycles == -1) {
+                fprintf(map, "  0x%08x unbounded %s\n", address, cstr1);
+            } else {
+                fprintf(map, "  0x%08x %9d %s\n", address, cycles, cstr1);
+            }
+        }
+    }
+    fprintf(map, "\nRemoved functions:\n");
+    for (int i = 0; i < symbols->functions_num; i++) {
+        if (code->functions[i].removed) {
+            STRINGREF_TO_CSTR1(&symbols->functions[i].name, 512);
+            fprintf(map, "  %5d %s\n", code->functions[i].len * 2, cstr1);
+        }
+    }
+}
@@ -3,11 +3,14 @@
 #define LINKER_H
 
 #include <stdint.h>
+#include <stdio.h>
 
 #include "armv6m.h"
 #include "symbols.h"
 
+int code_start_address(SymbolTable *symbols);
 int link(SymbolTable *symbols, MachineCode *code, uint8_t *dest);
-void print_hex(uint8_t *code, int len);
+void print_hex(uint8_t *code, int len, uint32_t start_address);
+void write_link_map(SymbolTable *symbols, MachineCode *code, FILE *map);
 
 #endif
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "armv6m.h"
@@ -8,20 +9,57 @@
 #include "symbols.h"
 #include "lexer.h"
 #include "linker.h"
+#include "optimizer.h"
 #include "parser.h"
 
 #define MAX_SOURCE_LEN 65536
 
 // This is the entrypoint of the compiler
 // It checks for one command-line argument and uses that as the filename of a lang808 source file
+// Optionally, "-m <file>" can come before it to write a link map to <file>, and
+// "--idle <wfi|deep|spin>" and "--sleep-on-exit" choose what happens after initialization,
+// and "--tick <cycles>" sets how long a tick of sleep_ticks is,
+// and "--gp" keeps the start of RAM in r7 so most statics take one instruction to reach
 // It reads the whole file, passes it through the lexer, and then parses it.
 int main(int argc, char *argv[]) {
-    // Check that one argument was supplied
-    if (argc != 2) {
+    // Check for options, then that one argument was supplied
+    int arg_index = 1;
+    while (arg_index < argc && argv[arg_index][0] == '-') {
+        if (strcmp(argv[arg_index], "-m") == 0 && arg_index + 1 < argc) {
+            options.map_file_name = argv[arg_index + 1];
+            arg_index += 2;
+        } else if (strcmp(argv[arg_index], "--idle") == 0 && arg_index + 1 < argc) {
+            char *mode = argv[arg_index + 1];
+            if (strcmp(mode, "wfi") == 0) {
+                options.idle_mode = idle_wfi;
+            } else if (strcmp(mode, "deep") == 0) {
+                options.idle_mode = idle_deep;
+            } else if (strcmp(mode, "spin") == 0) {
+                options.idle_mode = idle_spin;
+            } else {
+                fprintf(stderr, "ERROR: Unknown idle mode: %s\n", mode);
+                return 1;
+            }
+            arg_index += 2;
+        } else if (strcmp(argv[arg_index], "--sleep-on-exit") == 0) {
+            options.sleep_on_exit = true;
+            arg_index += 1;
+        } else if (strcmp(argv[arg_index], "--tick") == 0 && arg_index + 1 < argc) {
+            options.tick_cycles = atoi(argv[arg_index + 1]);
+            arg_index += 2;
+        } else if (strcmp(argv[arg_index], "--gp") == 0) {
+            options.gp = true;
+            arg_index += 1;
+        } else {
+            fprintf(stderr, "ERROR: Unknown option: %s\n", argv[arg_index]);
+            return 1;
+        }
+    }
+    if (argc - arg_index != 1) {
         fprintf(stderr, "ERROR: One argument is required: the path to the Lang808 source file.\n");
         return 1;
     }
-    char *source_file_name = argv[1];
+    char *source_file_name = argv[arg_index];
     //printf("Compiling %s\n", source_file_name);
 
     // Create a buffer to read the source file into
@@ -71,6 +109,11 @@ int main(int argc, char *argv[]) {
     // symbol table as well
     parse(tokens, token_num, &symbols);
 
+    // Pass the symbols to the "optimize" function, which rewrites the IR of each
+    // function to remove dead and unreachable code and to move work out of loops
+    // "optimize" is declared in "optimizer.h" and defined in "optimizer.c"
+    optimize(&symbols);
+
     //print_all_ir(&symbols);
 
     // Initialize the MachineCode struct
@@ -87,7 +130,20 @@ int main(int argc, char *argv[]) {
 
     uint8_t linked_blob[65536];
     int linked_blob_len = link(&symbols, &code, linked_blob);
-    print_hex(linked_blob, linked_blob_len);
+    // the reset function is the first code after the const data, +1 for Thumb mode
+    print_hex(linked_blob, linked_blob_len, code_start_address(&symbols) + 1);
+
+    // If it was requested, write the link map after linking so it includes
+    // final addresses and the functions that were removed
+    if (options.map_file_name != NULL) {
+        FILE *map_file = fopen(options.map_file_name, "w");
+        if (map_file == NULL) {
+            fprintf(stderr, "ERROR: Can't open map file.\n");
+            return 2;
+        }
+        write_link_map(&symbols, &code, map_file);
+        fclose(map_file);
+    }
     
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,1975 @@
+// This file contains the implementation of the Lang808 IR optimizer
+// The entrypoint of the optimizer is the "optimize" function defined at the bottom of this file.
+// It runs after parsing and before the IR is translated into machine code. Each pass rewrites
+// a function's IR in the symbol table using "set_function_ir".
+// The passes work on a control flow graph of basic blocks, built by "build_flow_graph".
+
+#include "optimizer.h"
+#include "armv6m.h"
+#include "common.h"
+#include "ir.h"
+#include "parser.h"
+#include "symbols.h"
+
+// These are the scratch arrays used while rewriting a function's IR
+static FlowGraph graph;
+static IROp new_code[MAX_IR_CODE];
+static bool removed[MAX_IR_CODE];
+static int block_of_op[MAX_IR_CODE];
+
+// These are helpers for working with ValueSets
+void value_set_clear(ValueSet *set) {
+    memset(set, 0, sizeof(ValueSet));
+}
+void value_set_add(ValueSet *set, int value) {
+    set->bits[value / 32] |= (1u << (value % 32));
+}
+void value_set_remove(ValueSet *set, int value) {
+    set->bits[value / 32] &= ~(1u << (value % 32));
+}
+bool value_set_has(ValueSet *set, int value) {
+    return (set->bits[value / 32] >> (value % 32)) & 1;
+}
+// Adds all values in src to dest, returns true if dest changed
+bool value_set_union(ValueSet *dest, ValueSet *src) {
+    bool changed = false;
+    for (int i = 0; i < MAX_TRACKED_VALUES / 32; i++) {
+        uint32_t bits = dest->bits[i] | src->bits[i];
+        if (bits != dest->bits[i]) {
+            dest->bits[i] = bits;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+// These are helpers for working with BlockSets
+void block_set_clear(BlockSet *set) {
+    memset(set, 0, sizeof(BlockSet));
+}
+void block_set_fill(BlockSet *set) {
+    memset(set, 0xff, sizeof(BlockSet));
+}
+void block_set_add(BlockSet *set, int block) {
+    set->bits[block / 32] |= (1u << (block % 32));
+}
+bool block_set_has(BlockSet *set, int block) {
+    return (set->bits[block / 32] >> (block % 32)) & 1;
+}
+void block_set_intersect(BlockSet *dest, BlockSet *src) {
+    for (int i = 0; i < MAX_BLOCKS / 32; i++) {
+        dest->bits[i] &= src->bits[i];
+    }
+}
+
+// Returns the slot of an IRValue in a ValueSet, or -1 if the value is not tracked.
+// Only temps and local variables are tracked. Everything else (statics, peripheral
+// registers, ...) is memory that can be seen outside of the function.
+int tracked_value(SymbolTable *symbols, int func_index, IRValue *value) {
+    if (value->type == irv_temp) {
+        if (value->temp_num >= MAX_TRACKED_TEMPS) {
+            PANIC("Temp %d is out of range\n", value->temp_num);
+        }
+        return value->temp_num;
+    }
+    if (value->type == irv_local_variable) {
+        Function *func = &symbols->functions[func_index];
+        int slot = MAX_TRACKED_TEMPS + (value->local_variable_index - func->func_vars_index);
+        if (slot >= MAX_TRACKED_VALUES) {
+            STRINGREF_TO_CSTR1(&func->name, 512);
+            PANIC("Too many local variables in function '%s'\n", cstr1);
+        }
+        return slot;
+    }
+    return -1;
+}
+
+// These describe which of an IROp's values are read and written, by opcode
+bool op_is_binary(IROp *op) {
+    switch (op->opcode) {
+        case ir_add:
+        case ir_subtract:
+        case ir_shift_left:
+        case ir_shift_right:
+        case ir_bitwise_and:
+        case ir_bitwise_or:
+        case ir_bitwise_xor:
+        case ir_multiply:
+        case ir_divide:
+        case ir_modulo:
+        case ir_equals:
+        case ir_less_than:
+        case ir_greater_than:
+            return true;
+        default:
+            return false;
+    }
+}
+// The backend has cheaper forms of these ops when arg2 is a constant, so it should be
+// given to them as an immediate instead of in a temp
+bool op_prefers_immediate_arg2(IROp *op) {
+    switch (op->opcode) {
+        case ir_shift_left:
+        case ir_shift_right:
+        case ir_multiply:
+        case ir_divide:
+        case ir_modulo:
+            return true;
+        default:
+            return false;
+    }
+}
+bool op_reads_arg1(IROp *op) {
+    if (op->opcode == ir_intrinsic) {
+        return intrinsics[op->arg2.immediate_value].args_num > 0;
+    }
+    return op_is_binary(op)
+        || op->opcode == ir_copy
+        || op->opcode == ir_if
+        || op->opcode == ir_jump_table
+        || op->opcode == ir_param
+        || op->opcode == ir_return
+        || op->opcode == ir_atomic_end;
+}
+bool op_reads_arg2(IROp *op) {
+    return op_is_binary(op);
+}
+bool op_writes_result(IROp *op) {
+    if (op->opcode == ir_intrinsic) {
+        return intrinsics[op->arg2.immediate_value].has_result;
+    }
+    return op_is_binary(op) || op->opcode == ir_copy || op->opcode == ir_call || op->opcode == ir_atomic_begin;
+}
+bool op_is_branch(IROp *op) {
+    return op->opcode == ir_goto || op->opcode == ir_if
+        || op->opcode == ir_jump_table || op->opcode == ir_jump_table_entry;
+}
+// Calls and asm blocks can change any temp register
+bool op_clobbers_temps(IROp *op) {
+    return op->opcode == ir_call || op->opcode == ir_asm;
+}
+// Intrinsics that let interrupts run or order memory accesses, and the edges of atomic blocks
+bool op_is_memory_barrier(IROp *op) {
+    if (op->opcode == ir_atomic_begin || op->opcode == ir_atomic_end) {
+        return true;
+    }
+    return op->opcode == ir_intrinsic && (intrinsics[op->arg2.immediate_value].flags & INTRINSIC_MEMORY);
+}
+bool op_ends_block(IROp *op) {
+    return op_is_branch(op) || op->opcode == ir_return;
+}
+// An op can be deleted if its result is never read, unless it does something else
+// as well. Reads of peripheral registers are kept because they can have side effects
+// in the hardware.
+bool op_is_removable(IROp *op) {
+    if (op->opcode == ir_intrinsic) {
+        return !(intrinsics[op->arg2.immediate_value].flags & INTRINSIC_SIDE_EFFECTS);
+    }
+    if (!op_is_binary(op) && op->opcode != ir_copy) {
+        return false;
+    }
+    if (op->arg1.type == irv_mmp_struct_item) {
+        return false;
+    }
+    if (op_reads_arg2(op) && op->arg2.type == irv_mmp_struct_item) {
+        return false;
+    }
+    return true;
+}
+
+// Adds the values that reading an IRValue uses to a live set
+void liveness_use(SymbolTable *symbols, int func_index, IRValue *value, ValueSet *live) {
+    int use = tracked_value(symbols, func_index, value);
+    if (use != -1) {
+        value_set_add(live, use);
+    }
+    if (value->address_in_temp) {
+        value_set_add(live, value->address_temp_num);
+    }
+    if (value->offset_in_temp) {
+        value_set_add(live, value->offset_temp_num);
+    }
+}
+
+// Applies one op to a live set, walking backwards: kill the value written then add
+// the values read. A call or an asm block clobbers every temp register. Storing to one element of an
+// array leaves the rest of it alone, so it doesn't kill the array.
+void liveness_transfer(SymbolTable *symbols, int func_index, IROp *op, ValueSet *live) {
+    if (op_writes_result(op) && !op->result.offset_in_temp) {
+        int def = tracked_value(symbols, func_index, &op->result);
+        if (def != -1) {
+            value_set_remove(live, def);
+        }
+    }
+    if (op_clobbers_temps(op)) {
+        for (int t = 0; t < MAX_TRACKED_TEMPS; t++) {
+            value_set_remove(live, t);
+        }
+    }
+    if (op->opcode == ir_asm) {
+        // the variables bound to the block are copied into these before it
+        int input_temps = symbols->asm_blocks[op->arg1.immediate_value].input_temps;
+        for (int t = 0; t < MAX_TRACKED_TEMPS; t++) {
+            if (input_temps & (1 << t)) {
+                value_set_add(live, t);
+            }
+        }
+    }
+    if (op_reads_arg1(op)) {
+        liveness_use(symbols, func_index, &op->arg1, live);
+    }
+    if (op_reads_arg2(op)) {
+        liveness_use(symbols, func_index, &op->arg2, live);
+    }
+    // storing to a static or peripheral register whose address is in a temp reads the temp,
+    // and so does storing to an array element whose offset is in a temp
+    if (op_writes_result(op) && op->result.address_in_temp) {
+        value_set_add(live, op->result.address_temp_num);
+    }
+    if (op_writes_result(op) && op->result.offset_in_temp) {
+        value_set_add(live, op->result.offset_temp_num);
+    }
+}
+
+// Returns the index (relative to the function) of the op with the given label, or -1
+int find_label_op(IROp *code, int len, int label) {
+    for (int i = 0; i < len; i++) {
+        if (code[i].label == label) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Splits a function's IR into basic blocks and links each block to its successors.
+// Block 0 is always the entry block.
+void build_flow_graph(SymbolTable *symbols, int func_index, FlowGraph *graph) {
+    Function *func = &symbols->functions[func_index];
+    IROp *code = &symbols->ir_code[func->ir_code_index];
+    int len = func->ir_code_len;
+    graph->blocks_num = 0;
+
+    // find the first op of each block
+    for (int i = 0; i < len; i++) {
+        bool leader = i == 0 || code[i].label != 0 || op_ends_block(&code[i - 1]);
+        if (leader) {
+            if (graph->blocks_num == MAX_BLOCKS) {
+                STRINGREF_TO_CSTR1(&func->name, 512);
+                PANIC("Too many basic blocks in function '%s'\n", cstr1);
+            }
+            BasicBlock *block = &graph->blocks[graph->blocks_num];
+            memset(block, 0, sizeof(BasicBlock));
+            block->first = i;
+            graph->blocks_num++;
+        }
+        graph->blocks[graph->blocks_num - 1].len++;
+        block_of_op[i] = graph->blocks_num - 1;
+    }
+
+    // link each block to the blocks it can continue to
+    for (int b = 0; b < graph->blocks_num; b++) {
+        BasicBlock *block = &graph->blocks[b];
+        IROp *last = &code[block->first + block->len - 1];
+        bool falls_through = last->opcode != ir_goto && last->opcode != ir_return;
+        // each entry of a jump table is its own block, linked to the next entry so they
+        // all stay reachable. Nothing runs after the last one.
+        int after = block->first + block->len;
+        if (last->opcode == ir_jump_table_entry && (after == len || code[after].opcode != ir_jump_table_entry)) {
+            falls_through = false;
+        }
+        if (op_is_branch(last)) {
+            int target = find_label_op(code, len, last->target_label);
+            if (target != -1) {
+                block->succs[block->succs_num++] = block_of_op[target];
+            } else {
+                // an unresolved branch is emitted as a branch to the next instruction
+                falls_through = true;
+            }
+        }
+        if (falls_through && b + 1 < graph->blocks_num) {
+            if (block->succs_num == 0 || block->succs[0] != b + 1) {
+                block->succs[block->succs_num++] = b + 1;
+            }
+        }
+    }
+}
+
+// Computes which tracked values are live on entry to and exit from each block.
+// This is the standard backwards dataflow problem, iterated until nothing changes.
+void compute_liveness(SymbolTable *symbols, int func_index, FlowGraph *graph) {
+    Function *func = &symbols->functions[func_index];
+    IROp *code = &symbols->ir_code[func->ir_code_index];
+    for (int b = 0; b < graph->blocks_num; b++) {
+        value_set_clear(&graph->blocks[b].live_in);
+        value_set_clear(&graph->blocks[b].live_out);
+    }
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int b = graph->blocks_num - 1; b >= 0; b--) {
+            BasicBlock *block = &graph->blocks[b];
+            for (int s = 0; s < block->succs_num; s++) {
+                value_set_union(&block->live_out, &graph->blocks[block->succs[s]].live_in);
+            }
+            ValueSet live = block->live_out;
+            for (int i = block->first + block->len - 1; i >= block->first; i--) {
+                liveness_transfer(symbols, func_index, &code[i], &live);
+            }
+            if (value_set_union(&block->live_in, &live)) {
+                changed = true;
+            }
+        }
+    }
+}
+
+// Makes every branch to from_label in a function go to to_label instead
+void retarget_label(IROp *code, int len, int from_label, int to_label) {
+    for (int i = 0; i < len; i++) {
+        if (op_is_branch(&code[i]) && code[i].target_label == from_label) {
+            code[i].target_label = to_label;
+        }
+    }
+}
+
+// Removes every op marked in "removed" from a function's IR, and inserts insert_len
+// ops from insert_ops just before the op at insert_at (use -1 to not insert anything).
+// A label on a removed op moves to the next op that is kept. If that op already has
+// a label, branches to the removed label are pointed at the existing one.
+void compact_function_ir(SymbolTable *symbols, int func_index, int insert_at, IROp *insert_ops, int insert_len) {
+    Function *func = &symbols->functions[func_index];
+    IROp *code = &symbols->ir_code[func->ir_code_index];
+    int len = func->ir_code_len;
+    int new_len = 0;
+    int pending_label = 0;
+    int remap_from[MAX_BLOCKS];
+    int remap_to[MAX_BLOCKS];
+    int remaps_num = 0;
+    for (int i = 0; i < len; i++) {
+        if (i == insert_at) {
+            for (int k = 0; k < insert_len; k++) {
+                IROp op = insert_ops[k];
+                op.label = pending_label;
+                pending_label = 0;
+                new_code[new_len++] = op;
+            }
+        }
+        if (removed[i]) {
+            if (code[i].label != 0) {
+                if (pending_label != 0) {
+                    remap_from[remaps_num] = code[i].label;
+                    remap_to[remaps_num++] = pending_label;
+                } else {
+                    pending_label = code[i].label;
+                }
+            }
+            continue;
+        }
+        IROp op = code[i];
+        if (pending_label != 0) {
+            if (op.label != 0) {
+                remap_from[remaps_num] = pending_label;
+                remap_to[remaps_num++] = op.label;
+            } else {
+                op.label = pending_label;
+            }
+            pending_label = 0;
+        }
+        new_code[new_len++] = op;
+    }
+    // a label can be remapped to a label that was itself remapped later on
+    for (int r = remaps_num - 1; r >= 0; r--) {
+        for (int later = r + 1; later < remaps_num; later++) {
+            if (remap_from[later] == remap_to[r]) {
+                remap_to[r] = remap_to[later];
+            }
+        }
+        retarget_label(new_code, new_len, remap_from[r], remap_to[r]);
+    }
+    set_function_ir(symbols, func_index, new_code, new_len);
+}
+
+// Marks all ops in blocks that can't be reached from the entry block.
+// This is code after a return or goto that no branch targets.
+bool mark_unreachable_blocks(FlowGraph *graph) {
+    int stack[MAX_BLOCKS];
+    int stack_len = 0;
+    graph->blocks[0].reachable = true;
+    stack[stack_len++] = 0;
+    while (stack_len > 0) {
+        BasicBlock *block = &graph->blocks[stack[--stack_len]];
+        for (int s = 0; s < block->succs_num; s++) {
+            BasicBlock *succ = &graph->blocks[block->succs[s]];
+            if (!succ->reachable) {
+                succ->reachable = true;
+                stack[stack_len++] = block->succs[s];
+            }
+        }
+    }
+    bool changed = false;
+    for (int b = 0; b < graph->blocks_num; b++) {
+        BasicBlock *block = &graph->blocks[b];
+        if (!block->reachable) {
+            for (int i = block->first; i < block->first + block->len; i++) {
+                removed[i] = true;
+            }
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+// Marks ops whose result is never read before being overwritten or the function returning.
+// This covers both stores to local variables and temps that are computed but never used.
+// Stores to statics and peripheral registers are never tracked, so they are always kept.
+bool mark_dead_ops(SymbolTable *symbols, int func_index, FlowGraph *graph) {
+    Function *func = &symbols->functions[func_index];
+    IROp *code = &symbols->ir_code[func->ir_code_index];
+    bool changed = false;
+    for (int b = 0; b < graph->blocks_num; b++) {
+        BasicBlock *block = &graph->blocks[b];
+        if (!block->reachable) {
+            continue;
+        }
+        ValueSet live = block->live_out;
+        for (int i = block->first + block->len - 1; i >= block->first; i--) {
+            IROp *op = &code[i];
+            if (op_is_removable(op)) {
+                int def = tracked_value(symbols, func_index, &op->result);
+                if (def != -1 && !value_set_has(&live, def)) {
+                    removed[i] = true;
+                    changed = true;
+                    continue;
+                }
+            }
+            liveness_transfer(symbols, func_index, op, &live);
+        }
+    }
+    return changed;
+}
+
+// Marks branches whose target is the op that would run next anyway
+bool mark_branches_to_next(SymbolTable *symbols, int func_index) {
+    Function *func = &symbols->functions[func_index];
+    IROp *code = &symbols->ir_code[func->ir_code_index];
+    int len = func->ir_code_len;
+    bool changed = false;
+    for (int i = 0; i < len; i++) {
+        if (removed[i] || !op_is_branch(&code[i])) {
+            continue;
+        }
+        // the entries of a jump table are all needed to keep it in order
+        if (code[i].opcode == ir_jump_table || code[i].opcode == ir_jump_table_entry) {
+            continue;
+        }
+        // labels on removed ops move forward onto the next op that is kept
+        for (int next = i + 1; next < len; next++) {
+            if (code[next].label == code[i].target_label) {
+                removed[i] = true;
+                changed = true;
+                break;
+            }
+            if (!removed[next]) {
+                break;
+            }
+        }
+    }
+    return changed;
+}
+
+// Returns true and sets value if a temp is set to an immediate before op i, in the same
+// basic block, and isn't changed again before op i
+bool temp_constant_before(IROp *code, int i, int temp, int *value) {
+    for (int j = i - 1; j >= 0; j--) {
+        IROp *op = &code[j];
+        if (op_ends_block(op) || op_clobbers_temps(op)) {
+            return false;
+        }
+        if (op_writes_result(op) && op->result.type == irv_temp && op->result.temp_num == temp) {
+            if (op->opcode == ir_copy && op->arg1.type == irv_immediate) {
+                *value = op->arg1.immediate_value;
+                return true;
+            }
+            return false;
+        }
+        if (op->label != 0) {
+            return false;
+        }
+    }
+    return false;
+}
+
+// Returns true and sets value if every return in a function returns the same constant,
+// either an immediate or a temp set to one just before
+bool function_constant_return(SymbolTable *symbols, int func_index, int *value) {
+    Function *func = &symbols->functions[func_index];
+    IROp *code = &symbols->ir_code[func->ir_code_index];
+    bool found = false;
+    for (int i = 0; i < func->ir_code_len; i++) {
+        if (code[i].opcode != ir_return) {
+            continue;
+        }
+        int returned = code[i].arg1.immediate_value;
+        bool known = code[i].arg1.type == irv_immediate
+            || (code[i].arg1.type == irv_temp && code[i].label == 0
+                && temp_constant_before(code, i, code[i].arg1.temp_num, &returned));
+        if (!known || (found && returned != *value)) {
+            return false;
+        }
+        *value = returned;
+        found = true;
+    }
+    return found;
+}
+
+// Returns true and sets result if an op's value can be worked out at compile time.
+// This gives the same answer the machine code would, including signed comparisons,
+// shifts by 32 or more and division by zero (all ones, with the dividend left over).
+bool evaluate_op(IROpCode opcode, int a, int b, int *result) {
+    uint32_t shift = ((uint32_t)b) & 0xFF;
+    switch (opcode) {
+        case ir_add: *result = (int)((uint32_t)a + (uint32_t)b); return true;
+        case ir_subtract: *result = (int)((uint32_t)a - (uint32_t)b); return true;
+        case ir_shift_left: *result = shift >= 32 ? 0 : (int)((uint32_t)a << shift); return true;
+        case ir_shift_right: *result = shift >= 32 ? 0 : (int)((uint32_t)a >> shift); return true;
+        case ir_bitwise_and: *result = a & b; return true;
+        case ir_bitwise_or: *result = a | b; return true;
+        case ir_bitwise_xor: *result = a ^ b; return true;
+        case ir_multiply: *result = (int)((uint32_t)a * (uint32_t)b); return true;
+        case ir_divide: *result = b == 0 ? -1 : (int)((uint32_t)a / (uint32_t)b); return true;
+        case ir_modulo: *result = b == 0 ? a : (int)((uint32_t)a % (uint32_t)b); return true;
+        case ir_equals: *result = a == b; return true;
+        case ir_less_than: *result = a < b; return true;
+        case ir_greater_than: *result = a > b; return true;
+        default: return false;
+    }
+}
+// Like evaluate_op, for the intrinsics that only compute a value from their argument
+bool evaluate_intrinsic(int intrinsic, int a, int *result) {
+    uint32_t x = (uint32_t)a;
+    switch (intrinsic) {
+        case intrinsic_rev:
+            *result = (int)((x >> 24) | ((x >> 8) & 0xFF00) | ((x << 8) & 0xFF0000) | (x << 24));
+            return true;
+        case intrinsic_rev16:
+            *result = (int)(((x >> 8) & 0x00FF00FF) | ((x << 8) & 0xFF00FF00));
+            return true;
+        case intrinsic_revsh:
+            *result = (int16_t)(((x >> 8) & 0xFF) | ((x << 8) & 0xFF00));
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Returns true and sets value if an IRValue is an immediate or a temp known to hold one
+bool constant_value(IRValue *value, bool *temp_known, int *temp_value, int *result) {
+    if (value->type == irv_immediate) {
+        *result = value->immediate_value;
+        return true;
+    }
+    if (value->type == irv_temp && temp_known[value->temp_num]) {
+        *result = temp_value[value->temp_num];
+        return true;
+    }
+    return false;
+}
+
+// Returns true and sets result if an IRValue is an element of a const array, at an
+// offset held in a temp that is known
+bool const_element(SymbolTable *symbols, IRValue *value, bool *temp_known, int *temp_value, int *result) {
+    if (value->type != irv_static_variable || !value->offset_in_temp || !temp_known[value->offset_temp_num]) {
+        return false;
+    }
+    Variable *var = &symbols->static_vars[value->static_variable_index];
+    int offset = temp_value[value->offset_temp_num];
+    int size = int_type_size(var->int_type);
+    if (!var->is_const || offset < 0 || offset + size > variable_size(var) || offset % size != 0) {
+        return false;
+    }
+    uint8_t *data = &symbols->const_data[var->address - VECTOR_TABLE_SIZE + offset];
+    uint32_t element = 0;
+    for (int i = 0; i < size; i++) {
+        element |= (uint32_t)data[i] << (8 * i);
+    }
+    *result = (int)element;
+    return true;
+}
+
+// Replaces ops on temps that are known at compile time with a copy of the result.
+// Temps only live inside a basic block, so they are tracked one block at a time.
+// Reading a const array at a known index becomes a copy of the element, and so does
+// reading a local variable that a constant was stored to earlier in the block.
+// A comparison that is known, followed by an "if" on it, turns the "if" into a goto
+// or marks it removed. This works together with dead code elimination, which deletes
+// the copies that are no longer read and the blocks that are no longer reachable.
+// Returns true if anything changed.
+bool fold_constants(SymbolTable *symbols, int func_index) {
+    Function *func = &symbols->functions[func_index];
+    IROp *code = &symbols->ir_code[func->ir_code_index];
+    int len = func->ir_code_len;
+    bool temp_known[MAX_TRACKED_TEMPS];
+    int temp_value[MAX_TRACKED_TEMPS];
+    // indexed like tracked_value, so only the local variable slots are used
+    bool local_known[MAX_TRACKED_VALUES];
+    int local_value[MAX_TRACKED_VALUES];
+    memset(temp_known, 0, sizeof(temp_known));
+    memset(local_known, 0, sizeof(local_known));
+    bool changed = false;
+    for (int i = 0; i < len; i++) {
+        IROp *op = &code[i];
+        if (op->label != 0 || (i > 0 && op_ends_block(&code[i - 1]))) {
+            memset(temp_known, 0, sizeof(temp_known));
+            memset(local_known, 0, sizeof(local_known));
+        }
+        if (op->opcode == ir_call) {
+            memset(temp_known, 0, sizeof(temp_known));
+            int value;
+            if (op->result.type == irv_temp && function_constant_return(symbols, op->arg1.func_index, &value)) {
+                temp_known[op->result.temp_num] = true;
+                temp_value[op->result.temp_num] = value;
+            }
+            continue;
+        }
+        if (op->opcode == ir_asm) {
+            memset(temp_known, 0, sizeof(temp_known));
+            memset(local_known, 0, sizeof(local_known));
+            continue;
+        }
+        if (op_writes_result(op) && op->result.type == irv_local_variable) {
+            Variable *var = &symbols->function_vars[op->result.local_variable_index];
+            int slot = tracked_value(symbols, func_index, &op->result);
+            int stored = 0;
+            local_known[slot] = op->opcode == ir_copy && var->array_len == 0
+                && constant_value(&op->arg1, temp_known, temp_value, &stored);
+            // the local only keeps as many bytes as its type has
+            int size = int_type_size(var->int_type);
+            local_value[slot] = size < 4 ? stored & ((1 << (size * 8)) - 1) : stored;
+            continue;
+        }
+        if (!op_writes_result(op) || op->result.type != irv_temp) {
+            continue;
+        }
+        if (op->opcode == ir_copy && op->arg1.type == irv_local_variable && !op->arg1.offset_in_temp
+                && local_known[tracked_value(symbols, func_index, &op->arg1)]) {
+            int value = local_value[tracked_value(symbols, func_index, &op->arg1)];
+            memset(&op->arg1, 0, sizeof(IRValue));
+            op->arg1.type = irv_immediate;
+            op->arg1.immediate_value = value;
+            changed = true;
+        }
+        int element;
+        if (op->opcode == ir_copy && const_element(symbols, &op->arg1, temp_known, temp_value, &element)) {
+            memset(&op->arg1, 0, sizeof(IRValue));
+            op->arg1.type = irv_immediate;
+            op->arg1.immediate_value = element;
+            changed = true;
+        }
+        int temp = op->result.temp_num;
+        int a;
+        int b;
+        int result;
+        if (op->opcode == ir_copy) {
+            temp_known[temp] = op->arg1.type == irv_immediate;
+            temp_value[temp] = op->arg1.immediate_value;
+            continue;
+        }
+        if (op->opcode == ir_intrinsic) {
+            bool known = constant_value(&op->arg1, temp_known, temp_value, &a)
+                && evaluate_intrinsic(op->arg2.immediate_value, a, &result);
+            temp_known[temp] = false;
+            if (known) {
+                op->opcode = ir_copy;
+                memset(&op->arg1, 0, sizeof(IRValue));
+                op->arg1.type = irv_immediate;
+                op->arg1.immediate_value = result;
+                memset(&op->arg2, 0, sizeof(IRValue));
+                temp_known[temp] = true;
+                temp_value[temp] = result;
+                changed = true;
+            }
+            continue;
+        }
+        if (op_prefers_immediate_arg2(op) && op->arg2.type == irv_temp
+                && constant_value(&op->arg2, temp_known, temp_value, &b)) {
+            memset(&op->arg2, 0, sizeof(IRValue));
+            op->arg2.type = irv_immediate;
+            op->arg2.immediate_value = b;
+            changed = true;
+        }
+        // the args are read before the result is written, so "t = t << 2" can be folded too
+        bool known = constant_value(&op->arg1, temp_known, temp_value, &a)
+            && constant_value(&op->arg2, temp_known, temp_value, &b)
+            && evaluate_op(op->opcode, a, b, &result);
+        temp_known[temp] = false;
+        if (!known) {
+            // "x | 0" is just x, e.g. when a BitField item is set to 0
+            if (op->opcode == ir_bitwise_or && op->arg2.type == irv_immediate && op->arg2.immediate_value == 0) {
+                if (op->arg1.type == irv_temp && op->arg1.temp_num == temp) {
+                    changed = changed || !removed[i];
+                    removed[i] = true;
+                } else {
+                    op->opcode = ir_copy;
+                    memset(&op->arg2, 0, sizeof(IRValue));
+                    changed = true;
+                }
+            }
+            continue;
+        }
+        bool comparison = op->opcode == ir_equals || op->opcode == ir_less_than || op->opcode == ir_greater_than;
+        if (comparison) {
+            // the "if" branches on the flags the comparison sets, so only fold both together
+            IROp *next = i + 1 < len ? &code[i + 1] : NULL;
+            if (next == NULL || next->opcode != ir_if || next->label != 0
+                    || next->arg1.type != irv_temp || next->arg1.temp_num != temp) {
+                continue;
+            }
+            if (result) {
+                next->opcode = ir_goto;
+            } else {
+                removed[i + 1] = true;
+            }
+        }
+        op->opcode = ir_copy;
+        op->arg1.type = irv_immediate;
+        op->arg1.immediate_value = result;
+        memset(&op->arg2, 0, sizeof(IRValue));
+        temp_known[temp] = true;
+        temp_value[temp] = result;
+        changed = true;
+    }
+    return changed;
+}
+
+// How many temps can be used at once. With --gp the last temp register holds the start
+// of RAM instead.
+int temp_registers_num(void) {
+    return options.gp ? TEMP_REGISTERS_NUM - 1 : TEMP_REGISTERS_NUM;
+}
+
+// Returns true if the op reads or writes the temp, including through an address or an
+// array offset in a temp
+bool op_references_temp(IROp *op, int temp) {
+    IRValue *values[3] = {&op->arg1, &op->arg2, &op->result};
+    bool used[3] = {op_reads_arg1(op), op_reads_arg2(op), op_writes_result(op)};
+    for (int v = 0; v < 3; v++) {
+        if (!used[v]) {
+            continue;
+        }
+        if (values[v]->type == irv_temp && values[v]->temp_num == temp) {
+            return true;
+        }
+        if (values[v]->address_in_temp && values[v]->address_temp_num == temp) {
+            return true;
+        }
+        if (values[v]->offset_in_temp && values[v]->offset_temp_num == temp) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Every temp is a register, so a statement that needs more temps than there are
+// registers for them can't be compiled
+void check_temps(SymbolTable *symbols, int func_index) {
+    Function *func = &symbols->functions[func_index];
+    for (int i = 0; i < func->ir_code_len; i++) {
+        for (int t = temp_registers_num(); t < MAX_TRACKED_TEMPS; t++) {
+            if (op_references_temp(&symbols->ir_code[func->ir_code_index + i], t)) {
+                STRINGREF_TO_CSTR1(&func->name, 512);
+                PANIC("A statement in function '%s' needs more than %d temp registers, it has to be split up\n", cstr1, temp_registers_num());
+            }
+        }
+    }
+}
+
+// Returns true if an op reads or writes a peripheral register
+bool op_accesses_register(IROp *op, int si_index) {
+    IRValue *values[3] = {&op->arg1, &op->arg2, &op->result};
+    bool used[3] = {op_reads_arg1(op), op_reads_arg2(op), op_writes_result(op)};
+    for (int v = 0; v < 3; v++) {
+        if (used[v] && values[v]->type == irv_mmp_struct_item && values[v]->mmp_struct_item_index == si_index) {
+            return true;
+        }
+    }
+    return false;
+}
+// Returns true if an op is "temp = temp OP immediate-or-temp"
+bool op_updates_temp(IROp *op, IROpCode opcode, int temp) {
+    return op->opcode == opcode && op->label == 0
+        && op->result.type == irv_temp && op->result.temp_num == temp
+        && op->arg1.type == irv_temp && op->arg1.temp_num == temp;
+}
+// Returns true if ops i-3..i are the read-modify-write of a BitField item that the
+// parser emits: "t = reg; t = t & ~mask; t = t | value; reg = t"
+bool field_write_at(IROp *code, int i) {
+    if (i < 3 || code[i].opcode != ir_copy || code[i].label != 0 || code[i].result.type != irv_mmp_struct_item
+            || code[i].result.address_in_temp || code[i].arg1.type != irv_temp) {
+        return false;
+    }
+    int temp = code[i].arg1.temp_num;
+    IROp *load = &code[i - 3];
+    return load->opcode == ir_copy && load->result.type == irv_temp && load->result.temp_num == temp
+        && load->arg1.type == irv_mmp_struct_item && !load->arg1.address_in_temp
+        && load->arg1.mmp_struct_item_index == code[i].result.mmp_struct_item_index
+        && op_updates_temp(&code[i - 2], ir_bitwise_and, temp) && code[i - 2].arg2.type == irv_immediate
+        && op_updates_temp(&code[i - 1], ir_bitwise_or, temp)
+        && (code[i - 1].arg2.type != irv_temp || code[i - 1].arg2.temp_num != temp);
+}
+// Returns true and sets value if an op's arg2 is an immediate or a temp that holds one
+bool arg2_constant(IROp *code, int i, int *value) {
+    if (code[i].arg2.type == irv_immediate) {
+        *value = code[i].arg2.immediate_value;
+        return true;
+    }
+    return code[i].arg2.type == irv_temp && temp_constant_before(code, i, code[i].arg2.temp_num, value);
+}
+// Renames the temp a BitField read-modify-write at i-3..i keeps the register in
+void rename_field_write_temp(IROp *code, int i, int temp) {
+    code[i - 3].result.temp_num = temp;
+    code[i - 2].result.temp_num = temp;
+    code[i - 2].arg1.temp_num = temp;
+    code[i - 1].result.temp_num = temp;
+    code[i - 1].arg1.temp_num = temp;
+    code[i].arg1.temp_num = temp;
+}
+
+// Merges writes to BitField items of the same register into a single read-modify-write,
+// when nothing in between touches the register. The store of the first write and the
+// load of the second are removed, so the register is read and written once:
+//   t = reg; t = t & ~a; t = t | x; [y]; t = t & ~b; t = t | y; reg = t
+// If both values are constants, the masks are merged too:
+//   t = reg; t = t & ~(a | b); t = t | (x | y); reg = t
+// Returns true if anything changed.
+bool coalesce_field_writes(SymbolTable *symbols, int func_index) {
+    Function *func = &symbols->functions[func_index];
+    IROp *code = &symbols->ir_code[func->ir_code_index];
+    bool changed = false;
+    for (int i = 0; i < func->ir_code_len; i++) {
+        if (removed[i] || !field_write_at(code, i)) {
+            continue;
+        }
+        int si_index = code[i].result.mmp_struct_item_index;
+        int temp = code[i].arg1.temp_num;
+        for (int j = i - 4; j >= 1; j--) {
+            if (code[j + 1].label != 0) {
+                break;
+            }
+            if (removed[j]) {
+                continue;
+            }
+            IROp *op = &code[j];
+            bool store = op->opcode == ir_copy && op->result.type == irv_mmp_struct_item
+                && op->result.mmp_struct_item_index == si_index && !op->result.address_in_temp
+                && op->arg1.type == irv_temp && op->label == 0;
+            if (store && op_updates_temp(&code[j - 1], ir_bitwise_or, op->arg1.temp_num)) {
+                if (j >= 2 && removed[j - 2]) {
+                    // this write was merged into an earlier one on this pass, so its AND
+                    // and OR are gone. It is merged with this one on the next pass, once
+                    // they have been compacted away.
+                    break;
+                }
+                // the first write's temp has to hold the register until the second write
+                int first_temp = op->arg1.temp_num;
+                bool kept = true;
+                for (int k = j + 1; k < i - 3; k++) {
+                    kept = kept && (removed[k] || !op_references_temp(&code[k], first_temp));
+                }
+                if (!kept) {
+                    break;
+                }
+                if (first_temp != temp) {
+                    if (code[i - 1].arg2.type == irv_temp && code[i - 1].arg2.temp_num == first_temp) {
+                        break;
+                    }
+                    rename_field_write_temp(code, i, first_temp);
+                }
+                int first_value;
+                int second_value;
+                if (j >= 2 && op_updates_temp(&code[j - 2], ir_bitwise_and, first_temp) && code[j - 2].arg2.type == irv_immediate
+                        && arg2_constant(code, j - 1, &first_value) && arg2_constant(code, i - 1, &second_value)) {
+                    uint32_t second_clear = code[i - 2].arg2.immediate_value;
+                    code[j - 2].arg2.immediate_value &= second_clear;
+                    memset(&code[j - 1].arg2, 0, sizeof(IRValue));
+                    code[j - 1].arg2.type = irv_immediate;
+                    code[j - 1].arg2.immediate_value = (first_value & second_clear) | second_value;
+                    // fold_constants removes the "t = t | 0" of a write of 0
+                    removed[j - 1] = false;
+                    removed[i - 2] = true;
+                    removed[i - 1] = true;
+                }
+                removed[j] = true;
+                removed[i - 3] = true;
+                changed = true;
+                break;
+            }
+            if (op_ends_block(op) || op_clobbers_temps(op) || op_is_memory_barrier(op) || op_accesses_register(op, si_index)) {
+                break;
+            }
+        }
+    }
+    return changed;
+}
+
+// Values that an interrupt can't change: statics and peripheral registers are shared,
+// but temps, local variables and arguments belong to the code that is running
+bool value_is_thread_local(IRValue *value) {
+    switch (value->type) {
+        case irv_immediate:
+        case irv_temp:
+        case irv_local_variable:
+        case irv_function_argument:
+            return true;
+        default:
+            return false;
+    }
+}
+// An op that gives the same result whether interrupts are masked or not, so it can be
+// moved out of an atomic block. Comparisons are left alone because the "if" after them
+// reads the flags they set.
+bool op_is_thread_local(IROp *op) {
+    if (!op_is_binary(op) && op->opcode != ir_copy) {
+        return false;
+    }
+    if (op->opcode == ir_equals || op->opcode == ir_less_than || op->opcode == ir_greater_than) {
+        return false;
+    }
+    if (!value_is_thread_local(&op->result) || !value_is_thread_local(&op->arg1)) {
+        return false;
+    }
+    return !op_reads_arg2(op) || value_is_thread_local(&op->arg2);
+}
+// Returns true if the op reads or writes a tracked value (a temp or local variable)
+bool op_uses_value(SymbolTable *symbols, int func_index, IROp *op, int value) {
+    if (value < MAX_TRACKED_TEMPS) {
+        return op_references_temp(op, value);
+    }
+    IRValue *values[3] = {&op->arg1, &op->arg2, &op->result};
+    bool used[3] = {op_reads_arg1(op), op_reads_arg2(op), op_writes_result(op)};
+    for (int v = 0; v < 3; v++) {
+        if (used[v] && tracked_value(symbols, func_index, values[v]) == value) {
+            return true;
+        }
+    }
+    return false;
+}
+// Returns true if a thread-local op can be moved past another op: neither one writes a
+// temp or local variable that the other uses
+bool ops_independent(SymbolTable *symbols, int func_index, IROp *thread_local, IROp *other) {
+    int written = tracked_value(symbols, func_index, &thread_local->result);
+    if (written != -1 && op_uses_value(symbols, func_index, other, written)) {
+        return false;
+    }
+    if (!op_writes_result(other)) {
+        return true;
+    }
+    written = tracked_value(symbols, func_index, &other->result);
+    return written == -1 || !op_uses_value(symbols, func_index, thread_local, written);
+}
+// Ops that thread-local ops aren't moved past
+bool op_stops_code_motion(IROp *op) {
+    return op->label != 0 || op_ends_block(op) || op_clobbers_temps(op) || op->opcode == ir_param
+        || op->opcode == ir_atomic_begin || op->opcode == ir_atomic_end;
+}
+// Moves op from to position to, shifting the ops in between by one. The labels stay
+// where they were.
+void move_op(IROp *code, int from, int to) {
+    int step = from < to ? 1 : -1;
+    for (int i = from; i != to; i += step) {
+        IROp op = code[i];
+        code[i] = code[i + step];
+        code[i + step] = op;
+        int label = code[i].label;
+        code[i].label = code[i + step].label;
+        code[i + step].label = label;
+    }
+}
+// Moves thread-local ops out of atomic blocks, to before the start or after the end, so
+// interrupts are masked for as little time as possible. Only ops that can be moved past
+// everything between them and the edge of the block are moved, and only as far as the
+// first branch target or branch.
+void shrink_atomic_blocks(SymbolTable *symbols, int func_index) {
+    Function *func = &symbols->functions[func_index];
+    IROp *code = &symbols->ir_code[func->ir_code_index];
+    int len = func->ir_code_len;
+    for (int begin = 0; begin < len; begin++) {
+        if (code[begin].opcode != ir_atomic_begin) {
+            continue;
+        }
+        for (int j = begin + 1; j < len && !op_stops_code_motion(&code[j]); j++) {
+            bool movable = op_is_thread_local(&code[j]);
+            for (int k = begin + 1; k < j && movable; k++) {
+                movable = ops_independent(symbols, func_index, &code[j], &code[k]);
+            }
+            if (movable) {
+                move_op(code, j, begin);
+                begin++;
+            }
+        }
+    }
+    for (int end = len - 1; end >= 0; end--) {
+        if (code[end].opcode != ir_atomic_end || code[end].label != 0) {
+            continue;
+        }
+        for (int j = end - 1; j >= 0 && !op_stops_code_motion(&code[j]); j--) {
+            bool movable = op_is_thread_local(&code[j]);
+            for (int k = j + 1; k < end && movable; k++) {
+                movable = ops_independent(symbols, func_index, &code[j], &code[k]);
+            }
+            if (movable) {
+                move_op(code, j, end);
+                end--;
+            }
+        }
+    }
+}
+
+// Repeatedly folds constants, merges BitField writes and removes unreachable blocks,
+// dead ops and useless branches from one function until there is nothing left to change.
+void eliminate_dead_code(SymbolTable *symbols, int func_index) {
+    bool changed = true;
+    while (changed) {
+        Function *func = &symbols->functions[func_index];
+        memset(removed, 0, sizeof(bool) * func->ir_code_len);
+        changed = fold_constants(symbols, func_index);
+        changed = coalesce_field_writes(symbols, func_index) || changed;
+        build_flow_graph(symbols, func_index, &graph);
+        compute_liveness(symbols, func_index, &graph);
+        changed = mark_unreachable_blocks(&graph) || changed;
+        changed = mark_dead_ops(symbols, func_index, &graph) || changed;
+        changed = mark_branches_to_next(symbols, func_index) || changed;
+        if (changed) {
+            compact_function_ir(symbols, func_index, -1, NULL, 0);
+        }
+    }
+}
+
+// Computes the blocks that dominate each block: the blocks that every path from the
+// entry block has to go through to get there. Every block dominates itself.
+void compute_dominators(FlowGraph *graph) {
+    for (int b = 0; b < graph->blocks_num; b++) {
+        if (b == 0) {
+            block_set_clear(&graph->blocks[b].dominators);
+            block_set_add(&graph->blocks[b].dominators, b);
+        } else {
+            block_set_fill(&graph->blocks[b].dominators);
+        }
+    }
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int b = 1; b < graph->blocks_num; b++) {
+            BlockSet doms;
+            block_set_fill(&doms);
+            bool has_pred = false;
+            for (int p = 0; p < graph->blocks_num; p++) {
+                for (int s = 0; s < graph->blocks[p].succs_num; s++) {
+                    if (graph->blocks[p].succs[s] == b) {
+                        block_set_intersect(&doms, &graph->blocks[p].dominators);
+                        has_pred = true;
+                    }
+                }
+            }
+            if (!has_pred) {
+                block_set_clear(&doms);
+            }
+            block_set_add(&doms, b);
+            if (memcmp(&doms, &graph->blocks[b].dominators, sizeof(BlockSet)) != 0) {
+                graph->blocks[b].dominators = doms;
+                changed = true;
+            }
+        }
+    }
+}
+
+// Returns true if block "from" has an edge to block "to"
+bool block_has_succ(FlowGraph *graph, int from, int to) {
+    for (int s = 0; s < graph->blocks[from].succs_num; s++) {
+        if (graph->blocks[from].succs[s] == to) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Finds every loop in the graph that has a single back edge, ordered by the position of
+// its header. An edge is a back edge if it goes to a block that dominates where it came
+// from. The loop is every block that can reach the latch without going through the header.
+int find_loops(FlowGraph *graph, Loop *loops) {
+    int loops_num = 0;
+    for (int h = 0; h < graph->blocks_num; h++) {
+        int latch = -1;
+        int latches_num = 0;
+        for (int b = 0; b < graph->blocks_num; b++) {
+            if (block_has_succ(graph, b, h) && block_set_has(&graph->blocks[b].dominators, h)) {
+                latch = b;
+                latches_num++;
+            }
+        }
+        if (latches_num != 1) {
+            continue;
+        }
+        Loop *loop = &loops[loops_num++];
+        loop->header = h;
+        loop->latch = latch;
+        block_set_clear(&loop->blocks);
+        block_set_add(&loop->blocks, h);
+        int stack[MAX_BLOCKS];
+        int stack_len = 0;
+        if (!block_set_has(&loop->blocks, latch)) {
+            block_set_add(&loop->blocks, latch);
+            stack[stack_len++] = latch;
+        }
+        while (stack_len > 0) {
+            int b = stack[--stack_len];
+            for (int p = 0; p < graph->blocks_num; p++) {
+                if (block_has_succ(graph, p, b) && !block_set_has(&loop->blocks, p)) {
+                    block_set_add(&loop->blocks, p);
+                    stack[stack_len++] = p;
+                }
+            }
+        }
+    }
+    return loops_num;
+}
+
+// Returns true if the op at index i (relative to the function) is inside the loop
+bool op_in_loop(Loop *loop, int i) {
+    return block_set_has(&loop->blocks, block_of_op[i]);
+}
+
+// Returns true and sets address if value is a static variable or peripheral register,
+// which are read and written through their address
+bool value_address(SymbolTable *symbols, IRValue *value, uint32_t *address) {
+    if (value->type == irv_mmp_struct_item) {
+        *address = symbols->struct_items[value->mmp_struct_item_index].address;
+        return true;
+    }
+    if (value->type == irv_static_variable) {
+        *address = symbols->static_vars[value->static_variable_index].address;
+        return true;
+    }
+    return false;
+}
+
+// These estimate how many instructions the backend will emit for a value or an op.
+// They follow what armv6m.c does and err on the side of too many.
+int estimate_immediate_size(uint32_t imm) {
+    uint32_t low_bits = imm;
+    while (low_bits != 0 && (low_bits & 1) == 0) {
+        low_bits >>= 1;
+    }
+    if (imm <= 0xFF) {
+        return 1;
+    } else if (low_bits <= 0xFF) {
+        // an 8 bit value shifted left
+        return 2;
+    } else if (imm <= 0xFFFF) {
+        return 3;
+    } else if (imm <= 0xFFFFFF) {
+        return 5;
+    }
+    return 7;
+}
+int estimate_value_size(SymbolTable *symbols, IRValue *value) {
+    uint32_t address;
+    if (value_address(symbols, value, &address)) {
+        if (value->address_in_temp) {
+            return 1;
+        }
+        if (value->type == irv_static_variable && options.gp) {
+            Variable *var = &symbols->static_vars[value->static_variable_index];
+            if (static_var_near_gp(var)) {
+                return 1;
+            }
+            // the offset is added to R_GP
+            return estimate_immediate_size(address - RAM_BASE_ADDRESS) + 2;
+        }
+        return estimate_immediate_size(address) + 1;
+    }
+    switch (value->type) {
+        case irv_immediate:
+            return estimate_immediate_size(value->immediate_value);
+        case irv_local_variable:
+        case irv_function_argument:
+            return 2;
+        default:
+            return 0;
+    }
+}
+int estimate_op_size(SymbolTable *symbols, IROp *op) {
+    if (op->opcode == ir_asm) {
+        return symbols->asm_blocks[op->arg1.immediate_value].instructions_len;
+    }
+    int size = op->opcode == ir_intrinsic ? intrinsics[op->arg2.immediate_value].size : 3;
+    if (op_reads_arg1(op)) {
+        size += estimate_value_size(symbols, &op->arg1);
+    }
+    if (op_reads_arg2(op) && !(op_prefers_immediate_arg2(op) && op->arg2.type == irv_immediate)) {
+        size += estimate_value_size(symbols, &op->arg2);
+    }
+    if (op->opcode == ir_divide || op->opcode == ir_modulo) {
+        // by a constant this is a multiply-high sequence, otherwise a call to ____udivmod
+        size += op->arg2.type == irv_immediate ? 24 : 4;
+    }
+    if (op_writes_result(op)) {
+        size += estimate_value_size(symbols, &op->result);
+    }
+    return size;
+}
+
+// Gives a static variable or peripheral register an address in a temp that is loaded
+// before the loop. Values with the same address share a temp.
+// Returns false if there are no free temps left.
+bool hoist_address(SymbolTable *symbols, IRValue *value, bool *temp_free, IROp *preheader, int *preheader_len) {
+    uint32_t address;
+    if (!value_address(symbols, value, &address) || value->address_in_temp) {
+        return true;
+    }
+    if (value->type == irv_static_variable && static_var_near_gp(&symbols->static_vars[value->static_variable_index])) {
+        // it can already be reached from R_GP in a single instruction
+        return true;
+    }
+    for (int k = 0; k < *preheader_len; k++) {
+        IROp *op = &preheader[k];
+        if (op->arg1.type == irv_immediate && (uint32_t)op->arg1.immediate_value == address) {
+            value->address_in_temp = true;
+            value->address_temp_num = op->result.temp_num;
+            return true;
+        }
+    }
+    for (int t = 0; t < temp_registers_num(); t++) {
+        if (temp_free[t]) {
+            temp_free[t] = false;
+            IROp op = {0};
+            op.opcode = ir_copy;
+            op.result.type = irv_temp;
+            op.result.temp_num = t;
+            op.arg1.type = irv_immediate;
+            op.arg1.immediate_value = address;
+            preheader[(*preheader_len)++] = op;
+            value->address_in_temp = true;
+            value->address_temp_num = t;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns true if a value is the same on every iteration of the loop
+bool value_is_invariant(SymbolTable *symbols, int func_index, IRValue *value, ValueSet *written, bool *temp_hoisted) {
+    if (value->offset_in_temp && !temp_hoisted[value->offset_temp_num]) {
+        return false;
+    }
+    switch (value->type) {
+        case irv_immediate:
+        case irv_function_argument:
+            return true;
+        case irv_local_variable:
+            return !value_set_has(written, tracked_value(symbols, func_index, value));
+        case irv_temp:
+            return temp_hoisted[value->temp_num];
+        case irv_static_variable:
+            // other statics can be changed by interrupts, but const arrays never change
+            return symbols->static_vars[value->static_variable_index].is_const;
+        default:
+            // peripheral registers can be changed by hardware
+            return false;
+    }
+}
+
+// Moves computations that give the same result on every iteration out of a loop and
+// into a preheader that runs once before it. First the addresses of statics and
+// peripheral registers are loaded into temps, then temps that are set to an invariant
+// value are moved out of the loop. This needs free temp registers that stay the same
+// for the whole loop, so loops that call functions (which clobber temps) are skipped.
+// Returns true if the function's IR was changed.
+bool hoist_loop_invariants(SymbolTable *symbols, int func_index, Loop *loop) {
+    Function *func = &symbols->functions[func_index];
+    IROp *code = &symbols->ir_code[func->ir_code_index];
+    int len = func->ir_code_len;
+    BasicBlock *header = &graph.blocks[loop->header];
+    int header_label = code[header->first].label;
+
+    // the preheader goes right before the header, so the loop can only be entered by
+    // falling into the header from above
+    for (int i = 0; i < len; i++) {
+        if (!op_in_loop(loop, i) && op_is_branch(&code[i]) && code[i].target_label == header_label) {
+            return false;
+        }
+    }
+
+    bool temp_free[TEMP_REGISTERS_NUM];
+    bool temp_hoisted[MAX_TRACKED_TEMPS];
+    memset(temp_hoisted, 0, sizeof(temp_hoisted));
+    for (int t = 0; t < TEMP_REGISTERS_NUM; t++) {
+        temp_free[t] = t < temp_registers_num() && !value_set_has(&header->live_in, t);
+    }
+    ValueSet written;
+    value_set_clear(&written);
+    for (int i = 0; i < len; i++) {
+        if (!op_in_loop(loop, i)) {
+            continue;
+        }
+        IROp *op = &code[i];
+        if (op_clobbers_temps(op) || op->opcode == ir_param) {
+            return false;
+        }
+        for (int t = 0; t < TEMP_REGISTERS_NUM; t++) {
+            if (op_references_temp(op, t)) {
+                temp_free[t] = false;
+            }
+        }
+        if (op_writes_result(op)) {
+            int def = tracked_value(symbols, func_index, &op->result);
+            if (def != -1) {
+                value_set_add(&written, def);
+            }
+        }
+    }
+
+    IROp preheader[TEMP_REGISTERS_NUM];
+    int preheader_len = 0;
+    memset(removed, 0, sizeof(bool) * len);
+
+    // addresses of statics and peripheral registers
+    for (int i = 0; i < len; i++) {
+        if (!op_in_loop(loop, i)) {
+            continue;
+        }
+        IROp *op = &code[i];
+        if (op_reads_arg1(op) && !hoist_address(symbols, &op->arg1, temp_free, preheader, &preheader_len)) {
+            break;
+        }
+        if (op_reads_arg2(op) && !hoist_address(symbols, &op->arg2, temp_free, preheader, &preheader_len)) {
+            break;
+        }
+        if (op_writes_result(op) && !hoist_address(symbols, &op->result, temp_free, preheader, &preheader_len)) {
+            break;
+        }
+    }
+
+    // temps that are set to the same value on every iteration
+    for (int i = 0; i < len; i++) {
+        if (!op_in_loop(loop, i)) {
+            continue;
+        }
+        IROp *op = &code[i];
+        if (op->result.type != irv_temp) {
+            continue;
+        }
+        bool invariant = false;
+        if (op->opcode == ir_copy) {
+            // a copy from a temp is emitted as nothing, so it can't be moved to a new temp
+            invariant = op->arg1.type != irv_temp
+                && value_is_invariant(symbols, func_index, &op->arg1, &written, temp_hoisted);
+        } else if (op->opcode == ir_add || op->opcode == ir_subtract || op->opcode == ir_shift_left
+                || op->opcode == ir_shift_right || op->opcode == ir_bitwise_and
+                || op->opcode == ir_bitwise_or || op->opcode == ir_bitwise_xor
+                || op->opcode == ir_multiply || op->opcode == ir_divide || op->opcode == ir_modulo) {
+            // comparisons are left alone, the branch after them uses the flags they set
+            invariant = value_is_invariant(symbols, func_index, &op->arg1, &written, temp_hoisted)
+                && value_is_invariant(symbols, func_index, &op->arg2, &written, temp_hoisted);
+        }
+        if (!invariant) {
+            continue;
+        }
+
+        // the temp must only be read later in the same block, before it is set again
+        int temp = op->result.temp_num;
+        BasicBlock *block = &graph.blocks[block_of_op[i]];
+        int block_end = block->first + block->len;
+        int uses_end = block_end;
+        bool set_again = false;
+        for (int j = i + 1; j < block_end; j++) {
+            if (op_writes_result(&code[j]) && code[j].result.type == irv_temp && code[j].result.temp_num == temp) {
+                uses_end = j + 1;
+                set_again = true;
+                break;
+            }
+        }
+        if (!set_again && value_set_has(&block->live_out, temp)) {
+            continue;
+        }
+
+        int new_temp = -1;
+        for (int t = 0; t < TEMP_REGISTERS_NUM; t++) {
+            if (temp_free[t]) {
+                new_temp = t;
+                break;
+            }
+        }
+        if (new_temp == -1) {
+            break;
+        }
+        temp_free[new_temp] = false;
+        temp_hoisted[new_temp] = true;
+
+        IROp hoisted = *op;
+        hoisted.label = 0;
+        hoisted.result.temp_num = new_temp;
+        preheader[preheader_len++] = hoisted;
+        removed[i] = true;
+        for (int j = i + 1; j < uses_end; j++) {
+            if (op_reads_arg1(&code[j]) && code[j].arg1.type == irv_temp && code[j].arg1.temp_num == temp) {
+                code[j].arg1.temp_num = new_temp;
+            }
+            if (op_reads_arg2(&code[j]) && code[j].arg2.type == irv_temp && code[j].arg2.temp_num == temp) {
+                code[j].arg2.temp_num = new_temp;
+            }
+            IRValue *values[3] = {&code[j].arg1, &code[j].arg2, &code[j].result};
+            for (int v = 0; v < 3; v++) {
+                if (values[v]->offset_in_temp && values[v]->offset_temp_num == temp) {
+                    values[v]->offset_temp_num = new_temp;
+                }
+            }
+        }
+    }
+
+    if (preheader_len == 0) {
+        return false;
+    }
+    compact_function_ir(symbols, func_index, header->first, preheader, preheader_len);
+    return true;
+}
+
+// Rotates a loop in the form the parser generates for while loops:
+//  H: (condition)          H: (condition)
+//     if t goto B             if t goto B
+//     goto E                  goto E
+//  B: (body)       into    B: (body)
+//     goto H                  (condition)
+//  E:                         if t goto B
+//                          E:
+// The condition at the top only runs once, and each iteration after that takes one
+// branch instead of two. The new branch at the bottom is conditional, so this is only
+// done for loops that are small enough for it to reach the top.
+// Returns the label of B if the loop was rotated, or 0.
+int rotate_loop(SymbolTable *symbols, int func_index, Loop *loop) {
+    Function *func = &symbols->functions[func_index];
+    IROp *code = &symbols->ir_code[func->ir_code_index];
+    int len = func->ir_code_len;
+    int h = loop->header;
+    BasicBlock *header = &graph.blocks[h];
+    BasicBlock *latch = &graph.blocks[loop->latch];
+    IROp *test = &code[header->first + header->len - 1];
+    IROp *back = &code[latch->first + latch->len - 1];
+
+    // check that the loop looks like the left side above
+    if (test->opcode != ir_if || header->len > MAX_ROTATED_HEADER_LEN || h + 2 >= graph.blocks_num) {
+        return 0;
+    }
+    BasicBlock *exit_goto = &graph.blocks[h + 1];
+    BasicBlock *body = &graph.blocks[h + 2];
+    if (exit_goto->len != 1 || code[exit_goto->first].opcode != ir_goto || block_set_has(&loop->blocks, h + 1)) {
+        return 0;
+    }
+    if (test->target_label != code[body->first].label) {
+        return 0;
+    }
+    if (back->opcode != ir_goto || back->target_label != code[header->first].label) {
+        return 0;
+    }
+    for (int b = h + 2; b <= loop->latch; b++) {
+        if (!block_set_has(&loop->blocks, b)) {
+            return 0;
+        }
+    }
+    int exit_label = code[exit_goto->first].target_label;
+
+    // check that the branch at the bottom can reach the top of the body
+    int size = 0;
+    for (int i = body->first; i < latch->first + latch->len - 1; i++) {
+        size += estimate_op_size(symbols, &code[i]);
+    }
+    for (int i = header->first; i < header->first + header->len; i++) {
+        size += estimate_op_size(symbols, &code[i]);
+    }
+    if (size > MAX_ROTATED_LOOP_SIZE) {
+        return 0;
+    }
+
+    int back_index = latch->first + latch->len - 1;
+    int new_len = 0;
+    for (int i = 0; i < len; i++) {
+        if (i != back_index) {
+            new_code[new_len++] = code[i];
+            continue;
+        }
+        // replace the goto with a copy of the condition
+        for (int k = header->first; k < header->first + header->len; k++) {
+            IROp op = code[k];
+            op.label = k == header->first ? code[i].label : 0;
+            new_code[new_len++] = op;
+        }
+        if (i + 1 >= len || code[i + 1].label != exit_label) {
+            IROp goto_op = {0};
+            goto_op.opcode = ir_goto;
+            goto_op.target_label = exit_label;
+            new_code[new_len++] = goto_op;
+        }
+    }
+    int body_label = code[body->first].label;
+    set_function_ir(symbols, func_index, new_code, new_len);
+    return body_label;
+}
+
+// Returns true if label is one of the first labels_num items of labels
+bool label_in_list(int *labels, int labels_num, int label) {
+    for (int i = 0; i < labels_num; i++) {
+        if (labels[i] == label) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Moves loop invariant code out of every loop in a function, then rotates every loop.
+// Loops are found again after each change, and remembered by the label of their header.
+void optimize_loops(SymbolTable *symbols, int func_index) {
+    static Loop loops[MAX_BLOCKS];
+    int done_labels[MAX_BLOCKS];
+    int done_labels_num = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        Function *func = &symbols->functions[func_index];
+        IROp *code = &symbols->ir_code[func->ir_code_index];
+        build_flow_graph(symbols, func_index, &graph);
+        compute_liveness(symbols, func_index, &graph);
+        compute_dominators(&graph);
+        int loops_num = find_loops(&graph, loops);
+        for (int l = 0; l < loops_num && !changed; l++) {
+            int header_label = code[graph.blocks[loops[l].header].first].label;
+            if (!label_in_list(done_labels, done_labels_num, header_label)) {
+                done_labels[done_labels_num++] = header_label;
+                changed = hoist_loop_invariants(symbols, func_index, &loops[l]);
+            }
+        }
+    }
+
+    done_labels_num = 0;
+    changed = true;
+    while (changed) {
+        changed = false;
+        Function *func = &symbols->functions[func_index];
+        IROp *code = &symbols->ir_code[func->ir_code_index];
+        build_flow_graph(symbols, func_index, &graph);
+        compute_dominators(&graph);
+        int loops_num = find_loops(&graph, loops);
+        for (int l = 0; l < loops_num && !changed; l++) {
+            int header_label = code[graph.blocks[loops[l].header].first].label;
+            if (!label_in_list(done_labels, done_labels_num, header_label)) {
+                done_labels[done_labels_num++] = header_label;
+                int body_label = rotate_loop(symbols, func_index, &loops[l]);
+                if (body_label != 0) {
+                    done_labels[done_labels_num++] = body_label;
+                    changed = true;
+                }
+            }
+        }
+    }
+}
+
+// Finds every call in the program and which constant arguments it passes.
+// The params before a call are pushed in order, so the last param pushed ends up
+// closest to the callee's frame and is the first argument the callee reads.
+// Returns -1 if there are more than MAX_CALL_SITES calls.
+int find_call_sites(SymbolTable *symbols, CallSite *sites) {
+    int sites_num = 0;
+    for (int caller = 0; caller < symbols->functions_num; caller++) {
+        Function *func = &symbols->functions[caller];
+        IROp *code = &symbols->ir_code[func->ir_code_index];
+        for (int i = 0; i < func->ir_code_len; i++) {
+            if (code[i].opcode != ir_call) {
+                continue;
+            }
+            if (sites_num == MAX_CALL_SITES) {
+                return -1;
+            }
+            CallSite *site = &sites[sites_num++];
+            memset(site, 0, sizeof(CallSite));
+            site->caller = caller;
+            site->op_index = i;
+            site->callee = code[i].arg1.func_index;
+            int args_len = symbols->functions[site->callee].func_args_len;
+            int arg_num = 0;
+            int skip = 0;
+            for (int j = i - 1; j >= 0 && arg_num < args_len; j--) {
+                if (code[j].opcode == ir_call) {
+                    // the params of a call inside an argument belong to that call
+                    skip += symbols->functions[code[j].arg1.func_index].func_args_len;
+                } else if (code[j].opcode == ir_param) {
+                    if (skip > 0) {
+                        skip--;
+                        continue;
+                    }
+                    if (arg_num < MAX_CALL_ARGS && code[j].arg1.type == irv_temp) {
+                        site->arg_known[arg_num] = temp_constant_before(code, j, code[j].arg1.temp_num, &site->arg_value[arg_num]);
+                        // the callee only loads as many bytes as the argument's type has
+                        int size = int_type_size(symbols->func_args[symbols->functions[site->callee].func_args_index + arg_num].int_type);
+                        if (size < 4) {
+                            site->arg_value[arg_num] &= (1 << (size * 8)) - 1;
+                        }
+                    }
+                    arg_num++;
+                }
+            }
+        }
+    }
+    // ____drain calls the deferred functions with the arguments in their queues, which
+    // aren't known at compile time
+    for (int q = 0; q < symbols->defer_queues_num; q++) {
+        if (sites_num == MAX_CALL_SITES) {
+            return -1;
+        }
+        CallSite *site = &sites[sites_num++];
+        memset(site, 0, sizeof(CallSite));
+        site->caller = symbols->defer_queues[q].handler_func_index;
+        site->op_index = -1;
+        site->callee = symbols->defer_queues[q].func_index;
+    }
+    return sites_num;
+}
+
+// Returns true if argument arg_num is read anywhere in a function
+bool function_reads_argument(SymbolTable *symbols, int func_index, int arg_num) {
+    Function *func = &symbols->functions[func_index];
+    IROp *code = &symbols->ir_code[func->ir_code_index];
+    int arg_index = func->func_args_index + arg_num;
+    for (int i = 0; i < func->ir_code_len; i++) {
+        if (op_reads_arg1(&code[i]) && code[i].arg1.type == irv_function_argument && code[i].arg1.func_arg_index == arg_index) {
+            return true;
+        }
+        if (op_reads_arg2(&code[i]) && code[i].arg2.type == irv_function_argument && code[i].arg2.func_arg_index == arg_index) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Replaces every read of argument arg_num in a function with an immediate.
+// The caller still pushes the argument, so the stack layout doesn't change.
+void bind_argument(SymbolTable *symbols, int func_index, int arg_num, int value) {
+    Function *func = &symbols->functions[func_index];
+    IROp *code = &symbols->ir_code[func->ir_code_index];
+    int arg_index = func->func_args_index + arg_num;
+    for (int i = 0; i < func->ir_code_len; i++) {
+        IRValue *values[2] = {&code[i].arg1, &code[i].arg2};
+        for (int v = 0; v < 2; v++) {
+            if (values[v]->type == irv_function_argument && values[v]->func_arg_index == arg_index) {
+                memset(values[v], 0, sizeof(IRValue));
+                values[v]->type = irv_immediate;
+                values[v]->immediate_value = value;
+            }
+        }
+    }
+}
+
+// Moves an IRValue from one function to a copy of it
+void move_value_to_clone(IRValue *value, int clone, int vars_delta) {
+    if (value->type == irv_local_variable) {
+        value->local_variable_index += vars_delta;
+        value->func_index = clone;
+    } else if (value->type == irv_function_argument) {
+        value->func_index = clone;
+    }
+}
+
+// Makes a copy of a function with its own copies of its local variables, and returns
+// the index of the copy. The copy shares the original's arguments.
+int clone_function(SymbolTable *symbols, int func_index, char *name) {
+    Function clone = symbols->functions[func_index];
+    clone.name.str = name;
+    clone.name.len = strlen(name);
+    clone.func_vars_index = symbols->function_vars_num;
+    for (int v = 0; v < clone.func_vars_len; v++) {
+        add_function_variable(symbols, symbols->function_vars[symbols->functions[func_index].func_vars_index + v]);
+    }
+    clone.ir_code_index = -1;
+    clone.ir_code_len = 0;
+    int clone_index = add_function(symbols, clone);
+
+    Function *func = &symbols->functions[func_index];
+    int vars_delta = clone.func_vars_index - func->func_vars_index;
+    int len = func->ir_code_len;
+    for (int i = 0; i < len; i++) {
+        new_code[i] = symbols->ir_code[func->ir_code_index + i];
+        move_value_to_clone(&new_code[i].arg1, clone_index, vars_delta);
+        move_value_to_clone(&new_code[i].arg2, clone_index, vars_delta);
+        move_value_to_clone(&new_code[i].result, clone_index, vars_delta);
+    }
+    set_function_ir(symbols, clone_index, new_code, len);
+    return clone_index;
+}
+
+// Returns the estimated number of instructions in a function
+int estimate_function_size(SymbolTable *symbols, int func_index) {
+    Function *func = &symbols->functions[func_index];
+    int size = 0;
+    for (int i = 0; i < func->ir_code_len; i++) {
+        size += estimate_op_size(symbols, &symbols->ir_code[func->ir_code_index + i]);
+    }
+    return size;
+}
+
+// Propagates constant arguments from callers into the functions they call.
+// If every call to a function passes the same constant for an argument, the function
+// reads the constant instead. Otherwise, if a call passes constants that make the
+// function a lot smaller once its code is folded, the call is pointed at a copy of the
+// function made for those constants. Copies are named after the constants, e.g.
+// "delay[delay_count=10000]", and shared between calls that pass the same constants.
+// Constant return values are propagated by "fold_constants" at each call.
+void propagate_constants_between_functions(SymbolTable *symbols) {
+    static CallSite sites[MAX_CALL_SITES];
+    static Specialization specializations[MAX_CALL_SITES];
+    static char names[MAX_CALL_SITES][128];
+    int specializations_num = 0;
+    int sites_num = find_call_sites(symbols, sites);
+    if (sites_num == -1) {
+        // without every call, it can't be known what a function is always passed
+        return;
+    }
+
+    // arguments that every caller passes the same constant for
+    for (int f = 0; f < symbols->functions_num; f++) {
+        Function *func = &symbols->functions[f];
+        bool bound = false;
+        for (int k = 0; k < func->func_args_len && k < MAX_CALL_ARGS; k++) {
+            bool all_same = true;
+            int calls = 0;
+            int value = 0;
+            for (int s = 0; s < sites_num; s++) {
+                if (sites[s].callee != f) {
+                    continue;
+                }
+                if (!sites[s].arg_known[k] || (calls > 0 && sites[s].arg_value[k] != value)) {
+                    all_same = false;
+                }
+                value = sites[s].arg_value[k];
+                calls++;
+            }
+            if (calls > 0 && all_same && function_reads_argument(symbols, f, k)) {
+                bind_argument(symbols, f, k, value);
+                bound = true;
+            }
+        }
+        if (bound) {
+            eliminate_dead_code(symbols, f);
+        }
+    }
+
+    // copies of functions for the constants passed by one call
+    int budget = SPECIALIZATION_BUDGET;
+    for (int s = 0; s < sites_num; s++) {
+        CallSite *site = &sites[s];
+        Function *callee = &symbols->functions[site->callee];
+        bool any_known = false;
+        for (int k = 0; k < callee->func_args_len && k < MAX_CALL_ARGS; k++) {
+            if (site->arg_known[k] && !function_reads_argument(symbols, site->callee, k)) {
+                site->arg_known[k] = false;
+            }
+            any_known = any_known || site->arg_known[k];
+        }
+        if (!any_known) {
+            continue;
+        }
+
+        Specialization *spec = NULL;
+        for (int p = 0; p < specializations_num; p++) {
+            Specialization *other = &specializations[p];
+            bool same = other->func_index == site->callee;
+            for (int k = 0; k < MAX_CALL_ARGS && same; k++) {
+                same = other->arg_known[k] == site->arg_known[k]
+                    && (!site->arg_known[k] || other->arg_value[k] == site->arg_value[k]);
+            }
+            if (same) {
+                spec = other;
+                break;
+            }
+        }
+        if (spec == NULL) {
+            if (symbols->functions_num == MAX_FUNCTIONS) {
+                break;
+            }
+            spec = &specializations[specializations_num];
+            spec->func_index = site->callee;
+            memcpy(spec->arg_known, site->arg_known, sizeof(spec->arg_known));
+            memcpy(spec->arg_value, site->arg_value, sizeof(spec->arg_value));
+
+            // name the copy after the constants it is for
+            char *name = names[specializations_num];
+            specializations_num++;
+            STRINGREF_TO_CSTR1(&callee->name, 512);
+            int name_len = snprintf(name, 128, "%s[", cstr1);
+            for (int k = 0; k < MAX_CALL_ARGS; k++) {
+                if (site->arg_known[k] && name_len < 128) {
+                    STRINGREF_TO_CSTR2(&symbols->func_args[callee->func_args_index + k].name, 512);
+                    name_len += snprintf(name + name_len, 128 - name_len, "%s%s=%d",
+                        name[name_len - 1] == '[' ? "" : ",", cstr2, site->arg_value[k]);
+                }
+            }
+            if (name_len < 127) {
+                strcat(name, "]");
+            }
+
+            int functions_num = symbols->functions_num;
+            int function_vars_num = symbols->function_vars_num;
+            int ir_len = symbols->ir_len;
+            int clone = clone_function(symbols, site->callee, name);
+            for (int k = 0; k < MAX_CALL_ARGS; k++) {
+                if (site->arg_known[k]) {
+                    bind_argument(symbols, clone, k, site->arg_value[k]);
+                }
+            }
+            eliminate_dead_code(symbols, clone);
+            int size = estimate_function_size(symbols, site->callee);
+            int clone_size = estimate_function_size(symbols, clone);
+            if (clone_size * 100 <= size * (100 - MIN_SPECIALIZATION_SAVINGS) && clone_size <= budget) {
+                budget -= clone_size;
+                spec->clone = clone;
+            } else {
+                // not worth it, throw the copy away
+                symbols->functions_num = functions_num;
+                symbols->function_vars_num = function_vars_num;
+                symbols->ir_len = ir_len;
+                spec->clone = -1;
+            }
+        }
+        if (spec->clone != -1) {
+            Function *caller = &symbols->functions[site->caller];
+            symbols->ir_code[caller->ir_code_index + site->op_index].arg1.func_index = spec->clone;
+        }
+    }
+}
+
+// Marks every pair of local variables in a live set as interfering with each other
+void add_interference(SymbolTable *symbols, int func_index, ValueSet *live, ValueSet *interferes) {
+    Function *func = &symbols->functions[func_index];
+    for (int a = 0; a < func->func_vars_len; a++) {
+        if (!value_set_has(live, MAX_TRACKED_TEMPS + a)) {
+            continue;
+        }
+        for (int b = 0; b < func->func_vars_len; b++) {
+            if (value_set_has(live, MAX_TRACKED_TEMPS + b)) {
+                value_set_add(&interferes[a], b);
+            }
+        }
+    }
+}
+
+// Returns which round of assign_frame_offsets a local is placed in
+int frame_placement_round(Variable *var) {
+    if (var->array_len > 0) {
+        return 0;
+    }
+    switch (var->int_type) {
+        case int_u32: return 1;
+        case int_u16: return 2;
+        default: return 3;
+    }
+}
+
+// Gives each local variable of a function an offset in the stack frame, and sets the
+// size of the frame. Two locals interfere if they are ever live at the same time, or
+// if one is stored to while the other is live. Locals that don't interfere can share
+// space. Arrays are placed first, word aligned, because the backend reaches them with
+// a single "ADD Rd, SP, #imm". Then larger locals are placed before smaller ones, and
+// each one goes at the lowest offset that is aligned to its size and doesn't overlap a
+// local it interferes with, so u8 and u16 locals get packed into the gaps. Locals that
+// are never used get no space at all.
+void assign_frame_offsets(SymbolTable *symbols, int func_index) {
+    static ValueSet interferes[MAX_TRACKED_VALUES];
+    Function *func = &symbols->functions[func_index];
+    IROp *code = &symbols->ir_code[func->ir_code_index];
+    int vars_num = func->func_vars_len;
+    bool used[MAX_TRACKED_VALUES];
+    memset(used, 0, sizeof(used));
+    for (int v = 0; v < vars_num; v++) {
+        value_set_clear(&interferes[v]);
+    }
+
+    if (func->ir_code_len > 0) {
+        build_flow_graph(symbols, func_index, &graph);
+        compute_liveness(symbols, func_index, &graph);
+        add_interference(symbols, func_index, &graph.blocks[0].live_in, interferes);
+        for (int b = 0; b < graph.blocks_num; b++) {
+            BasicBlock *block = &graph.blocks[b];
+            ValueSet live = block->live_out;
+            for (int i = block->first + block->len - 1; i >= block->first; i--) {
+                IROp *op = &code[i];
+                if (op_writes_result(op) && op->result.type == irv_local_variable) {
+                    int def = tracked_value(symbols, func_index, &op->result) - MAX_TRACKED_TEMPS;
+                    used[def] = true;
+                    ValueSet stored = live;
+                    value_set_add(&stored, MAX_TRACKED_TEMPS + def);
+                    add_interference(symbols, func_index, &stored, interferes);
+                }
+                liveness_transfer(symbols, func_index, op, &live);
+                add_interference(symbols, func_index, &live, interferes);
+                for (int v = 0; v < vars_num; v++) {
+                    if (value_set_has(&live, MAX_TRACKED_TEMPS + v)) {
+                        used[v] = true;
+                    }
+                }
+            }
+        }
+    }
+
+    // place the locals, arrays first and then biggest first
+    int placed[MAX_TRACKED_VALUES];
+    int placed_num = 0;
+    int frame_bytes = 0;
+    for (int round = 0; round < 4; round++) {
+        for (int v = 0; v < vars_num; v++) {
+            Variable *var = &symbols->function_vars[func->func_vars_index + v];
+            if (!used[v] || frame_placement_round(var) != round) {
+                continue;
+            }
+            int size = variable_size(var);
+            int align = var->array_len > 0 ? 4 : size;
+            int offset = 0;
+            bool overlaps = true;
+            while (overlaps) {
+                overlaps = false;
+                for (int p = 0; p < placed_num; p++) {
+                    Variable *other = &symbols->function_vars[func->func_vars_index + placed[p]];
+                    int other_end = other->frame_offset + variable_size(other);
+                    if (value_set_has(&interferes[v], placed[p])
+                            && offset < other_end && other->frame_offset < offset + size) {
+                        offset = ((other_end + align - 1) / align) * align;
+                        overlaps = true;
+                    }
+                }
+            }
+            var->frame_offset = offset;
+            placed[placed_num++] = v;
+            if (offset + size > frame_bytes) {
+                frame_bytes = offset + size;
+            }
+        }
+    }
+    func->frame_size = (frame_bytes + 3) / 4;
+}
+
+// The entry-point for the optimizer
+// runs every pass over every function, then lays out each function's stack frame
+// Constants are propagated between functions once each function has been cleaned up,
+// so that the sizes used to decide on specializations are realistic
+void optimize(SymbolTable *symbols) {
+    for (int i = 0; i < symbols->functions_num; i++) {
+        if (symbols->functions[i].ir_code_len != 0) {
+            eliminate_dead_code(symbols, i);
+        }
+    }
+    propagate_constants_between_functions(symbols);
+    for (int i = 0; i < symbols->functions_num; i++) {
+        if (symbols->functions[i].ir_code_len != 0) {
+            eliminate_dead_code(symbols, i);
+            optimize_loops(symbols, i);
+            eliminate_dead_code(symbols, i);
+            shrink_atomic_blocks(symbols, i);
+            check_temps(symbols, i);
+        }
+        assign_frame_offsets(symbols, i);
+    }
+}
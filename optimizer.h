@@ -0,0 +1,101 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include <stdint.h>
+
+#include "ir.h"
+#include "symbols.h"
+
+// Temps are tracked in the first slots of a ValueSet, followed by the
+// local variables of the function being analyzed.
+#define MAX_TRACKED_TEMPS 8
+#define MAX_TRACKED_VALUES 256
+#define MAX_BLOCKS 512
+
+// Temps are kept in r2-r7, so only this many can be used at once. With --gp r7 is
+// kept for the statics, see temp_registers_num.
+#define TEMP_REGISTERS_NUM 6
+// A rotated loop branches back to its start with a conditional branch, which can only
+// reach about 128 instructions back. This is the most (estimated) instructions a loop
+// can have and still be rotated.
+#define MAX_ROTATED_LOOP_SIZE 120
+// The most IROps a loop's condition can have and still be copied to the bottom of the loop
+#define MAX_ROTATED_HEADER_LEN 8
+
+// Only this many arguments of a function call are checked for constants
+#define MAX_CALL_ARGS 8
+#define MAX_CALL_SITES 1024
+// A function is only specialized for the constant arguments of a call site if that
+// makes it at least this much smaller (in percent). All specializations together can
+// add at most SPECIALIZATION_BUDGET (estimated) instructions to the program.
+#define MIN_SPECIALIZATION_SAVINGS 25
+#define SPECIALIZATION_BUDGET 512
+
+// A fixed-size bitset of tracked values (temps and local variables)
+typedef struct _ValueSet {
+    uint32_t bits[MAX_TRACKED_VALUES / 32];
+} ValueSet;
+
+// A fixed-size bitset of basic blocks
+typedef struct _BlockSet {
+    uint32_t bits[MAX_BLOCKS / 32];
+} BlockSet;
+
+// A basic block is a run of IROps with a single entry (the first op) and a
+// single exit (the last op).
+// first is an index relative to the start of the function's IR.
+typedef struct _BasicBlock {
+    int first;
+    int len;
+    int succs[2];
+    int succs_num;
+    bool reachable;
+    ValueSet live_in;
+    ValueSet live_out;
+    BlockSet dominators;
+} BasicBlock;
+
+// The control flow graph of one function
+typedef struct _FlowGraph {
+    BasicBlock blocks[MAX_BLOCKS];
+    int blocks_num;
+} FlowGraph;
+
+// A natural loop: the header block dominates every block in the loop, and the latch
+// block is the one that jumps back to the header.
+typedef struct _Loop {
+    int header;
+    int latch;
+    BlockSet blocks;
+} Loop;
+
+// A call to a function, and which of the arguments it passes are known constants.
+// op_index is relative to the start of the caller's IR, or -1 for a deferred call, which
+// ____drain makes.
+typedef struct _CallSite {
+    int caller;
+    int op_index;
+    int callee;
+    bool arg_known[MAX_CALL_ARGS];
+    int arg_value[MAX_CALL_ARGS];
+} CallSite;
+
+// A copy of a function made for some constant arguments. clone is -1 if making the
+// copy was tried but wasn't worth it.
+typedef struct _Specialization {
+    int func_index;
+    int clone;
+    bool arg_known[MAX_CALL_ARGS];
+    int arg_value[MAX_CALL_ARGS];
+} Specialization;
+
+void build_flow_graph(SymbolTable *symbols, int func_index, FlowGraph *graph);
+void compute_liveness(SymbolTable *symbols, int func_index, FlowGraph *graph);
+void compute_dominators(FlowGraph *graph);
+int find_loops(FlowGraph *graph, Loop *loops);
+int find_call_sites(SymbolTable *symbols, CallSite *sites);
+int temp_registers_num(void);
+bool evaluate_op(IROpCode opcode, int a, int b, int *result);
+void optimize(SymbolTable *symbols);
+
+#endif
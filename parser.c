@@ -6,10 +6,13 @@
 // as it parses tokens, and then returning the index to the next token that it hasn't yet parsed.
 // Most functions take a reference the SymbolTable and add or reference entries as appropriate.
 
+#include <stdint.h>
+
 #include "parser.h"
 #include "common.h"
 #include "ir.h"
 #include "lexer.h"
+#include "optimizer.h"
 #include "symbols.h"
 
 
@@ -68,8 +71,190 @@ int match_bitenum(Token *tokens, int next_token, int *dest, int indent) {
     return match(t_be, tokens, next_token, indent);
 }
 
+// Constant expressions are evaluated while parsing, and can be used anywhere an intliteral
+// can, e.g. "@PORT_BASE", "!(SERCOM0_IRQ + 1)" or "ctrl = 1 << ENABLE_BIT;".
+// They have the same operators as expressions, with the same precedence, but operators
+// can be chained and grouped with parentheses. The terms are intliterals, constants,
+// calls to constexpr functions and, in the body of a constexpr function, its arguments.
+// They are evaluated by functions that don't print the parse tree, since some are
+// looked at more than once (see "match_case_values").
+
+// The arguments of the constexpr function whose body is being evaluated
+typedef struct _ConstScope {
+    int const_func_index; // -1 outside of a constexpr function
+    int arg_values[MAX_CONST_FUNCTION_ARGS];
+    int depth;
+} ConstScope;
+
+int const_expression(Token *tokens, int next_token, SymbolTable *symbols, ConstScope *scope, int *dest);
+
+// like "match", but without printing the parse tree
+int const_match(TokenType token_type, Token *tokens, int next_token) {
+    if (tokens[next_token].type != token_type) {
+        PANIC(
+            "Expected %s but found %s\n",
+            token_type_to_static_string(token_type),
+            token_type_to_static_string(tokens[next_token].type)
+        );
+    }
+    return next_token + 1;
+}
+// evaluate a call to a constexpr function, e.g. "bit(4)"
+int const_call(Token *tokens, int next_token, SymbolTable *symbols, ConstScope *scope, int cf_index, int *dest) {
+    ConstFunction *cf = &symbols->const_functions[cf_index];
+    STRINGREF_TO_CSTR1(&cf->name, 512);
+    ConstScope call_scope;
+    call_scope.const_func_index = cf_index;
+    call_scope.depth = scope->depth + 1;
+    if (call_scope.depth > MAX_CONSTEXPR_DEPTH) {
+        PANIC("Too many nested calls to constexpr functions, in '%s'\n", cstr1);
+    }
+    next_token = const_match(t_id, tokens, next_token);
+    next_token = const_match(t_leftparen, tokens, next_token);
+    int num_args = 0;
+    while (tokens[next_token].type != t_rightparen) {
+        int value = 0;
+        next_token = const_expression(tokens, next_token, symbols, scope, &value);
+        if (num_args < MAX_CONST_FUNCTION_ARGS) {
+            call_scope.arg_values[num_args] = value;
+        }
+        num_args++;
+        if (tokens[next_token].type != t_rightparen) {
+            next_token = const_match(t_comma, tokens, next_token);
+        }
+    }
+    next_token = const_match(t_rightparen, tokens, next_token);
+    if (num_args != cf->func_args_len) {
+        PANIC("Incorrect number of arguments to function '%s'. Expected %d but got %d.\n", cstr1, cf->func_args_len, num_args);
+    }
+    const_expression(tokens, cf->body_token, symbols, &call_scope, dest);
+    return next_token;
+}
+// evaluate a term of a constant expression: an intliteral, a name, a constexpr function
+// call, "~term" or "(expression)"
+int const_term(Token *tokens, int next_token, SymbolTable *symbols, ConstScope *scope, int *dest) {
+    Token *t = &tokens[next_token];
+    if (t->type == t_intliteral) {
+        *dest = t->int_value;
+        return next_token + 1;
+    }
+    if (t->type == t_not) {
+        next_token = const_term(tokens, next_token + 1, symbols, scope, dest);
+        *dest = ~(*dest);
+        return next_token;
+    }
+    if (t->type == t_leftparen) {
+        next_token = const_expression(tokens, next_token + 1, symbols, scope, dest);
+        return const_match(t_rightparen, tokens, next_token);
+    }
+    if (t->type != t_id) {
+        PANIC("Expected a constant but found %s\n", token_type_to_static_string(t->type));
+    }
+    if (scope->const_func_index != -1) {
+        ConstFunction *cf = &symbols->const_functions[scope->const_func_index];
+        for (int i = 0; i < cf->func_args_len; i++) {
+            if (string_ref_eq(&t->lexeme, &symbols->func_args[cf->func_args_index + i].name)) {
+                *dest = scope->arg_values[i];
+                return next_token + 1;
+            }
+        }
+    }
+    int c_index = find_constant(symbols, &t->lexeme);
+    if (c_index != -1) {
+        *dest = symbols->constants[c_index].value;
+        return next_token + 1;
+    }
+    int cf_index = find_const_function(symbols, &t->lexeme);
+    if (cf_index != -1) {
+        return const_call(tokens, next_token, symbols, scope, cf_index, dest);
+    }
+    STRINGREF_TO_CSTR1(&t->lexeme, 512);
+    PANIC("'%s' is not a constant\n", cstr1);
+}
+// Returns the IROpCode of a binary operator at a level of precedence of constant
+// expressions, or -1 if it isn't one. Level 0 binds the loosest, like "expression_sum".
+int const_operator(TokenType token_type, int level) {
+    switch (token_type) {
+        case t_plus: return level == 0 ? ir_add : -1;
+        case t_minus: return level == 0 ? ir_subtract : -1;
+        case t_and: return level == 1 ? ir_bitwise_and : -1;
+        case t_or: return level == 1 ? ir_bitwise_or : -1;
+        case t_xor: return level == 1 ? ir_bitwise_xor : -1;
+        case t_shiftleft: return level == 2 ? ir_shift_left : -1;
+        case t_shiftright: return level == 2 ? ir_shift_right : -1;
+        case t_star: return level == 3 ? ir_multiply : -1;
+        case t_slash: return level == 3 ? ir_divide : -1;
+        case t_percent: return level == 3 ? ir_modulo : -1;
+        default: return -1;
+    }
+}
+// evaluate the operators of one level of precedence, left to right, e.g. "1 | 2 | 8"
+// the values are worked out the same way the machine code would (see "evaluate_op")
+int const_binary(Token *tokens, int next_token, SymbolTable *symbols, ConstScope *scope, int level, int *dest) {
+    if (level == CONST_OPERATOR_LEVELS) {
+        return const_term(tokens, next_token, symbols, scope, dest);
+    }
+    next_token = const_binary(tokens, next_token, symbols, scope, level + 1, dest);
+    int opcode = const_operator(tokens[next_token].type, level);
+    while (opcode != -1) {
+        int value = 0;
+        next_token = const_binary(tokens, next_token + 1, symbols, scope, level + 1, &value);
+        evaluate_op(opcode, *dest, value, dest);
+        opcode = const_operator(tokens[next_token].type, level);
+    }
+    return next_token;
+}
+int const_expression(Token *tokens, int next_token, SymbolTable *symbols, ConstScope *scope, int *dest) {
+    return const_binary(tokens, next_token, symbols, scope, 0, dest);
+}
+// print the tokens of a constant expression that has been evaluated
+void print_constant_tokens(Token *tokens, int begin, int end, int indent) {
+    for (int i = begin; i < end; i++) {
+        CREATE_TOKEN_STRING(tokens[i]);
+        PARSE_TREE_INDENT(indent); PARSE_TREE_PRINT("- %s\n", token_str);
+    }
+}
+// parse a constant expression where an intliteral is expected, putting its value into dest
+int match_constant(Token *tokens, int next_token, SymbolTable *symbols, int *dest, int indent) {
+    PARSE_TREE_INDENT(indent); indent++; PARSE_TREE_PRINT("- Constant:\n");
+    ConstScope scope = {0};
+    scope.const_func_index = -1;
+    int end = const_expression(tokens, next_token, symbols, &scope, dest);
+    print_constant_tokens(tokens, next_token, end, indent);
+    return end;
+}
+// parse a single term of a constant expression, e.g. a constant used in an expression,
+// putting its value into dest
+int match_constant_term(Token *tokens, int next_token, SymbolTable *symbols, int *dest, int indent) {
+    PARSE_TREE_INDENT(indent); indent++; PARSE_TREE_PRINT("- Constant:\n");
+    ConstScope scope = {0};
+    scope.const_func_index = -1;
+    int end = const_term(tokens, next_token, symbols, &scope, dest);
+    print_constant_tokens(tokens, next_token, end, indent);
+    return end;
+}
+
+// The local variables of a task are statics named "<task>.<variable>", which can't clash
+// with any other static since ids can't have a '.' in them. The names are kept here.
+static char task_var_names[8192];
+static int task_var_names_len = 0;
+
+// Returns the static that holds a task's local variable, or -1 if func_index isn't a task
+// or it has no variable with that name
+int find_task_variable(SymbolTable *symbols, int func_index, StringRef *name) {
+    if (find_task(symbols, func_index) == -1) {
+        return -1;
+    }
+    StringRef *task_name = &symbols->functions[func_index].name;
+    char full_name[512];
+    int len = snprintf(full_name, 512, "%.*s.%.*s", task_name->len, task_name->str, name->len, name->str);
+    StringRef full_name_ref = {full_name, len};
+    return find_static_variable(symbols, &full_name_ref);
+}
+
 enum name_result {
     name_mmp_struct_item,
+    name_mmp_bitfield_item,
     name_func_arg,
     name_local_var,
     name_static_var
@@ -78,12 +263,14 @@ struct NameResolutionResult {
     enum name_result result;
     int mmp_index;
     int si_index;
+    int bfi_index;
     int func_arg_index;
     int local_var_index;
     int func_index;
     int static_var_index;
 };
-// parse a "Name" which can be "id" if its a variable, or "id.id" if its a field on a peripheral
+// parse a "Name" which can be "id" if its a variable, "id.id" if its a field on a peripheral,
+// or "id.id.id" if its a sub-field of a BitField on a peripheral
 // Check that the variable/peripheral reference is valid and detect which it is
 int name(Token *tokens, int next_token, SymbolTable *symbols, int func_index, struct NameResolutionResult *result, int indent) {
     PARSE_TREE_INDENT(indent); indent++; PARSE_TREE_PRINT("- Name:\n");
@@ -106,6 +293,22 @@ int name(Token *tokens, int next_token, SymbolTable *symbols, int func_index, st
             PANIC("Field '%s' does not exist in '%s'\n", cstr1, cstr2);
         }
         result->result = name_mmp_struct_item;
+        if (tokens[next_token].type == t_dot) {
+            StringRef third_name;
+            next_token = match(t_dot, tokens, next_token, indent);
+            next_token = match_id(tokens, next_token, &third_name, indent);
+            if (symbols->struct_items[result->si_index].type != si_bf) {
+                STRINGREF_TO_CSTR1(&second_name, 512);
+                PANIC("Field '%s' is not a BitField\n", cstr1);
+            }
+            result->bfi_index = find_bitfield_item_index(symbols, result->si_index, &third_name);
+            if (result->bfi_index == -1) {
+                STRINGREF_TO_CSTR1(&third_name, 512);
+                STRINGREF_TO_CSTR2(&second_name, 512);
+                PANIC("BitField field '%s' does not exist in struct item '%s'\n", cstr1, cstr2);
+            }
+            result->result = name_mmp_bitfield_item;
+        }
         return next_token;
     } else {
         // must be a variable, local or static
@@ -121,7 +324,10 @@ int name(Token *tokens, int next_token, SymbolTable *symbols, int func_index, st
             result->func_index = func_index;
             return next_token;
         } 
-        result->static_var_index = find_static_variable(symbols, &first_name);
+        result->static_var_index = find_task_variable(symbols, func_index, &first_name);
+        if (result->static_var_index == -1) {
+            result->static_var_index = find_static_variable(symbols, &first_name);
+        }
         if (result->static_var_index == -1) {
             STRINGREF_TO_CSTR1(&first_name, 512);
             PANIC("No variable, arg or local or static, named '%s'\n", cstr1);
@@ -131,11 +337,73 @@ int name(Token *tokens, int next_token, SymbolTable *symbols, int func_index, st
     }
 }
 
+// Returns true if an id in an expression is a constant or a call to a constexpr function
+// rather than a variable. Arguments and local variables hide constants with the same name.
+bool id_is_constant(SymbolTable *symbols, int func_index, StringRef *name) {
+    if (find_constant(symbols, name) == -1 && find_const_function(symbols, name) == -1) {
+        return false;
+    }
+    return find_function_arg(symbols, func_index, name) == -1
+        && find_function_variable(symbols, func_index, name) == -1
+        && find_task_variable(symbols, func_index, name) == -1;
+}
+
 int expression(Token *tokens, int next_token, SymbolTable *symbols, int func_index, int *final_temp, int indent);
+int expression_sum(Token *tokens, int next_token, SymbolTable *symbols, int func_index, int *temp, int indent);
 
+// Returns the IntrinsicId of a built-in function name, e.g. "__wfi", or -1
+int find_intrinsic(StringRef *name) {
+    for (int i = 0; i < INTRINSICS_NUM; i++) {
+        if (name->len == (int)strlen(intrinsics[i].name) && strncmp(name->str, intrinsics[i].name, name->len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+// parse a call to an intrinsic e.g. "__rev(x)", which is a single instruction instead of a call
+// its value (if it has one) is put in temp 0, like the return value of a function
+int intrinsic_call(Token *tokens, int next_token, SymbolTable *symbols, int func_index, int intrinsic, int indent) {
+    PARSE_TREE_INDENT(indent); indent++; PARSE_TREE_PRINT("- IntrinsicCall:\n");
+    StringRef func_name;
+    next_token = match_id(tokens, next_token, &func_name, indent);
+    next_token = match(t_leftparen, tokens, next_token, indent);
+    IROp op = {0};
+    op.opcode = ir_intrinsic;
+    op.arg2.type = irv_immediate;
+    op.arg2.immediate_value = intrinsic;
+    int num_args = 0;
+    while (tokens[next_token].type != t_rightparen) {
+        int temp = 0;
+        next_token = expression(tokens, next_token, symbols, func_index, &temp, indent);
+        op.arg1.type = irv_temp;
+        op.arg1.temp_num = temp;
+        num_args++;
+        if (tokens[next_token].type != t_rightparen) {
+            next_token = match(t_comma, tokens, next_token, indent);
+        }
+    }
+    if (num_args != intrinsics[intrinsic].args_num) {
+        PANIC("Incorrect number of arguments to intrinsic '%s'. Expected %d but got %d.\n", intrinsics[intrinsic].name, intrinsics[intrinsic].args_num, num_args);
+    }
+    next_token = match(t_rightparen, tokens, next_token, indent);
+    if (intrinsics[intrinsic].has_result) {
+        op.result.type = irv_temp;
+        op.result.temp_num = 0;
+    }
+    add_function_ir(symbols, func_index, op);
+    return next_token;
+}
+// How many atomic blocks the statement being parsed is inside, and how many of those
+// don't allow function calls
+static int atomic_depth = 0;
+static int atomic_no_calls_depth = 0;
 // parse a function call e.g. "function_name(arg1, arg2)"
 // checks that the function exists and that the correct number of arguments are passed
 int function_call(Token *tokens, int next_token, SymbolTable *symbols, int func_index, int indent) {
+    int intrinsic = find_intrinsic(&tokens[next_token].lexeme);
+    if (intrinsic != -1) {
+        return intrinsic_call(tokens, next_token, symbols, func_index, intrinsic, indent);
+    }
     PARSE_TREE_INDENT(indent); indent++; PARSE_TREE_PRINT("- FunctionCall:\n");
     StringRef func_name;
     next_token = match_id(tokens, next_token, &func_name, indent);
@@ -144,6 +412,14 @@ int function_call(Token *tokens, int next_token, SymbolTable *symbols, int func_
         STRINGREF_TO_CSTR1(&func_name, 512);
         PANIC("Function '%s' does not exist\n", cstr1);
     }
+    if (find_task(symbols, called_func_index) != -1) {
+        STRINGREF_TO_CSTR1(&func_name, 512);
+        PANIC("Task '%s' can't be called, the main loop runs it\n", cstr1);
+    }
+    if (atomic_no_calls_depth > 0) {
+        STRINGREF_TO_CSTR1(&func_name, 512);
+        PANIC("Function '%s' can't be called inside an atomic block unless it is \"atomic allow_calls\"\n", cstr1);
+    }
     int num_args = 0;
     next_token = match(t_leftparen, tokens, next_token, indent);
     while (tokens[next_token].type != t_rightparen) {
@@ -174,9 +450,195 @@ int function_call(Token *tokens, int next_token, SymbolTable *symbols, int func_
     add_function_ir(symbols, func_index, op);
     return next_token;
 }
-// terminal in an expression, either an int literal or a "name"
+// Returns the bits a BitField item takes up in its register
+uint32_t bitfield_item_mask(BitFieldItem *bfi) {
+    uint32_t mask = bfi->width >= 32 ? 0xFFFFFFFF : (((uint32_t)1 << bfi->width) - 1);
+    return mask << bfi->offset;
+}
+// add the IR to read a BitField item from its register into a temp
+// e.g. "PortA.wrconfig.pmux" loads wrconfig, then shifts and masks the field down to bit 0
+void bitfield_item_read(SymbolTable *symbols, int func_index, int temp, struct NameResolutionResult *name_result) {
+    StructItem *si = &symbols->struct_items[name_result->si_index];
+    BitFieldItem *bfi = &symbols->bitfield_items[name_result->bfi_index];
+    IROp op = {0};
+    op.result.type = irv_temp;
+    op.result.temp_num = temp;
+    op.arg1.type = irv_mmp_struct_item;
+    op.arg1.mmp_index = name_result->mmp_index;
+    op.arg1.mmp_struct_item_index = name_result->si_index;
+    op.opcode = ir_copy;
+    add_function_ir(symbols, func_index, op);
+
+    op.arg1.type = irv_temp;
+    op.arg1.temp_num = temp;
+    op.arg2.type = irv_immediate;
+    if (bfi->offset > 0) {
+        op.opcode = ir_shift_right;
+        op.arg2.immediate_value = bfi->offset;
+        add_function_ir(symbols, func_index, op);
+    }
+    if (bfi->offset + bfi->width < si->bf.width) {
+        op.opcode = ir_bitwise_and;
+        op.arg2.immediate_value = bitfield_item_mask(bfi) >> bfi->offset;
+        add_function_ir(symbols, func_index, op);
+    }
+}
+// add the IR to write a value (a temp, or an immediate if value_is_immediate) into a
+// BitField item without changing the rest of its register.
+// e.g. "PortA.wrconfig.pmux = x" loads wrconfig, clears pmux, ORs in x shifted into place
+// and stores wrconfig. The masks are worked out here, so only the value is shifted at runtime.
+// value_temp is changed, and the temp after it is used for the register.
+void bitfield_item_write(SymbolTable *symbols, int func_index, int value_temp, bool value_is_immediate, int value, struct NameResolutionResult *name_result) {
+    StructItem *si = &symbols->struct_items[name_result->si_index];
+    BitFieldItem *bfi = &symbols->bitfield_items[name_result->bfi_index];
+    uint32_t mask = bitfield_item_mask(bfi);
+    IROp op = {0};
+
+    IRValue field_value = {0};
+    if (value_is_immediate) {
+        field_value.type = irv_immediate;
+        field_value.immediate_value = ((uint32_t)value << bfi->offset) & mask;
+    } else {
+        field_value.type = irv_temp;
+        field_value.temp_num = value_temp;
+        op.result = field_value;
+        op.arg1 = field_value;
+        op.arg2.type = irv_immediate;
+        if (bfi->offset > 0) {
+            op.opcode = ir_shift_left;
+            op.arg2.immediate_value = bfi->offset;
+            add_function_ir(symbols, func_index, op);
+        }
+        // bits above the register are dropped by the store anyway
+        if (bfi->offset + bfi->width < si->bf.width) {
+            op.opcode = ir_bitwise_and;
+            op.arg2.immediate_value = mask;
+            add_function_ir(symbols, func_index, op);
+        }
+    }
+
+    IRValue reg = {0};
+    reg.type = irv_mmp_struct_item;
+    reg.mmp_index = name_result->mmp_index;
+    reg.mmp_struct_item_index = name_result->si_index;
+    if (bfi->offset == 0 && bfi->width == si->bf.width) {
+        // the field is the whole register
+        op.opcode = ir_copy;
+        op.result = reg;
+        op.arg1 = field_value;
+        memset(&op.arg2, 0, sizeof(IRValue));
+        add_function_ir(symbols, func_index, op);
+        return;
+    }
+
+    IRValue reg_temp = {0};
+    reg_temp.type = irv_temp;
+    reg_temp.temp_num = value_is_immediate ? 0 : value_temp + 1;
+    op.opcode = ir_copy;
+    op.result = reg_temp;
+    op.arg1 = reg;
+    memset(&op.arg2, 0, sizeof(IRValue));
+    add_function_ir(symbols, func_index, op);
+
+    op.opcode = ir_bitwise_and;
+    op.arg1 = reg_temp;
+    op.arg2.type = irv_immediate;
+    op.arg2.immediate_value = ~mask;
+    add_function_ir(symbols, func_index, op);
+
+    op.opcode = ir_bitwise_or;
+    op.arg2 = field_value;
+    add_function_ir(symbols, func_index, op);
+
+    op.opcode = ir_copy;
+    op.result = reg;
+    op.arg1 = reg_temp;
+    memset(&op.arg2, 0, sizeof(IRValue));
+    add_function_ir(symbols, func_index, op);
+}
+// Returns the Variable a name refers to, or NULL if it isn't a local or static variable
+Variable *name_variable(SymbolTable *symbols, struct NameResolutionResult *name_result) {
+    if (name_result->result == name_local_var) {
+        return &symbols->function_vars[name_result->local_var_index];
+    } else if (name_result->result == name_static_var) {
+        return &symbols->static_vars[name_result->static_var_index];
+    }
+    return NULL;
+}
+// parse the index after the name of an array variable, e.g. "[i + 1]"
+// every use of an array must be indexed, and only arrays can be indexed
+// the index is computed into temps starting at *temp, then turned into a byte offset
+// so that value refers to that element. The offset stays in temp (*temp) - 1.
+int array_element(Token *tokens, int next_token, SymbolTable *symbols, int func_index, Variable *var, IRValue *value, int *temp, int indent) {
+    if (var->array_len == 0) {
+        if (tokens[next_token].type == t_leftbracket) {
+            STRINGREF_TO_CSTR1(&var->name, 512);
+            PANIC("Variable '%s' is not an array\n", cstr1);
+        }
+        return next_token;
+    }
+    if (tokens[next_token].type != t_leftbracket) {
+        STRINGREF_TO_CSTR1(&var->name, 512);
+        PANIC("Array '%s' can only be used one element at a time, e.g. '%s[0]'\n", cstr1, cstr1);
+    }
+    PARSE_TREE_INDENT(indent); indent++; PARSE_TREE_PRINT("- ArrayIndex:\n");
+    next_token = match(t_leftbracket, tokens, next_token, indent);
+    next_token = expression_sum(tokens, next_token, symbols, func_index, temp, indent);
+    next_token = match(t_rightbracket, tokens, next_token, indent);
+
+    // the backend adds the offset to the address of the array with a register-offset
+    // load or store, so scaling the index is the only extra work
+    int size = int_type_size(var->int_type);
+    if (size > 1) {
+        IROp op = {0};
+        op.opcode = ir_shift_left;
+        op.result.type = irv_temp;
+        op.result.temp_num = (*temp) - 1;
+        op.arg1 = op.result;
+        op.arg2.type = irv_immediate;
+        op.arg2.immediate_value = size == 4 ? 2 : 1;
+        add_function_ir(symbols, func_index, op);
+    }
+    value->offset_in_temp = true;
+    value->offset_temp_num = (*temp) - 1;
+    return next_token;
+}
+// Returns the token after the "]" that closes the "[" at next_token,
+// or next_token if there is no "[" there
+int skip_array_index(Token *tokens, int next_token) {
+    if (tokens[next_token].type != t_leftbracket) {
+        return next_token;
+    }
+    int depth = 0;
+    do {
+        if (tokens[next_token].type == t_leftbracket) {
+            depth++;
+        } else if (tokens[next_token].type == t_rightbracket) {
+            depth--;
+        } else if (tokens[next_token].type == t_semicolon) {
+            PANIC("Expected rightbracket but found semicolon\n");
+        }
+        next_token++;
+    } while (depth > 0);
+    return next_token;
+}
+// terminal in an expression, either an int literal or a "name", optionally inverted with "~"
 int expression_term(Token *tokens, int next_token, SymbolTable *symbols, int func_index, int *temp, int indent) {
     PARSE_TREE_INDENT(indent); indent++; PARSE_TREE_PRINT("- ExpressionTerm:\n");
+    if (tokens[next_token].type == t_not) {
+        next_token = match(t_not, tokens, next_token, indent);
+        next_token = expression_term(tokens, next_token, symbols, func_index, temp, indent);
+        // ~x is emitted as x ^ 0xFFFFFFFF, which the backend turns into MVNS
+        IROp op = {0};
+        op.opcode = ir_bitwise_xor;
+        op.result.type = irv_temp;
+        op.result.temp_num = (*temp) - 1;
+        op.arg1 = op.result;
+        op.arg2.type = irv_immediate;
+        op.arg2.immediate_value = -1;
+        add_function_ir(symbols, func_index, op);
+        return next_token;
+    }
     IROp op = {0};
     op.result.type = irv_temp;
     op.result.temp_num = *temp;
@@ -185,10 +647,17 @@ int expression_term(Token *tokens, int next_token, SymbolTable *symbols, int fun
     if (tokens[next_token].type == t_intliteral) {
         op.arg1.type = irv_immediate;
         next_token = match_intliteral(tokens, next_token, &op.arg1.immediate_value, indent);
+    } else if (tokens[next_token].type == t_id && id_is_constant(symbols, func_index, &tokens[next_token].lexeme)) {
+        // constants are replaced by their values, so they are never loaded
+        op.arg1.type = irv_immediate;
+        next_token = match_constant_term(tokens, next_token, symbols, &op.arg1.immediate_value, indent);
     } else {
         struct NameResolutionResult name_result;
         next_token = name(tokens, next_token, symbols, func_index, &name_result, indent);
-        if (name_result.result == name_mmp_struct_item) {
+        if (name_result.result == name_mmp_bitfield_item) {
+            bitfield_item_read(symbols, func_index, op.result.temp_num, &name_result);
+            return next_token;
+        } else if (name_result.result == name_mmp_struct_item) {
             op.arg1.type = irv_mmp_struct_item;
             op.arg1.mmp_index = name_result.mmp_index;
             op.arg1.mmp_struct_item_index = name_result.si_index;
@@ -204,14 +673,53 @@ int expression_term(Token *tokens, int next_token, SymbolTable *symbols, int fun
             op.arg1.type = irv_static_variable;
             op.arg1.static_variable_index = name_result.static_var_index;
         }
+        Variable *var = name_variable(symbols, &name_result);
+        if (var != NULL) {
+            // the index of an array element is computed in the temp the element is loaded into
+            int index_temp = op.result.temp_num;
+            next_token = array_element(tokens, next_token, symbols, func_index, var, &op.arg1, &index_temp, indent);
+        }
     }
     add_function_ir(symbols, func_index, op);
     return next_token;
 }
+// parse a multiplication, division or modulo expression e.g. "3 * 30"
+int expression_product(Token *tokens, int next_token, SymbolTable *symbols, int func_index, int *temp, int indent) {
+    PARSE_TREE_INDENT(indent); indent++; PARSE_TREE_PRINT("- ProductExpression:\n");
+    next_token = expression_term(tokens, next_token, symbols, func_index, temp, indent);
+    IROp op = {0};
+    op.arg1.type = irv_temp;
+    op.arg1.temp_num = (*temp) - 1;
+    switch (tokens[next_token].type) {
+        case t_star:
+            next_token = match(t_star, tokens, next_token, indent);
+            op.opcode = ir_multiply;
+            break;
+        case t_slash:
+            next_token = match(t_slash, tokens, next_token, indent);
+            op.opcode = ir_divide;
+            break;
+        case t_percent:
+            next_token = match(t_percent, tokens, next_token, indent);
+            op.opcode = ir_modulo;
+            break;
+        default:
+            return next_token;
+    }
+    next_token = expression_term(tokens, next_token, symbols, func_index, temp, indent);
+    op.arg2.type = irv_temp;
+    op.arg2.temp_num = (*temp) - 1;
+
+    op.result.type = irv_temp;
+    op.result.temp_num = *temp;
+    *temp = (*temp) + 1;
+    add_function_ir(symbols, func_index, op);
+    return next_token;
+}
 // parse a shift expression e.g. "1 << 30"
 int expression_shift(Token *tokens, int next_token, SymbolTable *symbols, int func_index, int *temp, int indent) {
     PARSE_TREE_INDENT(indent); indent++; PARSE_TREE_PRINT("- ShiftExpression:\n");
-    next_token = expression_term(tokens, next_token, symbols, func_index, temp, indent);
+    next_token = expression_product(tokens, next_token, symbols, func_index, temp, indent);
     IROp op = {0};
     op.arg1.type = irv_temp;
     op.arg1.temp_num = (*temp) - 1;
@@ -227,7 +735,7 @@ int expression_shift(Token *tokens, int next_token, SymbolTable *symbols, int fu
         default:
             return next_token;
     }
-    next_token = expression_term(tokens, next_token, symbols, func_index, temp, indent);
+    next_token = expression_product(tokens, next_token, symbols, func_index, temp, indent);
     op.arg2.type = irv_temp;
     op.arg2.temp_num = (*temp) - 1;
 
@@ -237,7 +745,7 @@ int expression_shift(Token *tokens, int next_token, SymbolTable *symbols, int fu
     add_function_ir(symbols, func_index, op);
     return next_token;
 }
-// parse a bitwise operation expression e.g. "1 & 30"
+// parse a bitwise operation expression e.g. "1 & 30", "1 | 30" or "1 ^ 30"
 int expression_bit(Token *tokens, int next_token, SymbolTable *symbols, int func_index, int *temp, int indent) {
     PARSE_TREE_INDENT(indent); indent++; PARSE_TREE_PRINT("- BitExpression:\n");
     next_token = expression_shift(tokens, next_token, symbols, func_index, temp, indent);
@@ -249,6 +757,14 @@ int expression_bit(Token *tokens, int next_token, SymbolTable *symbols, int func
             next_token = match(t_and, tokens, next_token, indent);
             op.opcode = ir_bitwise_and;
             break;
+        case t_or:
+            next_token = match(t_or, tokens, next_token, indent);
+            op.opcode = ir_bitwise_or;
+            break;
+        case t_xor:
+            next_token = match(t_xor, tokens, next_token, indent);
+            op.opcode = ir_bitwise_xor;
+            break;
         default:
             return next_token;
     }
@@ -353,7 +869,7 @@ int bitfield_value(Token *tokens, int next_token, SymbolTable *symbols, int si_i
         int field_value = 0;
         next_token = match(t_equals, tokens, next_token, indent);
         if (symbols->bitfield_items[bfi_index].type == bfi_int) {
-            next_token = match_intliteral(tokens, next_token, &field_value, indent);
+            next_token = match_constant(tokens, next_token, symbols, &field_value, indent);
         } else {
             // TODO
             StringRef be_item_name;
@@ -381,11 +897,11 @@ int bitfield_value(Token *tokens, int next_token, SymbolTable *symbols, int si_i
 
 // parse an item definition of a BitEnum e.g. "clock4 = 0x4;"
 // put name and value of enum item into *bei
-int mmp_def_structure_item_bf_item_enum_item(Token *tokens, int next_token, BitEnumItem *bei, int indent) {
+int mmp_def_structure_item_bf_item_enum_item(Token *tokens, int next_token, SymbolTable *symbols, BitEnumItem *bei, int indent) {
     PARSE_TREE_INDENT(indent); indent++; PARSE_TREE_PRINT("- BitEnumItem:\n");
     next_token = match_id(tokens, next_token, &bei->name, indent);
     next_token = match(t_equals, tokens, next_token, indent);
-    next_token = match_intliteral(tokens, next_token, &bei->value, indent);
+    next_token = match_constant(tokens, next_token, symbols, &bei->value, indent);
     next_token = match(t_semicolon, tokens, next_token, indent);
     return next_token;
 }
@@ -401,7 +917,7 @@ int mmp_def_structure_item_bf_item_enum(Token *tokens, int next_token, SymbolTab
     while (tokens[next_token].type == t_id || tokens[next_token].type == t_unused) {
         BitEnumItem bei;
         // any number of be items
-        next_token = mmp_def_structure_item_bf_item_enum_item(tokens, next_token, &bei, indent);
+        next_token = mmp_def_structure_item_bf_item_enum_item(tokens, next_token, symbols, &bei, indent);
 
         bei_index = add_bitenum_item(symbols, bei);
         if (be->be_items_index == -1) {
@@ -450,7 +966,7 @@ int mmp_def_structure_item_bf(Token *tokens, int next_token, SymbolTable *symbol
     int bfi_index = 0;
     int offset = 0;
     while (tokens[next_token].type == t_id || tokens[next_token].type == t_unused) {
-        BitFieldItem bfi;
+        BitFieldItem bfi = {0};
         // any number of bf items
         next_token = mmp_def_structure_item_bf_item(tokens, next_token, symbols, &bfi, indent);
 
@@ -467,6 +983,24 @@ int mmp_def_structure_item_bf(Token *tokens, int next_token, SymbolTable *symbol
     next_token = match(t_rightbrace, tokens, next_token, indent);
     return next_token;
 }
+// parse the optional sync status of a StructItem, e.g. "sync status.syncbusy"
+// the names are looked up once the whole structure is parsed, see mmp_def_structure
+int mmp_def_structure_item_opt_sync(Token *tokens, int next_token, StructItem *si, int indent) {
+    si->sync_si_index = -1;
+    si->sync_bfi_index = -1;
+    StringRef *keyword = &tokens[next_token].lexeme;
+    if (tokens[next_token].type != t_id || keyword->len != 4 || strncmp(keyword->str, "sync", 4) != 0) {
+        return next_token;
+    }
+    PARSE_TREE_INDENT(indent); indent++; PARSE_TREE_PRINT("- Sync:\n");
+    next_token = match(t_id, tokens, next_token, indent);
+    next_token = match_id(tokens, next_token, &si->sync_reg_name, indent);
+    next_token = match(t_dot, tokens, next_token, indent);
+    next_token = match_id(tokens, next_token, &si->sync_field_name, indent);
+    // resolved later
+    si->sync_si_index = -2;
+    return next_token;
+}
 // parse a StructItem of a MemoryMappedPeripheral e.g. "field: u32;"
 // put name and type into *si
 int mmp_def_structure_item(Token *tokens, int next_token, SymbolTable *symbols, StructItem *si, int indent) {
@@ -487,6 +1021,7 @@ int mmp_def_structure_item(Token *tokens, int next_token, SymbolTable *symbols,
         next_token = mmp_def_structure_item_bf(tokens, next_token, symbols, si, indent);
         si->type = si_bf;
     }
+    next_token = mmp_def_structure_item_opt_sync(tokens, next_token, si, indent);
     next_token = match(t_semicolon, tokens, next_token, indent);
     return next_token;
 }
@@ -499,7 +1034,7 @@ int mmp_def_structure(Token *tokens, int next_token, SymbolTable *symbols, Memor
     int si_index = 0;
     int address = mmp->base_address;
     while (tokens[next_token].type == t_id || tokens[next_token].type == t_unused) {
-        StructItem si;
+        StructItem si = {0};
         next_token = mmp_def_structure_item(tokens, next_token, symbols, &si, indent);
         si.address = address;
         if (si.type == si_int || si.type == si_unused) {
@@ -521,11 +1056,37 @@ int mmp_def_structure(Token *tokens, int next_token, SymbolTable *symbols, Memor
     }
     mmp->struct_items_len = (si_index + 1) - mmp->struct_items_index;
     next_token = match(t_rightbrace, tokens, next_token, indent);
+
+    // the sync status of a register can be declared after it
+    int end = mmp->struct_items_index == -1 ? -1 : mmp->struct_items_index + mmp->struct_items_len;
+    for (int i = mmp->struct_items_index; i < end; i++) {
+        StructItem *si = &symbols->struct_items[i];
+        if (si->sync_si_index != -2) {
+            continue;
+        }
+        si->sync_si_index = -1;
+        for (int j = mmp->struct_items_index; j < end; j++) {
+            if (string_ref_eq(&si->sync_reg_name, &symbols->struct_items[j].name)) {
+                si->sync_si_index = j;
+            }
+        }
+        if (si->sync_si_index == -1 || symbols->struct_items[si->sync_si_index].type != si_bf) {
+            STRINGREF_TO_CSTR1(&si->sync_reg_name, 512);
+            STRINGREF_TO_CSTR2(&mmp->name, 512);
+            PANIC("Sync status '%s' is not a BitField of '%s'\n", cstr1, cstr2);
+        }
+        si->sync_bfi_index = find_bitfield_item_index(symbols, si->sync_si_index, &si->sync_field_name);
+        if (si->sync_bfi_index == -1) {
+            STRINGREF_TO_CSTR1(&si->sync_field_name, 512);
+            STRINGREF_TO_CSTR2(&si->sync_reg_name, 512);
+            PANIC("Field '%s' does not exist in '%s'\n", cstr1, cstr2);
+        }
+    }
     return next_token;
 }
 // parse optional interrupt number for a peripheral, e.g. "!42"
 // put interrupt num, if present, in dest
-int mmp_def_opt_interrupt_num(Token *tokens, int next_token, int *dest, int indent) {
+int mmp_def_opt_interrupt_num(Token *tokens, int next_token, SymbolTable *symbols, int *dest, int indent) {
     if (tokens[next_token].type != t_bang) {
         PARSE_TREE_INDENT(indent); indent++; PARSE_TREE_PRINT("- NoInterruptNum:\n");
         *dest = -1;
@@ -533,15 +1094,15 @@ int mmp_def_opt_interrupt_num(Token *tokens, int next_token, int *dest, int inde
     }
     PARSE_TREE_INDENT(indent); indent++; PARSE_TREE_PRINT("- InterruptNum:\n");
     next_token = match(t_bang, tokens, next_token, indent);
-    next_token = match_intliteral(tokens, next_token, dest, indent);
+    next_token = match_constant(tokens, next_token, symbols, dest, indent);
     return next_token;
 }
 // parse base address for a peripheral, e.g. "@0x40000000"
 // put base address in dest
-int mmp_def_base_address(Token *tokens, int next_token, int *dest, int indent) {
+int mmp_def_base_address(Token *tokens, int next_token, SymbolTable *symbols, int *dest, int indent) {
     PARSE_TREE_INDENT(indent); indent++; PARSE_TREE_PRINT("- BaseAddress:\n");
     next_token = match(t_at, tokens, next_token, indent);
-    next_token = match_intliteral(tokens, next_token, dest, indent);
+    next_token = match_constant(tokens, next_token, symbols, dest, indent);
     return next_token;
 }
 // parse MemoryMappedPeripheral, e.g. "MemoryMappedPeripheral PeripheralName @0x40000000 !42 {}"
@@ -551,8 +1112,8 @@ int mmp_def(Token *tokens, int next_token, SymbolTable *symbols, int indent) {
 
     next_token = match(t_mmp, tokens, next_token, indent);
     next_token = match_id(tokens, next_token, &mmp.name, indent);
-    next_token = mmp_def_base_address(tokens, next_token, &mmp.base_address, indent);
-    next_token = mmp_def_opt_interrupt_num(tokens, next_token, &mmp.interrupt_number, indent);
+    next_token = mmp_def_base_address(tokens, next_token, symbols, &mmp.base_address, indent);
+    next_token = mmp_def_opt_interrupt_num(tokens, next_token, symbols, &mmp.interrupt_number, indent);
     next_token = mmp_def_structure(tokens, next_token, symbols, &mmp, indent);
 
     add_mmp(symbols, mmp);
@@ -578,7 +1139,7 @@ int initialize_statement(Token *tokens, int next_token, SymbolTable *symbols, in
     if (symbols->struct_items[si_index].type == si_bf) {
         next_token = bitfield_value(tokens, next_token, symbols, si_index, &value, indent);
     } else {
-        next_token = match_intliteral(tokens, next_token, &value, indent);
+        next_token = match_constant(tokens, next_token, symbols, &value, indent);
     }
 
     IROp op = {0};
@@ -622,6 +1183,12 @@ int function_statement(Token *tokens, int next_token, SymbolTable *symbols, int
 int function_statement_return(Token *tokens, int next_token, SymbolTable *symbols, int func_index, int indent) {
     PARSE_TREE_INDENT(indent); indent++; PARSE_TREE_PRINT("- Return:\n");
     next_token = match(t_return, tokens, next_token, indent);
+    if (atomic_depth > 0) {
+        PANIC("Can't return from inside an atomic block\n");
+    }
+    if (find_task(symbols, func_index) != -1) {
+        PANIC("Can't return from a task\n");
+    }
     int temp = 0;
     next_token = expression(tokens, next_token, symbols, func_index, &temp, indent);
     next_token = match(t_semicolon, tokens, next_token, indent);
@@ -657,8 +1224,42 @@ int function_statement_assignment(Token *tokens, int next_token, SymbolTable *sy
         op.result.type = irv_static_variable;
         op.result.static_variable_index = name_result.static_var_index;
     }
+    // the index of an array element is parsed after the value, so that it can't be
+    // clobbered by a function call and its temps start after the value's
+    Variable *var = name_variable(symbols, &name_result);
+    int index_token = next_token;
+    if (var != NULL) {
+        if (var->is_const) {
+            STRINGREF_TO_CSTR1(&var->name, 512);
+            PANIC("Cannot assign to const '%s'\n", cstr1);
+        }
+        next_token = skip_array_index(tokens, next_token);
+    }
 
     next_token = match(t_equals, tokens, next_token, indent);
+    if (name_result.result == name_mmp_bitfield_item) {
+        // a sub-field of a BitField is set with a read-modify-write of the whole register
+        int bei_index = -1;
+        if (symbols->bitfield_items[name_result.bfi_index].type == bfi_enum && tokens[next_token].type == t_id) {
+            bei_index = find_bitenum_item_index(symbols, name_result.bfi_index, &tokens[next_token].lexeme);
+        }
+        if (bei_index != -1) {
+            StringRef be_item_name;
+            next_token = match_id(tokens, next_token, &be_item_name, indent);
+            bitfield_item_write(symbols, func_index, 0, true, symbols->bitenum_items[bei_index].value, &name_result);
+        } else if ((tokens[next_token].type == t_intliteral || find_constant(symbols, &tokens[next_token].lexeme) != -1)
+                && tokens[next_token + 1].type == t_semicolon) {
+            int value = 0;
+            next_token = match_constant_term(tokens, next_token, symbols, &value, indent);
+            bitfield_item_write(symbols, func_index, 0, true, value, &name_result);
+        } else {
+            int temp = 0;
+            next_token = expression(tokens, next_token, symbols, func_index, &temp, indent);
+            bitfield_item_write(symbols, func_index, temp, false, 0, &name_result);
+        }
+        next_token = match(t_semicolon, tokens, next_token, indent);
+        return next_token;
+    }
     if (name_result.result == name_mmp_struct_item) {
         if (symbols->struct_items[name_result.si_index].type == si_bf && tokens[next_token].type == t_leftbrace) {
             int value = 0;
@@ -673,7 +1274,12 @@ int function_statement_assignment(Token *tokens, int next_token, SymbolTable *sy
         }
     } else {
         // local or static variable
-        if (tokens[next_token].type == t_id && tokens[next_token + 1].type == t_leftparen) {
+        if (tokens[next_token].type == t_id && tokens[next_token + 1].type == t_leftparen
+                && find_const_function(symbols, &tokens[next_token].lexeme) == -1) {
+            int intrinsic = find_intrinsic(&tokens[next_token].lexeme);
+            if (intrinsic != -1 && !intrinsics[intrinsic].has_result) {
+                PANIC("Intrinsic '%s' does not have a value\n", intrinsics[intrinsic].name);
+            }
             next_token = function_call(tokens, next_token, symbols, func_index, indent);
             op.arg1.type = irv_temp;
             op.arg1.temp_num = 0;
@@ -683,6 +1289,10 @@ int function_statement_assignment(Token *tokens, int next_token, SymbolTable *sy
             op.arg1.type = irv_temp;
             op.arg1.temp_num = temp;
         }
+        if (var != NULL) {
+            int index_temp = op.arg1.temp_num + 1;
+            array_element(tokens, index_token, symbols, func_index, var, &op.result, &index_temp, indent);
+        }
     }
     add_function_ir(symbols, func_index, op);
     next_token = match(t_semicolon, tokens, next_token, indent);
@@ -752,60 +1362,747 @@ int function_statement_if(Token *tokens, int next_token, SymbolTable *symbols, i
 
     return next_token;
 }
-// parse local variable declaration, e.g. "u32 var = 4;"
-// initial value is required
-// puts the variable into the symbol table
-int function_statement_local_var(Token *tokens, int next_token, SymbolTable *symbols, int func_index, int indent) {
-    PARSE_TREE_INDENT(indent); indent++; PARSE_TREE_PRINT("- LocalVariable:\n");
-    Variable var;
-
-    next_token = match_inttype(tokens, next_token, &var.int_type, indent);
-    next_token = match_id(tokens, next_token, &var.name, indent);
-    next_token = match(t_equals, tokens, next_token, indent);
-    next_token = match_intliteral(tokens, next_token, &var.initial_value, indent);
-    next_token = match(t_semicolon, tokens, next_token, indent);
-
-    int var_index = add_function_variable(symbols, var);
-    if (symbols->functions[func_index].func_vars_index == -1) {
-        symbols->functions[func_index].func_vars_index = var_index;
+// Returns the BitField field that the value of a match statement reads, e.g.
+// "match (RTC.ctrl.mode)", if the field has a BitEnum whose names can be used by the
+// cases. Otherwise returns -1.
+int match_subject_bitenum(Token *tokens, int next_token, SymbolTable *symbols) {
+    Token *t = &tokens[next_token];
+    if (t[0].type != t_id || t[1].type != t_dot || t[2].type != t_id
+            || t[3].type != t_dot || t[4].type != t_id || t[5].type != t_rightparen) {
+        return -1;
     }
-    symbols->functions[func_index].func_vars_len++;
-
-    IROp op = {0};
-    op.opcode = ir_copy;
-    op.result.type = irv_local_variable;
-    op.result.local_variable_index = var_index;
-    op.result.func_index = func_index;
-    op.arg1.type = irv_immediate;
-    op.arg1.immediate_value = var.initial_value;
-    add_function_ir(symbols, func_index, op);
-    return next_token;
+    int mmp_index = find_mmp_index(symbols, &t[0].lexeme);
+    if (mmp_index == -1) {
+        return -1;
+    }
+    int si_index = find_struct_item_index(symbols, mmp_index, &t[2].lexeme);
+    if (si_index == -1 || symbols->struct_items[si_index].type != si_bf) {
+        return -1;
+    }
+    int bfi_index = find_bitfield_item_index(symbols, si_index, &t[4].lexeme);
+    if (bfi_index == -1 || symbols->bitfield_items[bfi_index].type != bfi_enum) {
+        return -1;
+    }
+    return bfi_index;
 }
-// parse while-loop, e.g. "while (i < 10) { i = i + 1 }"
-int function_statement_while_loop(Token *tokens, int next_token, SymbolTable *symbols, int func_index, int indent) {
-    PARSE_TREE_INDENT(indent); indent++; PARSE_TREE_PRINT("- ForLoop:\n");
-    next_token = match(t_while, tokens, next_token, indent);
-    next_token = match(t_leftparen, tokens, next_token, indent);
-
-    int begin_loop_label = label;
-    set_next_ir_label(label);
-    label++;
-    int temp = 0;
-    next_token = expression(tokens, next_token, symbols, func_index, &temp, indent);
+// parse the value of a case of a match statement, a constant expression or the name of
+// a value of the BitEnum the match reads (bfi_index, or -1 if there isn't one), putting
+// the value into dest. This doesn't print the parse tree.
+int match_case_value(Token *tokens, int next_token, SymbolTable *symbols, int bfi_index, int *dest) {
+    Token *t = &tokens[next_token];
+    if (t->type == t_id && bfi_index != -1) {
+        int bei_index = find_bitenum_item_index(symbols, bfi_index, &t->lexeme);
+        if (bei_index != -1) {
+            *dest = symbols->bitenum_items[bei_index].value;
+            return next_token + 1;
+        }
+        if (find_constant(symbols, &t->lexeme) == -1 && find_const_function(symbols, &t->lexeme) == -1) {
+            STRINGREF_TO_CSTR1(&symbols->bitfield_items[bfi_index].name, 512);
+            STRINGREF_TO_CSTR2(&t->lexeme, 512);
+            PANIC("BitEnum for field '%s' does not include value called '%s'\n", cstr1, cstr2);
+        }
+    }
+    ConstScope scope = {0};
+    scope.const_func_index = -1;
+    return const_expression(tokens, next_token, symbols, &scope, dest);
+}
+// Finds the values of all the cases of a match statement before its bodies are parsed,
+// so that the code choosing a case can go first. next_token is the "{" of the match.
+// Each value is put in values, with the index of its case in cases, sorted by value.
+// Returns the number of values, and sets the number of cases (not counting "else") and
+// whether there is an "else" case.
+int match_case_values(Token *tokens, int next_token, SymbolTable *symbols, int bfi_index, int *values, int *cases, int *cases_num, bool *has_else) {
+    int values_num = 0;
+    int case_index = 0;
+    *has_else = false;
+    next_token++;
+    while (tokens[next_token].type != t_rightbrace) {
+        if (*has_else) {
+            PANIC("'else' must be the last case of a match\n");
+        }
+        if (tokens[next_token].type == t_else) {
+            *has_else = true;
+            next_token++;
+        } else {
+            while (true) {
+                int value = 0;
+                next_token = match_case_value(tokens, next_token, symbols, bfi_index, &value);
+                // insert it in order
+                int i = values_num;
+                while (i > 0 && values[i - 1] > value) {
+                    i--;
+                }
+                if (i > 0 && values[i - 1] == value) {
+                    PANIC("Value %d is matched by more than one case\n", value);
+                }
+                if (values_num == MAX_MATCH_CASES) {
+                    PANIC("Too many cases in match: maximum is %d\n", MAX_MATCH_CASES);
+                }
+                for (int j = values_num; j > i; j--) {
+                    values[j] = values[j - 1];
+                    cases[j] = cases[j - 1];
+                }
+                values[i] = value;
+                cases[i] = case_index;
+                values_num++;
+                if (tokens[next_token].type != t_comma) {
+                    break;
+                }
+                next_token++;
+            }
+            case_index++;
+        }
+        if (tokens[next_token].type != t_leftbrace) {
+            PANIC(
+                "Expected leftbrace but found %s\n",
+                token_type_to_static_string(tokens[next_token].type)
+            );
+        }
+        // skip the body
+        int depth = 0;
+        do {
+            if (tokens[next_token].type == t_leftbrace) {
+                depth++;
+            } else if (tokens[next_token].type == t_rightbrace) {
+                depth--;
+            } else if (tokens[next_token].type == t_NONE) {
+                PANIC("Expected rightbrace but found NONE\n");
+            }
+            next_token++;
+        } while (depth > 0);
+    }
+    *cases_num = case_index;
+    return values_num;
+}
+// Adds an op comparing a temp to a value, and an "if" jumping to target_label if it's true
+void match_compare(SymbolTable *symbols, int func_index, IROpCode opcode, int temp, int value, int target_label) {
+    IROp compare_op = {0};
+    compare_op.opcode = opcode;
+    compare_op.result.type = irv_temp;
+    compare_op.result.temp_num = temp + 1;
+    compare_op.arg1.type = irv_temp;
+    compare_op.arg1.temp_num = temp;
+    compare_op.arg2.type = irv_immediate;
+    compare_op.arg2.immediate_value = value;
+    add_function_ir(symbols, func_index, compare_op);
 
     IROp if_op = {0};
     if_op.opcode = ir_if;
     if_op.arg1.type = irv_temp;
-    if_op.arg1.temp_num = temp;
-    if_op.target_label = label;
+    if_op.arg1.temp_num = temp + 1;
+    if_op.target_label = target_label;
     add_function_ir(symbols, func_index, if_op);
-
-    IROp goto_op = {0};
-    goto_op.opcode = ir_goto;
-    int goto_op_i = add_function_ir(symbols, func_index, goto_op);
-
-    set_next_ir_label(label);
-    label++;
+}
+// Adds IR that jumps to the label of the case whose value is in temp, or to default_label
+// if none of the values from first to last match. A few values are compared one at a time,
+// more are split in half with a (signed) "<" until there are only a few left.
+void match_search(SymbolTable *symbols, int func_index, int temp, int *values, int *targets, int first, int last, int default_label) {
+    if (last - first < MATCH_CHAIN_MAX_CASES) {
+        for (int i = first; i <= last; i++) {
+            match_compare(symbols, func_index, ir_equals, temp, values[i], targets[i]);
+        }
+        IROp goto_op = {0};
+        goto_op.opcode = ir_goto;
+        goto_op.target_label = default_label;
+        add_function_ir(symbols, func_index, goto_op);
+        return;
+    }
+    int middle = (first + last + 1) / 2;
+    int lower_label = label;
+    label++;
+    match_compare(symbols, func_index, ir_less_than, temp, values[middle], lower_label);
+    match_search(symbols, func_index, temp, values, targets, middle, last, default_label);
+    set_next_ir_label(lower_label);
+    match_search(symbols, func_index, temp, values, targets, first, middle - 1, default_label);
+}
+// Adds a jump table for the cases, which takes the same time for every case.
+// The values must be close together (see MATCH_JUMP_TABLE_DENSITY).
+void match_jump_table(SymbolTable *symbols, int func_index, int temp, int *values, int *targets, int values_num, int default_label) {
+    int index_temp = temp;
+    if (values[0] != 0) {
+        IROp subtract_op = {0};
+        subtract_op.opcode = ir_subtract;
+        subtract_op.result.type = irv_temp;
+        subtract_op.result.temp_num = temp + 1;
+        subtract_op.arg1.type = irv_temp;
+        subtract_op.arg1.temp_num = temp;
+        subtract_op.arg2.type = irv_immediate;
+        subtract_op.arg2.immediate_value = values[0];
+        add_function_ir(symbols, func_index, subtract_op);
+        index_temp = temp + 1;
+    }
+    int entries = values[values_num - 1] - values[0] + 1;
+    IROp table_op = {0};
+    table_op.opcode = ir_jump_table;
+    table_op.arg1.type = irv_temp;
+    table_op.arg1.temp_num = index_temp;
+    table_op.arg2.type = irv_immediate;
+    table_op.arg2.immediate_value = entries;
+    table_op.target_label = default_label;
+    add_function_ir(symbols, func_index, table_op);
+
+    int v = 0;
+    for (int i = 0; i < entries; i++) {
+        IROp entry_op = {0};
+        entry_op.opcode = ir_jump_table_entry;
+        entry_op.target_label = default_label;
+        if (values[v] - values[0] == i) {
+            entry_op.target_label = targets[v];
+            v++;
+        }
+        add_function_ir(symbols, func_index, entry_op);
+    }
+}
+// parse a match statement, e.g. "match (x) { 0 { y = 1; } 1, 2 { y = 2; } else { y = 3; } }"
+// "else" is optional and must be the last case. If the value is a BitField field with a
+// BitEnum, e.g. "match (RTC.ctrl.mode)", the cases can be names from the BitEnum.
+// The case is chosen with a jump table if the values are close together, otherwise with
+// a binary search, or by comparing against each value if there are only a few.
+int function_statement_match(Token *tokens, int next_token, SymbolTable *symbols, int func_index, int indent) {
+    PARSE_TREE_INDENT(indent); indent++; PARSE_TREE_PRINT("- Match:\n");
+    next_token = match(t_match, tokens, next_token, indent);
+    next_token = match(t_leftparen, tokens, next_token, indent);
+    int bfi_index = match_subject_bitenum(tokens, next_token, symbols);
+    int temp = 0;
+    next_token = expression(tokens, next_token, symbols, func_index, &temp, indent);
+    next_token = match(t_rightparen, tokens, next_token, indent);
+
+    static int values[MAX_MATCH_CASES];
+    static int cases[MAX_MATCH_CASES];
+    int targets[MAX_MATCH_CASES];
+    int cases_num;
+    bool has_else;
+    int values_num = match_case_values(tokens, next_token, symbols, bfi_index, values, cases, &cases_num, &has_else);
+
+    // each case's body starts with a label, numbered in order
+    int first_case_label = label;
+    label += cases_num;
+    for (int i = 0; i < values_num; i++) {
+        targets[i] = first_case_label + cases[i];
+    }
+    int else_label = label;
+    label++;
+    int end_label = label;
+    label++;
+    int default_label = has_else ? else_label : end_label;
+
+    if (values_num == 0) {
+        IROp goto_op = {0};
+        goto_op.opcode = ir_goto;
+        goto_op.target_label = default_label;
+        add_function_ir(symbols, func_index, goto_op);
+    } else if (values_num > MATCH_CHAIN_MAX_CASES
+            && (int64_t)values[values_num - 1] - values[0] < (int64_t)values_num * MATCH_JUMP_TABLE_DENSITY
+            && (int64_t)values[values_num - 1] - values[0] < MAX_JUMP_TABLE_ENTRIES) {
+        match_jump_table(symbols, func_index, temp, values, targets, values_num, default_label);
+    } else {
+        match_search(symbols, func_index, temp, values, targets, 0, values_num - 1, default_label);
+    }
+
+    next_token = match(t_leftbrace, tokens, next_token, indent);
+    int case_index = 0;
+    while (tokens[next_token].type != t_rightbrace) {
+        PARSE_TREE_INDENT(indent); PARSE_TREE_PRINT("- Case:\n");
+        if (tokens[next_token].type == t_else) {
+            next_token = match(t_else, tokens, next_token, indent + 1);
+            set_next_ir_label(else_label);
+        } else {
+            while (true) {
+                int value = 0;
+                int end = match_case_value(tokens, next_token, symbols, bfi_index, &value);
+                print_constant_tokens(tokens, next_token, end, indent + 1);
+                next_token = end;
+                if (tokens[next_token].type != t_comma) {
+                    break;
+                }
+                next_token = match(t_comma, tokens, next_token, indent + 1);
+            }
+            set_next_ir_label(first_case_label + case_index);
+            case_index++;
+        }
+        next_token = match(t_leftbrace, tokens, next_token, indent + 1);
+        while (tokens[next_token].type != t_rightbrace) {
+            // any number of function statements
+            next_token = function_statement(tokens, next_token, symbols, func_index, indent + 1);
+        }
+        next_token = match(t_rightbrace, tokens, next_token, indent + 1);
+
+        IROp goto_op = {0};
+        goto_op.opcode = ir_goto;
+        goto_op.target_label = end_label;
+        add_function_ir(symbols, func_index, goto_op);
+    }
+    next_token = match(t_rightbrace, tokens, next_token, indent);
+
+    set_next_ir_label(end_label);
+    return next_token;
+}
+// Inline asm blocks, e.g.
+//   asm (in: count; out: result; clobber: r4) {
+//   loop:
+//       SUBS count, 1;
+//       BNE loop;
+//       MOVS r4, 5;
+//       MOVS result, r4;
+//   }
+// Each variable bound to the block gets a temp register that isn't clobbered. Inputs are
+// copied into their registers before the block and outputs are copied out after it, so
+// the variables' names can be used as registers in the instructions. Immediates are
+// constant expressions, and memory operands are "[rn]", "[rn, offset]" or "[rn, rm]".
+
+// The names that mean something in the body of an asm block
+typedef struct _AsmNames {
+    StringRef operands[MAX_ASM_OPERANDS];
+    int operand_registers[MAX_ASM_OPERANDS];
+    int operands_num;
+    StringRef labels[MAX_ASM_LABELS];
+    int label_values[MAX_ASM_LABELS];
+    int labels_num;
+    int clobbers;
+} AsmNames;
+
+// Returns the number of a register name from r0 to r7, or -1
+int asm_register_number(StringRef *name) {
+    if (name->len != 2 || (name->str[0] != 'r' && name->str[0] != 'R')
+            || name->str[1] < '0' || name->str[1] > '7') {
+        return -1;
+    }
+    return name->str[1] - '0';
+}
+int asm_find_name(StringRef *names, int names_num, StringRef *name) {
+    for (int i = 0; i < names_num; i++) {
+        if (string_ref_eq(&names[i], name)) {
+            return i;
+        }
+    }
+    return -1;
+}
+// parse a variable bound to an asm block, adding it to names if it isn't there yet
+// index is set to its index in names
+int asm_binding(Token *tokens, int next_token, SymbolTable *symbols, int func_index, AsmNames *names, IRValue *values, bool is_output, int *index, int indent) {
+    StringRef var_name = tokens[next_token].lexeme;
+    struct NameResolutionResult name_result;
+    next_token = name(tokens, next_token, symbols, func_index, &name_result, indent);
+    STRINGREF_TO_CSTR1(&var_name, 512);
+    Variable *var = name_variable(symbols, &name_result);
+    if (name_result.result != name_func_arg && var == NULL) {
+        PANIC("Only variables can be bound to an asm block: '%s'\n", cstr1);
+    }
+    if (var != NULL && var->array_len > 0) {
+        PANIC("Array '%s' cannot be bound to an asm block\n", cstr1);
+    }
+    if (var != NULL && var->is_const && is_output) {
+        PANIC("Cannot assign to const '%s'\n", cstr1);
+    }
+    if (asm_register_number(&var_name) != -1) {
+        PANIC("Variable '%s' has the name of a register and cannot be bound to an asm block\n", cstr1);
+    }
+    *index = asm_find_name(names->operands, names->operands_num, &var_name);
+    if (*index != -1) {
+        return next_token;
+    }
+    if (names->operands_num == MAX_ASM_OPERANDS) {
+        PANIC("Too many variables bound to an asm block: maximum is %d\n", MAX_ASM_OPERANDS);
+    }
+    IRValue *value = &values[names->operands_num];
+    memset(value, 0, sizeof(IRValue));
+    if (name_result.result == name_func_arg) {
+        value->type = irv_function_argument;
+        value->func_arg_index = name_result.func_arg_index;
+        value->func_index = name_result.func_index;
+    } else if (name_result.result == name_local_var) {
+        value->type = irv_local_variable;
+        value->local_variable_index = name_result.local_var_index;
+        value->func_index = name_result.func_index;
+    } else {
+        value->type = irv_static_variable;
+        value->static_variable_index = name_result.static_var_index;
+    }
+    names->operands[names->operands_num] = var_name;
+    *index = names->operands_num;
+    names->operands_num++;
+    return next_token;
+}
+// parse the optional list of variables bound to an asm block and the registers it
+// clobbers, e.g. "(in: a, b; out: c; clobber: r4, r5)"
+// is_input and is_output are set for each variable in names
+int asm_bindings(Token *tokens, int next_token, SymbolTable *symbols, int func_index, AsmNames *names, IRValue *values, bool *is_input, bool *is_output, int indent) {
+    if (tokens[next_token].type != t_leftparen) {
+        return next_token;
+    }
+    PARSE_TREE_INDENT(indent); indent++; PARSE_TREE_PRINT("- AsmBindings:\n");
+    next_token = match(t_leftparen, tokens, next_token, indent);
+    while (tokens[next_token].type != t_rightparen) {
+        StringRef list_name;
+        next_token = match_id(tokens, next_token, &list_name, indent);
+        STRINGREF_TO_CSTR1(&list_name, 512);
+        bool input = strcmp(cstr1, "in") == 0;
+        bool output = strcmp(cstr1, "out") == 0;
+        if (!input && !output && strcmp(cstr1, "clobber") != 0) {
+            PANIC("Expected 'in', 'out' or 'clobber' in asm block but found '%s'\n", cstr1);
+        }
+        next_token = match(t_colon, tokens, next_token, indent);
+        while (true) {
+            if (input || output) {
+                int i;
+                next_token = asm_binding(tokens, next_token, symbols, func_index, names, values, output, &i, indent);
+                is_input[i] = is_input[i] || input;
+                is_output[i] = is_output[i] || output;
+            } else {
+                StringRef reg_name;
+                next_token = match_id(tokens, next_token, &reg_name, indent);
+                int reg = asm_register_number(&reg_name);
+                if (reg == -1) {
+                    STRINGREF_TO_CSTR2(&reg_name, 512);
+                    PANIC("Expected a register from r0 to r7 in clobber list but found '%s'\n", cstr2);
+                }
+                if (options.gp && reg == R_TEMP_FIRST + TEMP_REGISTERS_NUM - 1) {
+                    PANIC("With --gp, r7 holds the start of RAM, so an asm block can't clobber it\n");
+                }
+                names->clobbers |= 1 << reg;
+            }
+            if (tokens[next_token].type != t_comma) {
+                break;
+            }
+            next_token = match(t_comma, tokens, next_token, indent);
+        }
+        if (tokens[next_token].type != t_semicolon) {
+            break;
+        }
+        next_token = match(t_semicolon, tokens, next_token, indent);
+    }
+    next_token = match(t_rightparen, tokens, next_token, indent);
+    return next_token;
+}
+// Gives each label in the body of an asm block (starting at next_token) a label number.
+// The body is scanned before it is parsed, so that branches can jump forwards.
+void asm_labels(Token *tokens, int next_token, AsmNames *names) {
+    for (int i = next_token; tokens[i].type != t_rightbrace && tokens[i].type != t_NONE; i++) {
+        if (tokens[i].type != t_id || tokens[i + 1].type != t_colon) {
+            continue;
+        }
+        STRINGREF_TO_CSTR1(&tokens[i].lexeme, 512);
+        if (asm_find_name(names->labels, names->labels_num, &tokens[i].lexeme) != -1) {
+            PANIC("Duplicate label in asm block: '%s'\n", cstr1);
+        }
+        if (asm_register_number(&tokens[i].lexeme) != -1
+                || asm_find_name(names->operands, names->operands_num, &tokens[i].lexeme) != -1) {
+            PANIC("Label in asm block has the name of a register: '%s'\n", cstr1);
+        }
+        if (names->labels_num == MAX_ASM_LABELS) {
+            PANIC("Too many labels in asm block: maximum is %d\n", MAX_ASM_LABELS);
+        }
+        names->labels[names->labels_num] = tokens[i].lexeme;
+        names->label_values[names->labels_num] = label;
+        names->labels_num++;
+        label++;
+    }
+}
+// parse one operand of an instruction in an asm block: a register, a bound variable,
+// a label or a constant expression
+int asm_operand(Token *tokens, int next_token, SymbolTable *symbols, AsmNames *names, AsmInstruction *inst, bool in_brackets, int indent) {
+    if (inst->operands_num == 3) {
+        PANIC("Too many operands in asm instruction\n");
+    }
+    AsmOperand *operand = &inst->operands[inst->operands_num];
+    inst->operands_num++;
+    operand->in_brackets = in_brackets;
+    StringRef *operand_name = &tokens[next_token].lexeme;
+    int reg = asm_register_number(operand_name);
+    int i = asm_find_name(names->operands, names->operands_num, operand_name);
+    int l = asm_find_name(names->labels, names->labels_num, operand_name);
+    if (tokens[next_token].type == t_id && (reg != -1 || i != -1 || l != -1)) {
+        STRINGREF_TO_CSTR1(operand_name, 512);
+        next_token = match_id(tokens, next_token, operand_name, indent);
+        if (reg != -1) {
+            // the temp registers can only be used directly if the block says it clobbers them
+            if (reg >= R_TEMP_FIRST && (names->clobbers & (1 << reg)) == 0) {
+                PANIC("Register '%s' is used in asm block but is not in its clobber list\n", cstr1);
+            }
+            operand->type = asm_register;
+            operand->value = reg;
+        } else if (i != -1) {
+            operand->type = asm_register;
+            operand->value = names->operand_registers[i];
+        } else {
+            operand->type = asm_label;
+            operand->value = names->label_values[l];
+        }
+        return next_token;
+    }
+    operand->type = asm_immediate;
+    next_token = match_constant(tokens, next_token, symbols, &operand->value, indent);
+    return next_token;
+}
+// parse one instruction in an asm block, with an optional label in front of it,
+// e.g. "loop: SUBS count, 1;" or "LDR r4, [addr, 4];"
+int asm_instruction(Token *tokens, int next_token, SymbolTable *symbols, AsmNames *names, int indent) {
+    PARSE_TREE_INDENT(indent); indent++; PARSE_TREE_PRINT("- AsmInstruction:\n");
+    AsmInstruction inst = {0};
+    if (tokens[next_token].type == t_id && tokens[next_token + 1].type == t_colon) {
+        StringRef label_name;
+        next_token = match_id(tokens, next_token, &label_name, indent);
+        next_token = match(t_colon, tokens, next_token, indent);
+        inst.label = names->label_values[asm_find_name(names->labels, names->labels_num, &label_name)];
+        if (tokens[next_token].type == t_rightbrace) {
+            // a label at the end of the block
+            add_asm_instruction(symbols, inst);
+            return next_token;
+        }
+    }
+    next_token = match_id(tokens, next_token, &inst.mnemonic, indent);
+    while (tokens[next_token].type != t_semicolon) {
+        if (inst.operands_num > 0) {
+            next_token = match(t_comma, tokens, next_token, indent);
+        }
+        if (tokens[next_token].type == t_leftbracket) {
+            next_token = match(t_leftbracket, tokens, next_token, indent);
+            next_token = asm_operand(tokens, next_token, symbols, names, &inst, true, indent);
+            if (tokens[next_token].type == t_comma) {
+                next_token = match(t_comma, tokens, next_token, indent);
+                next_token = asm_operand(tokens, next_token, symbols, names, &inst, true, indent);
+            }
+            next_token = match(t_rightbracket, tokens, next_token, indent);
+        } else {
+            next_token = asm_operand(tokens, next_token, symbols, names, &inst, false, indent);
+        }
+    }
+    next_token = match(t_semicolon, tokens, next_token, indent);
+    add_asm_instruction(symbols, inst);
+    return next_token;
+}
+// parse an inline asm block, e.g. "asm (in: a; out: b) { MOVS b, a; }"
+int function_statement_asm(Token *tokens, int next_token, SymbolTable *symbols, int func_index, int indent) {
+    PARSE_TREE_INDENT(indent); indent++; PARSE_TREE_PRINT("- Asm:\n");
+    next_token = match(t_asm, tokens, next_token, indent);
+
+    AsmNames names = {0};
+    IRValue values[MAX_ASM_OPERANDS];
+    bool is_input[MAX_ASM_OPERANDS] = {0};
+    bool is_output[MAX_ASM_OPERANDS] = {0};
+    next_token = asm_bindings(tokens, next_token, symbols, func_index, &names, values, is_input, is_output, indent);
+
+    // the bound variables go in the temps whose registers aren't clobbered
+    AsmBlock block = {0};
+    block.clobbers = names.clobbers;
+    int temp = 0;
+    for (int i = 0; i < names.operands_num; i++) {
+        while (temp < temp_registers_num() && (names.clobbers & (1 << (temp + R_TEMP_FIRST)))) {
+            temp++;
+        }
+        if (temp == temp_registers_num()) {
+            PANIC("Not enough registers for the variables bound to asm block\n");
+        }
+        names.operand_registers[i] = temp + R_TEMP_FIRST;
+        if (is_input[i]) {
+            IROp op = {0};
+            op.opcode = ir_copy;
+            op.result.type = irv_temp;
+            op.result.temp_num = temp;
+            op.arg1 = values[i];
+            add_function_ir(symbols, func_index, op);
+            block.input_temps |= 1 << temp;
+        }
+        temp++;
+    }
+
+    next_token = match(t_leftbrace, tokens, next_token, indent);
+    asm_labels(tokens, next_token, &names);
+    block.instructions_index = symbols->asm_instructions_num;
+    while (tokens[next_token].type != t_rightbrace) {
+        next_token = asm_instruction(tokens, next_token, symbols, &names, indent);
+    }
+    next_token = match(t_rightbrace, tokens, next_token, indent);
+    block.instructions_len = symbols->asm_instructions_num - block.instructions_index;
+
+    IROp asm_op = {0};
+    asm_op.opcode = ir_asm;
+    asm_op.arg1.type = irv_immediate;
+    asm_op.arg1.immediate_value = add_asm_block(symbols, block);
+    add_function_ir(symbols, func_index, asm_op);
+
+    for (int i = 0; i < names.operands_num; i++) {
+        if (is_output[i]) {
+            IROp op = {0};
+            op.opcode = ir_copy;
+            op.result = values[i];
+            op.arg1.type = irv_temp;
+            op.arg1.temp_num = names.operand_registers[i] - R_TEMP_FIRST;
+            add_function_ir(symbols, func_index, op);
+        }
+    }
+    return next_token;
+}
+// parse the length of an array in a variable declaration, e.g. "[16]", putting it into dest
+// dest is set to 0 if the variable is not an array
+int variable_opt_array_len(Token *tokens, int next_token, SymbolTable *symbols, int *dest, int indent) {
+    *dest = 0;
+    if (tokens[next_token].type != t_leftbracket) {
+        return next_token;
+    }
+    next_token = match(t_leftbracket, tokens, next_token, indent);
+    next_token = match_constant(tokens, next_token, symbols, dest, indent);
+    next_token = match(t_rightbracket, tokens, next_token, indent);
+    if (*dest <= 0) {
+        PANIC("Arrays must have at least one element\n");
+    }
+    return next_token;
+}
+// emit a loop that sets every element of an array to its initial value:
+//      t0 = 0
+//   L: t1 = initial value
+//      array[t0] = t1
+//      t1 = element size
+//      t0 = t0 + t1
+//      t1 = array size in bytes
+//      t2 = t0 < t1
+//      if t2 goto L
+// arrays always have at least one element, so the test can go at the bottom
+void array_fill(SymbolTable *symbols, int func_index, IRValue array, Variable *var) {
+    IRValue offset = {0};
+    offset.type = irv_temp;
+    offset.temp_num = 0;
+    IRValue scratch = {0};
+    scratch.type = irv_temp;
+    scratch.temp_num = 1;
+    IRValue compare = {0};
+    compare.type = irv_temp;
+    compare.temp_num = 2;
+    array.offset_in_temp = true;
+    array.offset_temp_num = offset.temp_num;
+
+    IROp op = {0};
+    op.opcode = ir_copy;
+    op.result = offset;
+    op.arg1.type = irv_immediate;
+    op.arg1.immediate_value = 0;
+    add_function_ir(symbols, func_index, op);
+
+    int loop_label = label;
+    set_next_ir_label(label);
+    label++;
+    op.result = scratch;
+    op.arg1.immediate_value = var->initial_value;
+    add_function_ir(symbols, func_index, op);
+
+    op.result = array;
+    op.arg1 = scratch;
+    add_function_ir(symbols, func_index, op);
+
+    op.result = scratch;
+    op.arg1.type = irv_immediate;
+    op.arg1.immediate_value = int_type_size(var->int_type);
+    add_function_ir(symbols, func_index, op);
+
+    op.opcode = ir_add;
+    op.result = offset;
+    op.arg1 = offset;
+    op.arg2 = scratch;
+    add_function_ir(symbols, func_index, op);
+
+    memset(&op, 0, sizeof(IROp));
+    op.opcode = ir_copy;
+    op.result = scratch;
+    op.arg1.type = irv_immediate;
+    op.arg1.immediate_value = variable_size(var);
+    add_function_ir(symbols, func_index, op);
+
+    op.opcode = ir_less_than;
+    op.result = compare;
+    op.arg1 = offset;
+    op.arg2 = scratch;
+    add_function_ir(symbols, func_index, op);
+
+    memset(&op, 0, sizeof(IROp));
+    op.opcode = ir_if;
+    op.arg1 = compare;
+    op.target_label = loop_label;
+    add_function_ir(symbols, func_index, op);
+}
+int hidden_static_var(SymbolTable *symbols, char *name, IntType int_type, int array_len);
+
+// Adds the static that holds a local variable of a task
+int task_static_var(SymbolTable *symbols, int func_index, Variable *var) {
+    if (find_task_variable(symbols, func_index, &var->name) != -1) {
+        STRINGREF_TO_CSTR1(&var->name, 512);
+        PANIC("Variable '%s' is already declared in this task\n", cstr1);
+    }
+    StringRef *task_name = &symbols->functions[func_index].name;
+    int len = task_name->len + 1 + var->name.len + 1;
+    if (task_var_names_len + len > 8192) {
+        PANIC("The names of task variables are too long: maximum is %d characters\n", 8192);
+    }
+    char *name = &task_var_names[task_var_names_len];
+    snprintf(name, len, "%.*s.%.*s", task_name->len, task_name->str, var->name.len, var->name.str);
+    task_var_names_len += len;
+    return hidden_static_var(symbols, name, var->int_type, var->array_len);
+}
+// parse local variable declaration, e.g. "u32 var = 4;" or "u8 buf[16] = 0;"
+// initial value is required, every element of an array is set to it
+// puts the variable into the symbol table
+int function_statement_local_var(Token *tokens, int next_token, SymbolTable *symbols, int func_index, int indent) {
+    PARSE_TREE_INDENT(indent); indent++; PARSE_TREE_PRINT("- LocalVariable:\n");
+    Variable var;
+    var.is_const = false;
+
+    next_token = match_inttype(tokens, next_token, &var.int_type, indent);
+    next_token = match_id(tokens, next_token, &var.name, indent);
+    next_token = variable_opt_array_len(tokens, next_token, symbols, &var.array_len, indent);
+    next_token = match(t_equals, tokens, next_token, indent);
+    next_token = match_constant(tokens, next_token, symbols, &var.initial_value, indent);
+    next_token = match(t_semicolon, tokens, next_token, indent);
+
+    IROp op = {0};
+    op.opcode = ir_copy;
+    if (find_task(symbols, func_index) != -1) {
+        // a task's variables are statics, so they keep their values while it is stopped
+        op.result.type = irv_static_variable;
+        op.result.static_variable_index = task_static_var(symbols, func_index, &var);
+    } else {
+        int var_index = add_function_variable(symbols, var);
+        if (symbols->functions[func_index].func_vars_index == -1) {
+            symbols->functions[func_index].func_vars_index = var_index;
+        }
+        symbols->functions[func_index].func_vars_len++;
+
+        op.result.type = irv_local_variable;
+        op.result.local_variable_index = var_index;
+        op.result.func_index = func_index;
+    }
+    if (var.array_len > 0) {
+        array_fill(symbols, func_index, op.result, &var);
+        return next_token;
+    }
+    op.arg1.type = irv_immediate;
+    op.arg1.immediate_value = var.initial_value;
+    add_function_ir(symbols, func_index, op);
+    return next_token;
+}
+// parse while-loop, e.g. "while (i < 10) { i = i + 1 }"
+int function_statement_while_loop(Token *tokens, int next_token, SymbolTable *symbols, int func_index, int indent) {
+    PARSE_TREE_INDENT(indent); indent++; PARSE_TREE_PRINT("- ForLoop:\n");
+    next_token = match(t_while, tokens, next_token, indent);
+    next_token = match(t_leftparen, tokens, next_token, indent);
+
+    int begin_loop_label = label;
+    set_next_ir_label(label);
+    label++;
+    int temp = 0;
+    next_token = expression(tokens, next_token, symbols, func_index, &temp, indent);
+
+    IROp if_op = {0};
+    if_op.opcode = ir_if;
+    if_op.arg1.type = irv_temp;
+    if_op.arg1.temp_num = temp;
+    if_op.target_label = label;
+    add_function_ir(symbols, func_index, if_op);
+
+    IROp goto_op = {0};
+    goto_op.opcode = ir_goto;
+    int goto_op_i = add_function_ir(symbols, func_index, goto_op);
+
+    set_next_ir_label(label);
+    label++;
 
     next_token = match(t_rightparen, tokens, next_token, indent);
     next_token = match(t_leftbrace, tokens, next_token, indent);
@@ -826,6 +2123,416 @@ int function_statement_while_loop(Token *tokens, int next_token, SymbolTable *sy
     label++;
     return next_token;
 }
+// parse an atomic block, e.g. "atomic { pressed = pressed + 1; }"
+// Interrupts are masked while the block runs, and PRIMASK is put back the way it was
+// afterwards (in a hidden local variable), so blocks can be nested. Calls to functions
+// aren't allowed inside unless the block starts with "atomic allow_calls".
+int function_statement_atomic(Token *tokens, int next_token, SymbolTable *symbols, int func_index, int indent) {
+    PARSE_TREE_INDENT(indent); indent++; PARSE_TREE_PRINT("- Atomic:\n");
+    next_token = match(t_atomic, tokens, next_token, indent);
+    bool allow_calls = false;
+    StringRef *keyword = &tokens[next_token].lexeme;
+    if (tokens[next_token].type == t_id && keyword->len == 11 && strncmp(keyword->str, "allow_calls", 11) == 0) {
+        next_token = match(t_id, tokens, next_token, indent);
+        allow_calls = true;
+    }
+
+    Variable var = {0};
+    var.int_type = int_u32;
+    var.name.str = "____primask";
+    var.name.len = 11;
+    int var_index = add_function_variable(symbols, var);
+    if (symbols->functions[func_index].func_vars_index == -1) {
+        symbols->functions[func_index].func_vars_index = var_index;
+    }
+    symbols->functions[func_index].func_vars_len++;
+
+    IROp begin_op = {0};
+    begin_op.opcode = ir_atomic_begin;
+    begin_op.result.type = irv_local_variable;
+    begin_op.result.local_variable_index = var_index;
+    begin_op.result.func_index = func_index;
+    add_function_ir(symbols, func_index, begin_op);
+
+    atomic_depth++;
+    if (!allow_calls) {
+        atomic_no_calls_depth++;
+    }
+    next_token = match(t_leftbrace, tokens, next_token, indent);
+    while (tokens[next_token].type != t_rightbrace) {
+        next_token = function_statement(tokens, next_token, symbols, func_index, indent);
+    }
+    next_token = match(t_rightbrace, tokens, next_token, indent);
+    atomic_depth--;
+    if (!allow_calls) {
+        atomic_no_calls_depth--;
+    }
+
+    IROp end_op = {0};
+    end_op.opcode = ir_atomic_end;
+    end_op.arg1 = begin_op.result;
+    add_function_ir(symbols, func_index, end_op);
+    return next_token;
+}
+// Returns the interrupt handler whose function this is, or -1
+int find_interrupt_handler_index(SymbolTable *symbols, int func_index) {
+    for (int i = 0; i < symbols->interrupt_handlers_num; i++) {
+        if (symbols->interrupt_handlers[i].func_index == func_index) {
+            return i;
+        }
+    }
+    return -1;
+}
+// Returns the queue for the calls to a function that an interrupt handler defers, adding
+// it (and its statics) the first time
+int defer_queue(SymbolTable *symbols, int handler_func_index, int called_func_index) {
+    int index = find_defer_queue(symbols, handler_func_index, called_func_index);
+    if (index != -1) {
+        return index;
+    }
+    DeferQueue queue;
+    queue.handler_func_index = handler_func_index;
+    queue.func_index = called_func_index;
+    queue.head_var = hidden_static_var(symbols, "____defer_head", int_u8, 0);
+    queue.tail_var = hidden_static_var(symbols, "____defer_tail", int_u8, 0);
+    queue.entries_var = -1;
+    int args_len = symbols->functions[called_func_index].func_args_len;
+    if (args_len > 0) {
+        queue.entries_var = hidden_static_var(symbols, "____defer_entries", int_u32, DEFER_QUEUE_LEN * args_len);
+    }
+    return add_defer_queue(symbols, queue);
+}
+// Emits "temp = static var", for the statics the compiler adds itself
+void static_to_temp(SymbolTable *symbols, int func_index, int temp, int var_index) {
+    IROp op = {0};
+    op.opcode = ir_copy;
+    op.result.type = irv_temp;
+    op.result.temp_num = temp;
+    op.arg1.type = irv_static_variable;
+    op.arg1.static_variable_index = var_index;
+    add_function_ir(symbols, func_index, op);
+}
+// Emits "static var = temp"
+void temp_to_static(SymbolTable *symbols, int func_index, int var_index, int temp) {
+    IROp op = {0};
+    op.opcode = ir_copy;
+    op.result.type = irv_static_variable;
+    op.result.static_variable_index = var_index;
+    op.arg1.type = irv_temp;
+    op.arg1.temp_num = temp;
+    add_function_ir(symbols, func_index, op);
+}
+// Emits "static var = immediate"
+void immediate_to_static(SymbolTable *symbols, int func_index, int var_index, int immediate) {
+    IROp op = {0};
+    op.opcode = ir_copy;
+    op.result.type = irv_static_variable;
+    op.result.static_variable_index = var_index;
+    op.arg1.type = irv_immediate;
+    op.arg1.immediate_value = immediate;
+    add_function_ir(symbols, func_index, op);
+}
+// Emits "temp = temp OP immediate"
+void temp_op_immediate(SymbolTable *symbols, int func_index, IROpCode opcode, int temp, int immediate) {
+    IROp op = {0};
+    op.opcode = opcode;
+    op.result.type = irv_temp;
+    op.result.temp_num = temp;
+    op.arg1 = op.result;
+    op.arg2.type = irv_immediate;
+    op.arg2.immediate_value = immediate;
+    add_function_ir(symbols, func_index, op);
+}
+// parse a deferred call, e.g. "defer blink(3);", which can only be in an interrupt handler
+// The call is added to the end of a queue, and the main loop makes it after the handler
+// has returned. If the queue is full the call is dropped. It works out to:
+//      t0 = tail
+//      t1 = t0 + 1
+//      t1 = t1 & (DEFER_QUEUE_LEN - 1)
+//      t2 = head
+//      t1 = t1 == t2
+//      if t1 goto full
+//      (for each argument)
+//      tN = argument
+//      tN+1 = tail
+//      tN+1 = tN+1 * args * 4 + argument * 4
+//      entries[tN+1] = tN
+//      t0 = tail
+//      t0 = t0 + 1
+//      t0 = t0 & (DEFER_QUEUE_LEN - 1)
+//      tail = t0
+//   full:
+// The entry is written before the tail is moved past it, so the main loop never sees a
+// half-written entry.
+int function_statement_defer(Token *tokens, int next_token, SymbolTable *symbols, int func_index, int indent) {
+    PARSE_TREE_INDENT(indent); indent++; PARSE_TREE_PRINT("- Defer:\n");
+    next_token = match(t_defer, tokens, next_token, indent);
+    if (find_interrupt_handler_index(symbols, func_index) == -1) {
+        PANIC("defer can only be used in an on_interrupt handler\n");
+    }
+    StringRef func_name;
+    next_token = match_id(tokens, next_token, &func_name, indent);
+    int called_func_index = find_function_index(symbols, &func_name);
+    STRINGREF_TO_CSTR1(&func_name, 512);
+    if (called_func_index == -1) {
+        PANIC("Function '%s' does not exist\n", cstr1);
+    }
+    int args_len = symbols->functions[called_func_index].func_args_len;
+    if (args_len > MAX_DEFER_ARGS) {
+        PANIC("Function '%s' has too many arguments to be deferred: maximum is %d\n", cstr1, MAX_DEFER_ARGS);
+    }
+    DeferQueue *queue = &symbols->defer_queues[defer_queue(symbols, func_index, called_func_index)];
+
+    static_to_temp(symbols, func_index, 0, queue->tail_var);
+    IROp op = {0};
+    op.opcode = ir_add;
+    op.result.type = irv_temp;
+    op.result.temp_num = 1;
+    op.arg1.type = irv_temp;
+    op.arg1.temp_num = 0;
+    op.arg2.type = irv_immediate;
+    op.arg2.immediate_value = 1;
+    add_function_ir(symbols, func_index, op);
+    temp_op_immediate(symbols, func_index, ir_bitwise_and, 1, DEFER_QUEUE_LEN - 1);
+    static_to_temp(symbols, func_index, 2, queue->head_var);
+    memset(&op, 0, sizeof(IROp));
+    op.opcode = ir_equals;
+    op.result.type = irv_temp;
+    op.result.temp_num = 1;
+    op.arg1 = op.result;
+    op.arg2.type = irv_temp;
+    op.arg2.temp_num = 2;
+    add_function_ir(symbols, func_index, op);
+    int full_label = label;
+    label++;
+    memset(&op, 0, sizeof(IROp));
+    op.opcode = ir_if;
+    op.arg1.type = irv_temp;
+    op.arg1.temp_num = 1;
+    op.target_label = full_label;
+    add_function_ir(symbols, func_index, op);
+
+    next_token = match(t_leftparen, tokens, next_token, indent);
+    int num_args = 0;
+    while (tokens[next_token].type != t_rightparen) {
+        int temp = 0;
+        next_token = expression(tokens, next_token, symbols, func_index, &temp, indent);
+        if (num_args < args_len) {
+            int offset = temp + 1;
+            static_to_temp(symbols, func_index, offset, queue->tail_var);
+            temp_op_immediate(symbols, func_index, ir_multiply, offset, args_len * 4);
+            if (num_args > 0) {
+                temp_op_immediate(symbols, func_index, ir_add, offset, num_args * 4);
+            }
+            memset(&op, 0, sizeof(IROp));
+            op.opcode = ir_copy;
+            op.result.type = irv_static_variable;
+            op.result.static_variable_index = queue->entries_var;
+            op.result.offset_in_temp = true;
+            op.result.offset_temp_num = offset;
+            op.arg1.type = irv_temp;
+            op.arg1.temp_num = temp;
+            add_function_ir(symbols, func_index, op);
+        }
+        num_args++;
+        if (tokens[next_token].type != t_rightparen) {
+            next_token = match(t_comma, tokens, next_token, indent);
+        }
+    }
+    if (num_args != args_len) {
+        PANIC("Incorrect number of arguments to function '%s'. Expected %d but got %d.\n", cstr1, args_len, num_args);
+    }
+    next_token = match(t_rightparen, tokens, next_token, indent);
+    next_token = match(t_semicolon, tokens, next_token, indent);
+
+    static_to_temp(symbols, func_index, 0, queue->tail_var);
+    temp_op_immediate(symbols, func_index, ir_add, 0, 1);
+    temp_op_immediate(symbols, func_index, ir_bitwise_and, 0, DEFER_QUEUE_LEN - 1);
+    temp_to_static(symbols, func_index, queue->tail_var, 0);
+    set_next_ir_label(full_label);
+    return next_token;
+}
+// Returns true if an id is the contextual keyword, e.g. "sleep_ticks" in a task
+bool id_is_keyword(StringRef *id, char *keyword) {
+    return id->len == (int)strlen(keyword) && strncmp(id->str, keyword, id->len) == 0;
+}
+
+// The task being parsed: the label of its first resume point, how many resume points it
+// has had so far, and the label of the return at its end
+static int task_resume_label = 0;
+static int task_resume_points = 0;
+static int task_end_label = 0;
+
+// Returns the task being parsed, checking that a statement that stops it can be used here
+Task *current_task(SymbolTable *symbols, int func_index, char *statement) {
+    int task_index = find_task(symbols, func_index);
+    if (task_index == -1) {
+        PANIC("%s can only be used in a task\n", statement);
+    }
+    if (atomic_depth > 0) {
+        PANIC("%s can't be used inside an atomic block\n", statement);
+    }
+    return &symbols->tasks[task_index];
+}
+// Stops the task, so that the next time it runs it carries on from the next op
+//      state = resume point
+//      return 0
+//   resume point:
+void task_suspend(SymbolTable *symbols, int func_index, Task *task) {
+    task_resume_points++;
+    immediate_to_static(symbols, func_index, task->state_var, task_resume_points);
+    IROp op = {0};
+    op.opcode = ir_return;
+    op.arg1.type = irv_immediate;
+    op.arg1.immediate_value = 0;
+    add_function_ir(symbols, func_index, op);
+    set_next_ir_label(task_resume_label + task_resume_points - 1);
+}
+// Returns the static that tells the main loop not to sleep, adding it the first time. A
+// yield sets it, and so do SysTick and the handlers that tasks await.
+int tasks_runnable_static_var(SymbolTable *symbols) {
+    StringRef runnable_name = {"____tasks_runnable", 18};
+    int var_index = find_static_variable(symbols, &runnable_name);
+    if (var_index == -1) {
+        var_index = hidden_static_var(symbols, runnable_name.str, int_u8, 0);
+    }
+    return var_index;
+}
+// parse a yield in a task, e.g. "yield;", which lets the other tasks run before this one
+// carries on. The task is still runnable, so the main loop goes around again rather than
+// sleeping until an interrupt.
+int function_statement_yield(Token *tokens, int next_token, SymbolTable *symbols, int func_index, int indent) {
+    PARSE_TREE_INDENT(indent); indent++; PARSE_TREE_PRINT("- Yield:\n");
+    next_token = match(t_yield, tokens, next_token, indent);
+    next_token = match(t_semicolon, tokens, next_token, indent);
+    Task *task = current_task(symbols, func_index, "yield");
+    immediate_to_static(symbols, func_index, tasks_runnable_static_var(symbols), 1);
+    task_suspend(symbols, func_index, task);
+    return next_token;
+}
+// Returns the static that SysTick counts ticks in, adding it the first time
+int ticks_static_var(SymbolTable *symbols) {
+    StringRef ticks_name = {"____ticks", 9};
+    int var_index = find_static_variable(symbols, &ticks_name);
+    if (var_index == -1) {
+        var_index = hidden_static_var(symbols, ticks_name.str, int_u32, 0);
+    }
+    return var_index;
+}
+// parse a sleep in a task, e.g. "sleep_ticks(100);", which stops the task until at least
+// that many SysTick ticks have gone by. It works out to:
+//      tN = ticks to sleep
+//      tN+1 = ticks
+//      tN = tN + tN+1
+//      wait = tN
+//      (stop the task)
+//      t0 = ticks
+//      t1 = wait
+//      t0 = t0 - t1
+//      t0 = t0 < 0
+//      if t0 goto end (it is still asleep)
+// The tick count wraps around, so the (signed) difference is checked rather than the counts.
+int function_statement_sleep_ticks(Token *tokens, int next_token, SymbolTable *symbols, int func_index, int indent) {
+    PARSE_TREE_INDENT(indent); indent++; PARSE_TREE_PRINT("- SleepTicks:\n");
+    Task *task = current_task(symbols, func_index, "sleep_ticks");
+    StringRef keyword;
+    next_token = match_id(tokens, next_token, &keyword, indent);
+    next_token = match(t_leftparen, tokens, next_token, indent);
+    int temp = 0;
+    next_token = expression(tokens, next_token, symbols, func_index, &temp, indent);
+    next_token = match(t_rightparen, tokens, next_token, indent);
+    next_token = match(t_semicolon, tokens, next_token, indent);
+
+    int ticks_var = ticks_static_var(symbols);
+    static_to_temp(symbols, func_index, temp + 1, ticks_var);
+    IROp op = {0};
+    op.opcode = ir_add;
+    op.result.type = irv_temp;
+    op.result.temp_num = temp;
+    op.arg1 = op.result;
+    op.arg2.type = irv_temp;
+    op.arg2.temp_num = temp + 1;
+    add_function_ir(symbols, func_index, op);
+    temp_to_static(symbols, func_index, task->wait_var, temp);
+    task_suspend(symbols, func_index, task);
+
+    static_to_temp(symbols, func_index, 0, ticks_var);
+    static_to_temp(symbols, func_index, 1, task->wait_var);
+    op.opcode = ir_subtract;
+    op.result.temp_num = 0;
+    op.arg1 = op.result;
+    op.arg2.temp_num = 1;
+    add_function_ir(symbols, func_index, op);
+    temp_op_immediate(symbols, func_index, ir_less_than, 0, 0);
+    memset(&op, 0, sizeof(IROp));
+    op.opcode = ir_if;
+    op.arg1.type = irv_temp;
+    op.arg1.temp_num = 0;
+    op.target_label = task_end_label;
+    add_function_ir(symbols, func_index, op);
+    return next_token;
+}
+// parse waiting for an interrupt in a task, e.g. "await_irq(RTCMode0);", which stops the
+// task until the peripheral's on_interrupt handler has run again. The handler counts how
+// many times it has run, so it works out to:
+//      t0 = count
+//      wait = t0
+//      (stop the task)
+//      t0 = count
+//      t1 = wait
+//      t0 = t0 == t1
+//      if t0 goto end (the handler hasn't run yet)
+int function_statement_await_irq(Token *tokens, int next_token, SymbolTable *symbols, int func_index, int indent) {
+    PARSE_TREE_INDENT(indent); indent++; PARSE_TREE_PRINT("- AwaitIrq:\n");
+    Task *task = current_task(symbols, func_index, "await_irq");
+    StringRef keyword;
+    next_token = match_id(tokens, next_token, &keyword, indent);
+    next_token = match(t_leftparen, tokens, next_token, indent);
+    StringRef mmp_name;
+    next_token = match_id(tokens, next_token, &mmp_name, indent);
+    next_token = match(t_rightparen, tokens, next_token, indent);
+    next_token = match(t_semicolon, tokens, next_token, indent);
+
+    STRINGREF_TO_CSTR1(&mmp_name, 512);
+    int mmp_index = find_mmp_index(symbols, &mmp_name);
+    if (mmp_index == -1) {
+        PANIC("MemoryMappedPeripheral '%s' does not exist\n", cstr1);
+    }
+    InterruptHandler *handler = NULL;
+    for (int i = 0; i < symbols->interrupt_handlers_num; i++) {
+        if (symbols->interrupt_handlers[i].interrupt_number == symbols->mmps[mmp_index].interrupt_number) {
+            handler = &symbols->interrupt_handlers[i];
+        }
+    }
+    if (symbols->mmps[mmp_index].interrupt_number == -1 || handler == NULL) {
+        PANIC("await_irq(%s) needs an on_interrupt handler for '%s' before the task\n", cstr1, cstr1);
+    }
+    if (handler->count_var == -1) {
+        handler->count_var = hidden_static_var(symbols, "____irq_count", int_u32, 0);
+    }
+
+    static_to_temp(symbols, func_index, 0, handler->count_var);
+    temp_to_static(symbols, func_index, task->wait_var, 0);
+    task_suspend(symbols, func_index, task);
+
+    static_to_temp(symbols, func_index, 0, handler->count_var);
+    static_to_temp(symbols, func_index, 1, task->wait_var);
+    IROp op = {0};
+    op.opcode = ir_equals;
+    op.result.type = irv_temp;
+    op.result.temp_num = 0;
+    op.arg1 = op.result;
+    op.arg2.type = irv_temp;
+    op.arg2.temp_num = 1;
+    add_function_ir(symbols, func_index, op);
+    memset(&op, 0, sizeof(IROp));
+    op.opcode = ir_if;
+    op.arg1.type = irv_temp;
+    op.arg1.temp_num = 0;
+    op.target_label = task_end_label;
+    add_function_ir(symbols, func_index, op);
+    return next_token;
+}
 // parse any function statement, lookahead at next token to determine which kind of statement it will be
 int function_statement(Token *tokens, int next_token, SymbolTable *symbols, int func_index, int indent) {
     switch (tokens[next_token].type) {
@@ -835,7 +2542,25 @@ int function_statement(Token *tokens, int next_token, SymbolTable *symbols, int
             return function_statement_local_var(tokens, next_token, symbols, func_index, indent);
         case t_if:
             return function_statement_if(tokens, next_token, symbols, func_index, indent);
+        case t_match:
+            return function_statement_match(tokens, next_token, symbols, func_index, indent);
+        case t_asm:
+            return function_statement_asm(tokens, next_token, symbols, func_index, indent);
+        case t_atomic:
+            return function_statement_atomic(tokens, next_token, symbols, func_index, indent);
+        case t_defer:
+            return function_statement_defer(tokens, next_token, symbols, func_index, indent);
+        case t_yield:
+            return function_statement_yield(tokens, next_token, symbols, func_index, indent);
         case t_id:
+            if (tokens[next_token+1].type == t_leftparen && find_task(symbols, func_index) != -1) {
+                if (id_is_keyword(&tokens[next_token].lexeme, "sleep_ticks")) {
+                    return function_statement_sleep_ticks(tokens, next_token, symbols, func_index, indent);
+                }
+                if (id_is_keyword(&tokens[next_token].lexeme, "await_irq")) {
+                    return function_statement_await_irq(tokens, next_token, symbols, func_index, indent);
+                }
+            }
             if (tokens[next_token+1].type == t_leftparen) {
                 next_token = function_call(tokens, next_token, symbols, func_index, indent);
                 next_token = match(t_semicolon, tokens, next_token, indent);
@@ -914,8 +2639,9 @@ int function(Token *tokens, int next_token, SymbolTable *symbols, int indent) {
     next_token = match(t_rightbrace, tokens, next_token, indent);
 
 
-    if (symbols->ir_code[func_ref->ir_code_index + (func_ref->ir_code_len - 1)].opcode != ir_return) {
+    if (symbols->ir_code[func_ref->ir_code_index + (func_ref->ir_code_len - 1)].opcode != ir_return || ir_label_pending()) {
         // if there was no final return, add one
+        // (a statement that ends after a return still needs an op for its label)
         IROp op = {0};
         op.opcode = ir_return;
         op.arg1.type = irv_immediate;
@@ -926,34 +2652,177 @@ int function(Token *tokens, int next_token, SymbolTable *symbols, int indent) {
     return next_token;
 }
 
+// Adds a static variable that the compiler uses itself, e.g. for the queues of "defer".
+// Like any static without an initial value, it starts at 0.
+int hidden_static_var(SymbolTable *symbols, char *name, IntType int_type, int array_len) {
+    Variable var = {0};
+    var.name.str = name;
+    var.name.len = strlen(name);
+    var.int_type = int_type;
+    var.array_len = array_len;
+    return add_static_variable(symbols, var);
+}
+
 // parse a static (global) variable, e.g "static u32 global = 45;"
 // put the variable in the symbol table
-// assign it an address
-static int next_static_var_address = RAM_BASE_ADDRESS;
-
+// it is given an address once the whole program is parsed, see layout_static_vars
 int static_var(Token *tokens, int next_token, SymbolTable *symbols, int indent) {
     PARSE_TREE_INDENT(indent); indent++; PARSE_TREE_PRINT("- StaticVariable:\n");
     Variable var;
 
+    var.is_const = false;
     next_token = match(t_static, tokens, next_token, indent);
     next_token = match_inttype(tokens, next_token, &var.int_type, indent);
     next_token = match_id(tokens, next_token, &var.name, indent);
+    next_token = variable_opt_array_len(tokens, next_token, symbols, &var.array_len, indent);
     next_token = match(t_equals, tokens, next_token, indent);
-    next_token = match_intliteral(tokens, next_token, &var.initial_value, indent);
+    next_token = match_constant(tokens, next_token, symbols, &var.initial_value, indent);
     next_token = match(t_semicolon, tokens, next_token, indent);
 
-    var.address = next_static_var_address;
-    next_static_var_address += 4;
+    add_static_variable(symbols, var);
+    return next_token;
+}
 
-    int index = add_static_variable(symbols, var);
+// parse a const, either a compile-time constant, e.g. "const u32 ENABLE = 1 << 1;",
+// or a const array, e.g. "const u8 gamma[4] = {0, 2, 9, 22};"
+// put the variable in the symbol table and its values in the const data,
+// which the linker puts in flash right after the vector table, so it never takes up RAM
+// elements that aren't given a value are 0
+int const_var(Token *tokens, int next_token, SymbolTable *symbols, int indent) {
+    PARSE_TREE_INDENT(indent); indent++; PARSE_TREE_PRINT("- ConstVariable:\n");
+    Variable var;
+    var.is_const = true;
+    var.initial_value = 0;
 
-    IROp op = {0};
-    op.opcode = ir_copy;
-    op.result.type = irv_static_variable;
-    op.result.static_variable_index = index;
-    op.arg1.type = irv_immediate;
-    op.arg1.immediate_value = var.initial_value;
-    add_function_ir(symbols, INIT_FUNC_INDEX, op);
+    next_token = match(t_const, tokens, next_token, indent);
+    next_token = match_inttype(tokens, next_token, &var.int_type, indent);
+    next_token = match_id(tokens, next_token, &var.name, indent);
+    next_token = variable_opt_array_len(tokens, next_token, symbols, &var.array_len, indent);
+    STRINGREF_TO_CSTR1(&var.name, 512);
+    if (find_constant(symbols, &var.name) != -1 || find_const_function(symbols, &var.name) != -1) {
+        PANIC("There is already a constant called '%s'\n", cstr1);
+    }
+    if (var.array_len == 0) {
+        // a single value is a compile-time constant, which takes up no memory at all
+        Constant constant;
+        constant.name = var.name;
+        next_token = match(t_equals, tokens, next_token, indent);
+        next_token = match_constant(tokens, next_token, symbols, &constant.value, indent);
+        next_token = match(t_semicolon, tokens, next_token, indent);
+        int size = int_type_size(var.int_type);
+        if (size < 4 && ((uint32_t)constant.value >> (size * 8)) != 0) {
+            PANIC("Value 0x%x is too big for const '%s'\n", constant.value, cstr1);
+        }
+        add_constant(symbols, constant);
+        return next_token;
+    }
+
+    // every const array starts on a word boundary
+    int start = ((symbols->const_data_len + 3) / 4) * 4;
+    int end = start + variable_size(&var);
+    if (end > MAX_CONST_DATA) {
+        PANIC("Too much const data: maximum is %d bytes\n", MAX_CONST_DATA);
+    }
+    memset(&symbols->const_data[symbols->const_data_len], 0, end - symbols->const_data_len);
+    int size = int_type_size(var.int_type);
+
+    next_token = match(t_equals, tokens, next_token, indent);
+    next_token = match(t_leftbrace, tokens, next_token, indent);
+    int count = 0;
+    while (tokens[next_token].type != t_rightbrace) {
+        int value = 0;
+        next_token = match_constant(tokens, next_token, symbols, &value, indent);
+        if (count == var.array_len) {
+            PANIC("Too many values for const '%s', it has %d elements\n", cstr1, var.array_len);
+        }
+        if (size < 4 && ((uint32_t)value >> (size * 8)) != 0) {
+            PANIC("Value 0x%x is too big for an element of const '%s'\n", value, cstr1);
+        }
+        for (int i = 0; i < size; i++) {
+            symbols->const_data[start + count * size + i] = (uint8_t)((uint32_t)value >> (8 * i));
+        }
+        count++;
+        if (tokens[next_token].type != t_rightbrace) {
+            next_token = match(t_comma, tokens, next_token, indent);
+        }
+    }
+    next_token = match(t_rightbrace, tokens, next_token, indent);
+    next_token = match(t_semicolon, tokens, next_token, indent);
+
+    var.address = VECTOR_TABLE_SIZE + start;
+    symbols->const_data_len = end;
+    add_static_variable(symbols, var);
+    return next_token;
+}
+
+// parse a constexpr function, e.g. "constexpr fun bit(n: u32): u32 { return 1 << n; }"
+// the body is a single return of a constant expression, which can use the arguments
+// it's evaluated wherever the function is called, so it has no machine code
+int const_function(Token *tokens, int next_token, SymbolTable *symbols, int indent) {
+    PARSE_TREE_INDENT(indent); indent++; PARSE_TREE_PRINT("- ConstFunction:\n");
+    ConstFunction cf;
+    cf.func_args_index = symbols->func_args_num;
+    cf.func_args_len = 0;
+
+    next_token = match(t_constexpr, tokens, next_token, indent);
+    next_token = match(t_fun, tokens, next_token, indent);
+    next_token = match_id(tokens, next_token, &cf.name, indent);
+    STRINGREF_TO_CSTR1(&cf.name, 512);
+    if (find_constant(symbols, &cf.name) != -1 || find_const_function(symbols, &cf.name) != -1) {
+        PANIC("There is already a constant called '%s'\n", cstr1);
+    }
+    next_token = match(t_leftparen, tokens, next_token, indent);
+    while (tokens[next_token].type != t_rightparen) {
+        // any number of args
+        FunctionArg fa;
+        next_token = function_argument(tokens, next_token, &fa, indent);
+        add_function_arg(symbols, fa);
+        cf.func_args_len++;
+
+        if (tokens[next_token].type == t_rightparen) {
+            break;
+        }
+        next_token = match(t_comma, tokens, next_token, indent);
+    }
+    if (cf.func_args_len > MAX_CONST_FUNCTION_ARGS) {
+        PANIC("Too many arguments to constexpr function '%s': maximum is %d\n", cstr1, MAX_CONST_FUNCTION_ARGS);
+    }
+    next_token = match(t_rightparen, tokens, next_token, indent);
+    IntType return_type;
+    next_token = match(t_colon, tokens, next_token, indent);
+    next_token = match_inttype(tokens, next_token, &return_type, indent);
+
+    next_token = match(t_leftbrace, tokens, next_token, indent);
+    next_token = match(t_return, tokens, next_token, indent);
+    cf.body_token = next_token;
+    int cf_index = add_const_function(symbols, cf);
+
+    // evaluate the body once with every argument 0, to check that it is a constant
+    // expression and find where it ends
+    ConstScope scope = {0};
+    scope.const_func_index = cf_index;
+    int value = 0;
+    int end = const_expression(tokens, next_token, symbols, &scope, &value);
+    print_constant_tokens(tokens, next_token, end, indent);
+    next_token = match(t_semicolon, tokens, end, indent);
+    next_token = match(t_rightbrace, tokens, next_token, indent);
+    return next_token;
+}
+
+// parse the priority of an interrupt handler, e.g. "priority 1", putting it into dest
+// dest is set to -1 if there is no priority
+int on_interrupt_opt_priority(Token *tokens, int next_token, SymbolTable *symbols, int *dest, int indent) {
+    StringRef *keyword = &tokens[next_token].lexeme;
+    if (tokens[next_token].type != t_id || keyword->len != 8 || strncmp(keyword->str, "priority", 8) != 0) {
+        *dest = -1;
+        return next_token;
+    }
+    PARSE_TREE_INDENT(indent); indent++; PARSE_TREE_PRINT("- Priority:\n");
+    next_token = match(t_id, tokens, next_token, indent);
+    next_token = match_constant(tokens, next_token, symbols, dest, indent);
+    if (*dest < 0 || *dest > MAX_INTERRUPT_PRIORITY) {
+        PANIC("Interrupt priority must be from 0 to %d but is %d\n", MAX_INTERRUPT_PRIORITY, *dest);
+    }
     return next_token;
 }
 
@@ -978,6 +2847,8 @@ int on_interrupt(Token *tokens, int next_token, SymbolTable *symbols, int indent
 
     InterruptHandler handler;
     handler.interrupt_number = symbols->mmps[mmp_index].interrupt_number;
+    handler.count_var = -1;
+    next_token = on_interrupt_opt_priority(tokens, next_token, symbols, &handler.priority, indent);
 
     Function func;
     func.func_args_index = -1;
@@ -1011,6 +2882,114 @@ int on_interrupt(Token *tokens, int next_token, SymbolTable *symbols, int indent
     return next_token;
 }
 
+// Counts the resume points ("yield", "sleep_ticks" and "await_irq") in the body of a
+// task, which starts at next_token with a "{"
+int count_task_resume_points(Token *tokens, int next_token) {
+    int depth = 0;
+    int points = 0;
+    do {
+        Token *token = &tokens[next_token];
+        if (token->type == t_leftbrace) {
+            depth++;
+        } else if (token->type == t_rightbrace) {
+            depth--;
+        } else if (token->type == t_yield) {
+            points++;
+        } else if (token->type == t_id && tokens[next_token + 1].type == t_leftparen
+                && (id_is_keyword(&token->lexeme, "sleep_ticks") || id_is_keyword(&token->lexeme, "await_irq"))) {
+            points++;
+        }
+        next_token++;
+    } while (depth > 0 && tokens[next_token].type != t_NONE);
+    return points;
+}
+// parse a task, e.g. "task blink { ... }"
+// A task is a function without arguments that the main loop calls over and over. Each
+// "yield", "sleep_ticks" or "await_irq" in it is a resume point: the task puts its number
+// in the state and returns, and the next call jumps straight back to it. It works out to:
+//      t0 = state
+//      jump table t0: start, resume point 1, resume point 2, ... (or else end)
+//   start:
+//      (the statements)
+//      state = TASK_DONE
+//   end:
+//      return 0
+// The resume points are counted before the statements are parsed, so that the jump table
+// can go first.
+int task(Token *tokens, int next_token, SymbolTable *symbols, int indent) {
+    PARSE_TREE_INDENT(indent); indent++; PARSE_TREE_PRINT("- Task:\n");
+    next_token = match(t_task, tokens, next_token, indent);
+
+    Function func;
+    func.func_args_index = -1;
+    func.func_args_len = 0;
+    func.ir_code_index = -1;
+    func.ir_code_len = 0;
+    func.func_vars_index = -1;
+    func.func_vars_len = 0;
+    func.returns = false;
+    next_token = match_id(tokens, next_token, &func.name, indent);
+    if (find_function_index(symbols, &func.name) != -1) {
+        STRINGREF_TO_CSTR1(&func.name, 512);
+        PANIC("Function '%s' already exists\n", cstr1);
+    }
+    int func_index = add_function(symbols, func);
+
+    Task new_task;
+    new_task.func_index = func_index;
+    new_task.state_var = hidden_static_var(symbols, "____task_state", int_u8, 0);
+    new_task.wait_var = hidden_static_var(symbols, "____task_wait", int_u32, 0);
+    tasks_runnable_static_var(symbols);
+    Task *task_ref = &symbols->tasks[add_task(symbols, new_task)];
+
+    int resume_points = count_task_resume_points(tokens, next_token);
+    task_resume_label = label;
+    task_resume_points = 0;
+    label += resume_points;
+    int start_label = label;
+    label++;
+    task_end_label = label;
+    label++;
+
+    static_to_temp(symbols, func_index, 0, task_ref->state_var);
+    IROp op = {0};
+    op.opcode = ir_jump_table;
+    op.arg1.type = irv_temp;
+    op.arg1.temp_num = 0;
+    op.arg2.type = irv_immediate;
+    op.arg2.immediate_value = resume_points + 1;
+    op.target_label = task_end_label;
+    add_function_ir(symbols, func_index, op);
+    memset(&op, 0, sizeof(IROp));
+    op.opcode = ir_jump_table_entry;
+    op.target_label = start_label;
+    add_function_ir(symbols, func_index, op);
+    for (int i = 0; i < resume_points; i++) {
+        op.target_label = task_resume_label + i;
+        add_function_ir(symbols, func_index, op);
+    }
+    set_next_ir_label(start_label);
+
+    next_token = match(t_leftbrace, tokens, next_token, indent);
+    while (tokens[next_token].type != t_rightbrace) {
+        // any number of function statements
+        next_token = function_statement(tokens, next_token, symbols, func_index, indent);
+    }
+    next_token = match(t_rightbrace, tokens, next_token, indent);
+    if (task_resume_points != resume_points) {
+        PANIC("yield, sleep_ticks and await_irq can only be used as statements\n");
+    }
+
+    immediate_to_static(symbols, func_index, task_ref->state_var, TASK_DONE);
+    set_next_ir_label(task_end_label);
+    memset(&op, 0, sizeof(IROp));
+    op.opcode = ir_return;
+    op.arg1.type = irv_immediate;
+    op.arg1.immediate_value = 0;
+    add_function_ir(symbols, func_index, op);
+    return next_token;
+}
+
 // parse any top-level statement, lookahead at next token to determine which kind of statement it will be
 int root_statement(Token *tokens, int next_token, SymbolTable *symbols) {
     switch (tokens[next_token].type) {
@@ -1022,13 +3001,109 @@ int root_statement(Token *tokens, int next_token, SymbolTable *symbols) {
             return function(tokens, next_token, symbols, 0);
         case t_static:
             return static_var(tokens, next_token, symbols, 0);
+        case t_const:
+            return const_var(tokens, next_token, symbols, 0);
+        case t_constexpr:
+            return const_function(tokens, next_token, symbols, 0);
         case t_on_interrupt:
             return on_interrupt(tokens, next_token, symbols, 0);
+        case t_task:
+            return task(tokens, next_token, symbols, 0);
         default:
             PANIC("invalid token at beginning of root statement\n");
     }
 }
 
+// Places the statics of one section, .data (the ones with an initial value) or .bss,
+// that are arrays (or not) with elements of the given size, starting at address.
+// Returns the address after the last one.
+int layout_static_group(SymbolTable *symbols, bool data, bool arrays, int size, int address) {
+    for (int i = 0; i < symbols->static_vars_num; i++) {
+        Variable *var = &symbols->static_vars[i];
+        if (var->is_const || (var->initial_value != 0) != data
+                || (var->array_len > 0) != arrays || int_type_size(var->int_type) != size) {
+            continue;
+        }
+        var->address = address;
+        address += variable_size(var);
+    }
+    return address;
+}
+// Places the statics of one section starting at address, and returns the end of it,
+// rounded up to a word so it can be copied or zeroed a word at a time.
+// The u32 statics go first, then the u16 ones and then the u8 ones, so each is naturally
+// aligned without any padding between them. With --gp a static is loaded with an
+// immediate offset from R_GP, which can only be up to 31 times its size, so the single
+// values go first instead, smallest first. Arrays are reached through a register either
+// way, so they go after them.
+int layout_static_section(SymbolTable *symbols, bool data, int address) {
+    if (options.gp) {
+        for (int size = 1; size <= 4; size *= 2) {
+            address = ((address + size - 1) / size) * size;
+            address = layout_static_group(symbols, data, false, size, address);
+        }
+        for (int size = 4; size > 0; size /= 2) {
+            address = layout_static_group(symbols, data, true, size, address);
+        }
+    } else {
+        for (int size = 4; size > 0; size /= 2) {
+            address = layout_static_group(symbols, data, false, size, address);
+            address = layout_static_group(symbols, data, true, size, address);
+        }
+    }
+    return ((address + 3) / 4) * 4;
+}
+
+// Gives every static in RAM its address, once all of them are known. .data comes
+// first and .bss after it, except with --gp, where .bss comes first since that is where
+// the statics that interrupt handlers share usually are. The initial values of .data are
+// put in the const data, so ____init can copy all of .data with one loop and zero all of
+// .bss with another, instead of storing to each static.
+void layout_static_vars(SymbolTable *symbols) {
+    int end_address;
+    if (options.gp) {
+        symbols->bss_address = RAM_BASE_ADDRESS;
+        symbols->data_address = layout_static_section(symbols, false, symbols->bss_address);
+        end_address = layout_static_section(symbols, true, symbols->data_address);
+        symbols->bss_len = symbols->data_address - symbols->bss_address;
+        symbols->data_len = end_address - symbols->data_address;
+    } else {
+        symbols->data_address = RAM_BASE_ADDRESS;
+        symbols->bss_address = layout_static_section(symbols, true, symbols->data_address);
+        end_address = layout_static_section(symbols, false, symbols->bss_address);
+        symbols->data_len = symbols->bss_address - symbols->data_address;
+        symbols->bss_len = end_address - symbols->bss_address;
+    }
+    if (end_address > RAM_END_ADDRESS) {
+        PANIC("Too many statics: they need %d bytes of RAM\n", end_address - RAM_BASE_ADDRESS);
+    }
+    if (symbols->data_len == 0) {
+        return;
+    }
+
+    int image = ((symbols->const_data_len + 3) / 4) * 4;
+    if (image + symbols->data_len > MAX_CONST_DATA) {
+        PANIC("Too much const data: maximum is %d bytes\n", MAX_CONST_DATA);
+    }
+    memset(&symbols->const_data[symbols->const_data_len], 0, image + symbols->data_len - symbols->const_data_len);
+    for (int i = 0; i < symbols->static_vars_num; i++) {
+        Variable *var = &symbols->static_vars[i];
+        if (var->is_const || var->initial_value == 0) {
+            continue;
+        }
+        uint8_t *value = &symbols->const_data[image + var->address - symbols->data_address];
+        int size = int_type_size(var->int_type);
+        int count = var->array_len > 0 ? var->array_len : 1;
+        for (int j = 0; j < count; j++) {
+            for (int k = 0; k < size; k++) {
+                value[j * size + k] = (uint8_t)((uint32_t)var->initial_value >> (8 * k));
+            }
+        }
+    }
+    symbols->data_image = image;
+    symbols->const_data_len = image + symbols->data_len;
+}
+
 // The entry-point for the parser
 // calls root_statement until all tokens are parsed.
 void parse(Token *tokens, int token_num, SymbolTable *symbols) {
@@ -1051,4 +3126,5 @@ void parse(Token *tokens, int token_num, SymbolTable *symbols) {
     while (next_token < token_num) {
         next_token = root_statement(tokens, next_token, symbols);
     }
+    layout_static_vars(symbols);
 }
\ No newline at end of file
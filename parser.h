@@ -14,6 +14,32 @@
 #define INIT_FUNC_INDEX 0
 
 #define RAM_BASE_ADDRESS 0x20000000
+// the SAMD21J18 has 32KB of SRAM, and the stack starts at the top of it
+#define RAM_END_ADDRESS 0x20008000
+
+// A match with at most this many values compares against each of them in turn. One with
+// more uses a jump table if it would have fewer than MATCH_JUMP_TABLE_DENSITY entries
+// per value (and fewer than MAX_JUMP_TABLE_ENTRIES), otherwise a binary search.
+#define MATCH_CHAIN_MAX_CASES 3
+#define MATCH_JUMP_TABLE_DENSITY 3
+#define MAX_JUMP_TABLE_ENTRIES 256
+#define MAX_MATCH_CASES 256
+
+// Constant expressions have four levels of binary operators (+ -, & | ^, << >>, * / %)
+#define CONST_OPERATOR_LEVELS 4
+#define MAX_CONST_FUNCTION_ARGS 8
+// constexpr functions can call each other, but can't call themselves, since there is
+// nothing that would stop it. This catches that.
+#define MAX_CONSTEXPR_DEPTH 32
+
+// Temps are kept in registers from R_TEMP_FIRST, so this many variables can be bound to an
+// asm block, less the temp registers it clobbers
+#define R_TEMP_FIRST 2
+#define MAX_ASM_OPERANDS 6
+#define MAX_ASM_LABELS 64
+
+// The NVIC of the Cortex-M0+ has four priority levels, 0 (the highest) to 3
+#define MAX_INTERRUPT_PRIORITY 3
 
 void parse(Token *tokens, int token_num, SymbolTable *symbols);
 
@@ -42,14 +42,76 @@ int add_function_variable(SymbolTable *symbols, Variable item) {
   symbols->function_vars[symbols->function_vars_num] = item;
   return symbols->function_vars_num++;
 }
+int add_constant(SymbolTable *symbols, Constant item) {
+  symbols->constants[symbols->constants_num] = item;
+  return symbols->constants_num++;
+}
+int add_const_function(SymbolTable *symbols, ConstFunction item) {
+  symbols->const_functions[symbols->const_functions_num] = item;
+  return symbols->const_functions_num++;
+}
+int add_defer_queue(SymbolTable *symbols, DeferQueue item) {
+  if (symbols->defer_queues_num == 64) {
+    PANIC("Too many deferred functions: maximum is %d\n", 64);
+  }
+  symbols->defer_queues[symbols->defer_queues_num] = item;
+  return symbols->defer_queues_num++;
+}
+int add_task(SymbolTable *symbols, Task item) {
+  if (symbols->tasks_num == 64) {
+    PANIC("Too many tasks: maximum is %d\n", 64);
+  }
+  symbols->tasks[symbols->tasks_num] = item;
+  return symbols->tasks_num++;
+}
+int add_asm_block(SymbolTable *symbols, AsmBlock item) {
+  if (symbols->asm_blocks_num == 256) {
+    PANIC("Too many asm blocks: maximum is %d\n", 256);
+  }
+  symbols->asm_blocks[symbols->asm_blocks_num] = item;
+  return symbols->asm_blocks_num++;
+}
+int add_asm_instruction(SymbolTable *symbols, AsmInstruction item) {
+  if (symbols->asm_instructions_num == 4096) {
+    PANIC("Too many asm instructions: maximum is %d\n", 4096);
+  }
+  symbols->asm_instructions[symbols->asm_instructions_num] = item;
+  return symbols->asm_instructions_num++;
+}
 
 static int next_ir_label = 0;
+// Labels that were still waiting for an op when another label was set, e.g. the ends of
+// an inner and an outer if. They all end up on the same op, so branches to them are
+// pointed at the label that op gets.
+static int merged_ir_labels[64];
+static int merged_ir_labels_num = 0;
 void set_next_ir_label(int label) {
+    if (next_ir_label != 0) {
+        if (merged_ir_labels_num == 64) {
+            PANIC("Too many statements end in the same place\n");
+        }
+        merged_ir_labels[merged_ir_labels_num++] = next_ir_label;
+    }
     next_ir_label = label;
 }
+bool ir_label_pending() {
+    return next_ir_label != 0;
+}
 int add_function_ir(SymbolTable *symbols, int func_index, IROp item) {
   if (next_ir_label != 0) {
     item.label = next_ir_label;
+    Function *func = &symbols->functions[func_index];
+    for (int m = 0; m < merged_ir_labels_num; m++) {
+      for (int i = func->ir_code_index; i != -1 && i < func->ir_code_index + func->ir_code_len; i++) {
+        if (symbols->ir_code[i].target_label == merged_ir_labels[m]) {
+          symbols->ir_code[i].target_label = next_ir_label;
+        }
+      }
+      if (item.target_label == merged_ir_labels[m]) {
+        item.target_label = next_ir_label;
+      }
+    }
+    merged_ir_labels_num = 0;
     next_ir_label = 0;
   }
   symbols->ir_code[symbols->ir_len] = item;
@@ -61,6 +123,23 @@ int add_function_ir(SymbolTable *symbols, int func_index, IROp item) {
   symbols->functions[func_index].ir_code_len++;
   return index;
 }
+// Replaces all of a function's IR with the given ops.
+// If the new code fits in the function's current range it is written in place,
+// otherwise it is appended to the end of ir_code and the old range is abandoned.
+void set_function_ir(SymbolTable *symbols, int func_index, IROp *ops, int len) {
+  Function *func = &symbols->functions[func_index];
+  if (len > func->ir_code_len || func->ir_code_index == -1) {
+    if (symbols->ir_len + len > MAX_IR_CODE) {
+      PANIC("Too much IR code: maximum is %d ops\n", MAX_IR_CODE);
+    }
+    func->ir_code_index = symbols->ir_len;
+    symbols->ir_len += len;
+  }
+  for (int i = 0; i < len; i++) {
+    symbols->ir_code[func->ir_code_index + i] = ops[i];
+  }
+  func->ir_code_len = len;
+}
 
 // These are helpers to find items by name (StringRef) in each of the arrays in the SymbolTable
 // They all return -1 if an item with the given name cannot be found
@@ -158,8 +237,58 @@ int find_static_variable(SymbolTable *symbols, StringRef *name) {
     }
     return -1;
 }
+int find_constant(SymbolTable *symbols, StringRef *name) {
+    for (int i = 0; i < symbols->constants_num; i++) {
+        if (string_ref_eq(name, &symbols->constants[i].name)) {
+            return i;
+        }
+    }
+    return -1;
+}
+int find_const_function(SymbolTable *symbols, StringRef *name) {
+    for (int i = 0; i < symbols->const_functions_num; i++) {
+        if (string_ref_eq(name, &symbols->const_functions[i].name)) {
+            return i;
+        }
+    }
+    return -1;
+}
+int find_defer_queue(SymbolTable *symbols, int handler_func_index, int func_index) {
+    for (int i = 0; i < symbols->defer_queues_num; i++) {
+        DeferQueue *queue = &symbols->defer_queues[i];
+        if (queue->handler_func_index == handler_func_index && queue->func_index == func_index) {
+            return i;
+        }
+    }
+    return -1;
+}
+int find_task(SymbolTable *symbols, int func_index) {
+    for (int i = 0; i < symbols->tasks_num; i++) {
+        if (symbols->tasks[i].func_index == func_index) {
+            return i;
+        }
+    }
+    return -1;
+}
 
 
+// Returns the size of an IntType in bytes
+int int_type_size(IntType int_type) {
+    switch (int_type) {
+        case int_u8: return 1;
+        case int_u16: return 2;
+        case int_u32: return 4;
+        default: PANIC("INVALID INT TYPE: %d\n", int_type);
+    }
+}
+// Returns how many bytes a variable takes up in memory, including all elements of an array
+int variable_size(Variable *var) {
+    if (var->array_len > 0) {
+        return int_type_size(var->int_type) * var->array_len;
+    }
+    return int_type_size(var->int_type);
+}
+
 void print_ir_value(SymbolTable *symbols, IRValue *value) {
     switch (value->type) {
         case irv_function: {
@@ -198,6 +327,12 @@ void print_ir_value(SymbolTable *symbols, IRValue *value) {
         }
         default: PANIC("UNIDENTIFIED IR VALUE: %d\n", value->type);
     }
+    if (value->offset_in_temp) {
+        printf("[temp%d]", value->offset_temp_num);
+    }
+    if (value->address_in_temp) {
+        printf(" [temp%d]", value->address_temp_num);
+    }
 }
 void print_irop(SymbolTable *symbols, int irop_index) {
     IROp *op = &symbols->ir_code[irop_index];
@@ -247,6 +382,46 @@ void print_irop(SymbolTable *symbols, int irop_index) {
             print_ir_value(symbols, &op->arg2);
             printf("\n");
             break;
+        case ir_bitwise_or:
+            print_ir_value(symbols, &op->result);
+            printf(" = ");
+            print_ir_value(symbols, &op->arg1);
+            printf(" | ");
+            print_ir_value(symbols, &op->arg2);
+            printf("\n");
+            break;
+        case ir_bitwise_xor:
+            print_ir_value(symbols, &op->result);
+            printf(" = ");
+            print_ir_value(symbols, &op->arg1);
+            printf(" ^ ");
+            print_ir_value(symbols, &op->arg2);
+            printf("\n");
+            break;
+        case ir_multiply:
+            print_ir_value(symbols, &op->result);
+            printf(" = ");
+            print_ir_value(symbols, &op->arg1);
+            printf(" * ");
+            print_ir_value(symbols, &op->arg2);
+            printf("\n");
+            break;
+        case ir_divide:
+            print_ir_value(symbols, &op->result);
+            printf(" = ");
+            print_ir_value(symbols, &op->arg1);
+            printf(" / ");
+            print_ir_value(symbols, &op->arg2);
+            printf("\n");
+            break;
+        case ir_modulo:
+            print_ir_value(symbols, &op->result);
+            printf(" = ");
+            print_ir_value(symbols, &op->arg1);
+            printf(" %% ");
+            print_ir_value(symbols, &op->arg2);
+            printf("\n");
+            break;
         case ir_equals:
             print_ir_value(symbols, &op->result);
             printf(" = ");
@@ -285,6 +460,44 @@ void print_irop(SymbolTable *symbols, int irop_index) {
             print_ir_value(symbols, &op->arg1);
             printf(" != 0 then goto %d\n", op->target_label);
             break;
+        case ir_jump_table:
+            printf("jump table ");
+            print_ir_value(symbols, &op->arg1);
+            printf(" of ");
+            print_ir_value(symbols, &op->arg2);
+            printf(" else goto %d\n", op->target_label);
+            break;
+        case ir_jump_table_entry:
+            printf("    goto %d\n", op->target_label);
+            break;
+        case ir_asm: {
+            AsmBlock *block = &symbols->asm_blocks[op->arg1.immediate_value];
+            printf("asm (%d instructions)\n", block->instructions_len);
+            break;
+        }
+        case ir_atomic_begin:
+            printf("atomic begin, PRIMASK saved in ");
+            print_ir_value(symbols, &op->result);
+            printf("\n");
+            break;
+        case ir_atomic_end:
+            printf("atomic end, PRIMASK restored from ");
+            print_ir_value(symbols, &op->arg1);
+            printf("\n");
+            break;
+        case ir_intrinsic: {
+            Intrinsic *intrinsic = &intrinsics[op->arg2.immediate_value];
+            if (intrinsic->has_result) {
+                print_ir_value(symbols, &op->result);
+                printf(" = ");
+            }
+            printf("%s(", intrinsic->name);
+            if (intrinsic->args_num > 0) {
+                print_ir_value(symbols, &op->arg1);
+            }
+            printf(") (cycles: %d)\n", intrinsic->cycles);
+            break;
+        }
         case ir_param:
             printf("param ");
             print_ir_value(symbols, &op->arg1);
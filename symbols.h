@@ -1,6 +1,8 @@
 #ifndef SYMBOLS_H
 #define SYMBOLS_H
 
+#include <stdint.h>
+
 #include "common.h"
 #include "ir.h"
 
@@ -57,12 +59,19 @@ typedef enum {
 } StructItemType;
 
 // A struct representing one item in a MemoryMappedPeripheral struct. e.g. "field: u16;"
+// A write-synchronized register names the bit that is set while a write to it is still
+// being synchronized, e.g. "ctrl: u8 sync status.syncbusy;". sync_si_index and
+// sync_bfi_index are -1 if it isn't synchronized.
 typedef struct _StructItem {
     StructItemType type;
     StringRef name;
     IntType int_type;
     BitField bf;
     int address;
+    StringRef sync_reg_name;
+    StringRef sync_field_name;
+    int sync_si_index;
+    int sync_bfi_index;
 } StructItem;
 
 // A struct representing a MemoryMappedPeripheral.
@@ -80,7 +89,10 @@ typedef struct _Variable {
     StringRef name;
     IntType int_type;
     int initial_value;
+    int array_len; // number of elements for arrays, 0 for plain variables
+    bool is_const; // const arrays are kept in flash and can't be written
     int address; // used for static variables
+    int frame_offset; // used for local variables, offset from sp in bytes
 } Variable;
 
 // A struct representing one argument to a function
@@ -102,15 +114,117 @@ typedef struct _Function {
     IntType return_type;
     int ir_code_index;
     int ir_code_len;
+    int frame_size; // space for local variables on the stack, in words
 } Function;
 
 // A struct representing an interrupt handler
 // It references its function by an index into the array of Functions in the SymbolTable.
+// priority is -1 if the handler doesn't set one, so it keeps the default (0, the highest)
+// count_var is the index of a static that the handler adds one to each time it runs, for
+// tasks that "await_irq" it, or -1
 typedef struct _InterruptHandler {
     int interrupt_number;
     int func_index;
+    int priority;
+    int count_var;
 } InterruptHandler;
 
+// A struct representing a named compile-time constant, e.g. "const u32 ENABLE = 1 << 1;"
+// Uses of it are replaced with its value, so it never takes up RAM.
+typedef struct _Constant {
+    StringRef name;
+    int value;
+} Constant;
+
+// A struct representing a constexpr function, e.g.
+// "constexpr fun bit(n: u32): u32 { return 1 << n; }"
+// Its body is a single constant expression, which is evaluated by the parser wherever
+// the function is called. body_token is the index of the expression's first Token.
+// It references its arguments by indexes into the array of FunctionArgs in the SymbolTable.
+typedef struct _ConstFunction {
+    StringRef name;
+    int func_args_index;
+    int func_args_len;
+    int body_token;
+} ConstFunction;
+
+// The kinds of operands an instruction in an asm block can have
+typedef enum {
+    asm_register,
+    asm_immediate,
+    asm_label
+} AsmOperandType;
+
+// A struct representing one operand of an instruction in an asm block, e.g. "r2", "4" or
+// "loop". in_brackets is set for the operands of an address, e.g. "[r2, 4]".
+typedef struct _AsmOperand {
+    AsmOperandType type;
+    int value;
+    bool in_brackets;
+} AsmOperand;
+
+// A struct representing one instruction in an asm block, e.g. "ADDS r2, r2, r3;"
+// The variables bound to the block are already replaced with their registers.
+// label is non-zero if the instruction has a label in front of it.
+typedef struct _AsmInstruction {
+    StringRef mnemonic;
+    int label;
+    AsmOperand operands[3];
+    int operands_num;
+} AsmInstruction;
+
+// A struct representing an asm block.
+// It references its instructions by indexes into the array of AsmInstructions in the SymbolTable.
+// The masks have bit n set for temp n (input_temps) or register n (clobbers).
+typedef struct _AsmBlock {
+    int instructions_index;
+    int instructions_len;
+    int input_temps;
+    int clobbers;
+} AsmBlock;
+
+// A queue of calls to one function that one interrupt handler has deferred to the main
+// loop. The handler is the only one that adds to it and the main loop the only one that
+// takes from it, so neither has to mask interrupts.
+// It references its statics by indexes into the array of static Variables: the index of
+// the next entry to run (head), the index of the next free entry (tail), and the entries,
+// which hold the arguments of each call (-1 if the function has no arguments).
+typedef struct _DeferQueue {
+    int handler_func_index;
+    int func_index;
+    int head_var;
+    int tail_var;
+    int entries_var;
+} DeferQueue;
+// Each queue has room for this many calls. It is a power of two, so the indexes can wrap
+// around with an AND.
+#define DEFER_QUEUE_LEN 8
+#define MAX_DEFER_ARGS 4
+
+// A struct representing a task, e.g. "task blink { ... }". It is a function that the main
+// loop calls over and over, and each call carries on from where the last one stopped (at a
+// "yield", "sleep_ticks" or "await_irq"). Its local variables are statics, so they keep
+// their values while it is stopped.
+// It references its function by an index into the array of Functions, and its statics by
+// indexes into the array of static Variables: the point it carries on from (state), and
+// the tick or interrupt count it is waiting for (wait_var).
+typedef struct _Task {
+    int func_index;
+    int state_var;
+    int wait_var;
+} Task;
+// The state of a task that has run to the end. Other states are the index of the point to
+// carry on from, 0 being the start.
+#define TASK_DONE 0xFF
+
+#define MAX_IR_CODE 4096
+// The vector table takes up the start of flash. The data of const arrays follows it,
+// and then the code.
+#define VECTOR_TABLE_SIZE 0xB0
+#define MAX_CONST_DATA 8192
+// This is limited by the machine code, which has room for this many functions
+#define MAX_FUNCTIONS 64
+
 // All types of symbols are kept in flat arrays
 typedef struct _SymbolTable {
     MemoryMappedPeripheral mmps[1024];
@@ -134,8 +248,35 @@ typedef struct _SymbolTable {
     InterruptHandler interrupt_handlers[1024];
     int interrupt_handlers_num;
 
-    IROp ir_code[4096];
+    Constant constants[1024];
+    int constants_num;
+    ConstFunction const_functions[1024];
+    int const_functions_num;
+
+    DeferQueue defer_queues[64];
+    int defer_queues_num;
+    Task tasks[64];
+    int tasks_num;
+
+    AsmBlock asm_blocks[256];
+    int asm_blocks_num;
+    AsmInstruction asm_instructions[4096];
+    int asm_instructions_num;
+
+    IROp ir_code[MAX_IR_CODE];
     int ir_len;
+
+    // the contents of all const arrays, as they are laid out in flash
+    uint8_t const_data[MAX_CONST_DATA];
+    int const_data_len;
+
+    // where the statics in RAM go, see layout_static_vars
+    // data_image is the offset of the initial values of .data in the const data
+    int data_image;
+    int data_address;
+    int data_len;
+    int bss_address;
+    int bss_len;
 } SymbolTable;
 
 
@@ -150,9 +291,17 @@ int add_interrupt_handler(SymbolTable *symbols, InterruptHandler item);
 int add_function_arg(SymbolTable *symbols, FunctionArg item);
 int add_static_variable(SymbolTable *symbols, Variable item);
 int add_function_variable(SymbolTable *symbols, Variable item);
+int add_constant(SymbolTable *symbols, Constant item);
+int add_const_function(SymbolTable *symbols, ConstFunction item);
+int add_defer_queue(SymbolTable *symbols, DeferQueue item);
+int add_task(SymbolTable *symbols, Task item);
+int add_asm_block(SymbolTable *symbols, AsmBlock item);
+int add_asm_instruction(SymbolTable *symbols, AsmInstruction item);
 
 void set_next_ir_label(int label);
+bool ir_label_pending();
 int add_function_ir(SymbolTable *symbols, int func_index, IROp item);
+void set_function_ir(SymbolTable *symbols, int func_index, IROp *ops, int len);
 
 int find_mmp_index(SymbolTable *symbols, StringRef *name);
 int find_struct_item_index(SymbolTable *symbols, int mmp_index, StringRef *name);
@@ -162,6 +311,13 @@ int find_function_index(SymbolTable *symbols, StringRef *name);
 int find_function_arg(SymbolTable *symbols, int func_index, StringRef *name);
 int find_function_variable(SymbolTable *symbols, int func_index, StringRef *name);
 int find_static_variable(SymbolTable *symbols, StringRef *name);
+int find_constant(SymbolTable *symbols, StringRef *name);
+int find_const_function(SymbolTable *symbols, StringRef *name);
+int find_defer_queue(SymbolTable *symbols, int handler_func_index, int func_index);
+int find_task(SymbolTable *symbols, int func_index);
+
+int int_type_size(IntType int_type);
+int variable_size(Variable *var);
 
 void print_all_ir(SymbolTable *symbols);
 